@@ -11,40 +11,972 @@ asm.cpp
 #include <vector>
 #include <fstream>
 #include <bitset>
-#include <map>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <filesystem>
+#include <cstdio>
 
 using namespace std;
 
-/*Check if this line is a label or not based on the colon sign*/
-bool islabel(const string& line){
-    return line.find(':') != string::npos;
+/*Characters that separate tokens.*/
+bool isspace_char(char c){
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
 }
 
-/*Check if this line is a "fill" instruction or not.*/
-bool hasfill(const string& line){
-    string fill = ".fill";
-    return line.find(fill) != string::npos;
+/*Remove leading and trailing whitespace without copying the text.*/
+string_view trim(string_view text){
+    size_t start = 0;
+    while (start < text.size() && isspace_char(text[start]))
+        start++;
+    size_t end = text.size();
+    while (end > start && isspace_char(text[end - 1]))
+        end--;
+    return text.substr(start, end - start);
 }
 
+/*Operand layouts of the E20 instructions.*/
+enum Form {
+    FORM_REG3,      // add $dst, $srcA, $srcB
+    FORM_JR,        // jr $reg
+    FORM_REG2_IMM,  // addi $dst, $src, imm
+    FORM_MOVI,      // movi $dst, imm
+    FORM_MEM,       // lw $reg, imm($addr)
+    FORM_JUMP,      // j imm
+    FORM_JEQ,       // jeq $regA, $regB, imm
+    FORM_NONE       // nop
+};
+
+/*One entry of the opcode table: the opcode for bits 15-13, the function
+code for bits 3-0 and how the operands are laid out.*/
+struct OpcodeInfo {
+    unsigned opcode;
+    unsigned func;
+    Form form;
+};
+
+/*Look up a mnemonic in the opcode table, which is built once. Returns
+nullptr for an unknown mnemonic.*/
+const OpcodeInfo* find_opcode(string_view name){
+    static const unordered_map<string_view, OpcodeInfo> table = {
+        {"add",  {0, 0, FORM_REG3}},
+        {"sub",  {0, 1, FORM_REG3}},
+        {"or",   {0, 2, FORM_REG3}},
+        {"and",  {0, 3, FORM_REG3}},
+        {"slt",  {0, 4, FORM_REG3}},
+        {"jr",   {0, 8, FORM_JR}},
+        {"slti", {7, 0, FORM_REG2_IMM}},
+        {"lw",   {4, 0, FORM_MEM}},
+        {"sw",   {5, 0, FORM_MEM}},
+        {"jeq",  {6, 0, FORM_JEQ}},
+        {"addi", {1, 0, FORM_REG2_IMM}},
+        {"movi", {1, 0, FORM_MOVI}},
+        {"j",    {2, 0, FORM_JUMP}},
+        {"jal",  {3, 0, FORM_JUMP}},
+        {"nop",  {0, 0, FORM_NONE}},    // add $0, $0, $0
+    };
+    auto entry = table.find(name);
+    return entry == table.end() ? nullptr : &entry->second;
+}
+
+/*Labels and their addresses. The keys point into the source text, which
+must outlive the table.*/
+typedef unordered_map<string_view, unsigned> SymbolTable;
+
+/*Thrown for a malformed line; assemble() adds the line number.*/
+struct AsmError {
+    string message;
+};
+
+/*Parse a decimal integer that makes up the whole token, with an optional
+sign. Returns false if token is not a number.*/
+bool parse_number(string_view token, int& value){
+    bool negative = false;
+    if (!token.empty() && (token[0] == '-' || token[0] == '+')) {
+        negative = token[0] == '-';
+        token.remove_prefix(1);
+    }
+    if (token.empty() || token.size() > 9)
+        return false;
+    value = 0;
+    for (char c : token) {
+        if (c < '0' || c > '9')
+            return false;
+        value = value * 10 + (c - '0');
+    }
+    if (negative)
+        value = -value;
+    return true;
+}
+
+/*Convert a register operand such as $3 into its number.*/
+unsigned parse_register(string_view token){
+    token = trim(token);
+    if (token.size() != 2 || token[0] != '$' || token[1] < '0' || token[1] > '7')
+        throw AsmError{"Invalid register " + string(token)};
+    return token[1] - '0';
+}
+
+/*The start of an error message about a line of the file name.*/
+string source_position(const string& name, unsigned line){
+    return (name.empty() ? "" : name + ": ") + "Line " + to_string(line) + ": ";
+}
+
+/*How a relocation patches its word once addresses are known.*/
+enum RelocKind {
+    RELOC_ABS,      // OR in the symbol's address
+    RELOC_JEQ,      // OR in the 7-bit offset from the jeq to the symbol
+    RELOC_JEQ_ABS,  // the same for the fixed address in target
+    RELOC_HALT      // OR in the word's own address
+};
+
+/*A field of the code that depends on where the unit ends up in memory or
+on a label. symbol is looked up in the unit's own labels first, then in
+the symbols exported by the other units.*/
+struct Relocation {
+    unsigned offset;    // word to patch, relative to the unit
+    RelocKind kind;
+    string symbol;
+    unsigned target;    // for RELOC_JEQ_ABS
+    unsigned line;      // source line, for error messages
+};
+
+/*A label of a unit, at an address relative to the unit.*/
+struct Symbol {
+    string name;
+    unsigned address;
+    bool global;    // exported with .global
+};
+
+/*A relocatable object: the assembled code of one translation unit, with
+every label-dependent field left zero and described by a relocation.*/
+struct ObjectFile {
+    string name;
+    vector<unsigned> code;
+    vector<Symbol> symbols;
+    vector<string> imports;     // symbols used but not defined here
+    vector<Relocation> relocations;
+};
+
 /*Check if the parameter imm is a label or not.
-The function will go through the map labels. If there is a same label name stored, 
-it will return the corrresponding value. If there is no same label name, the program will
-convert characters in imm to integer and check its sign.*/
-unsigned checklabel(const string& imm, map<string, unsigned>& labels){
-    for(map<string,unsigned>::iterator pair = labels.begin(); pair != labels.end(); ++pair){
-        if(pair->first == imm){
-            return pair->second;
-        }
+A label of this unit, or any name that is not a number (which has to be
+exported by another unit), gets a relocation of the given kind and
+contributes nothing to the word yet. Otherwise imm is a number; negative
+numbers are converted into 7-bit two's complement.*/
+unsigned checklabel(string_view imm, RelocKind kind, unsigned location, const SymbolTable& labels,
+                    ObjectFile& object){
+    imm = trim(imm);
+    int temp;
+    if (labels.count(imm) || !parse_number(imm, temp)) {
+        if (imm.empty())
+            throw AsmError{"Missing immediate"};
+        object.relocations.push_back({location, kind, string(imm), 0, 0});
+        return 0;
     }
-    int temp = stoi(imm);
+    unsigned value;
     if(temp >= 0){
-        return (unsigned)temp;
+        value = (unsigned)temp;
     }
-        return (unsigned) 127 + temp + 1;
+    else{
+        value = (unsigned) 127 + temp + 1;
         /*After this modification, it would be converted into 7-bit signed binary correctly*/
+    }
+    if (kind == RELOC_JEQ) {
+        /*A numeric jeq target is an absolute address, so the offset still
+        depends on where the unit is placed*/
+        object.relocations.push_back({location, RELOC_JEQ_ABS, string(), value, 0});
+        return 0;
+    }
+    return value;
+}
+
+/*Split the operands of an instruction at the commas. Throws unless
+there are exactly count of them.*/
+void split_operands(string_view text, string_view operands[], size_t count){
+    size_t found = 0;
+    while (true) {
+        size_t comma = text.find(',');
+        if (found == count)
+            throw AsmError{"Too many operands"};
+        operands[found++] = trim(text.substr(0, comma));
+        if (comma == string_view::npos)
+            break;
+        text.remove_prefix(comma + 1);
+    }
+    if (found != count || operands[count - 1].empty())
+        throw AsmError{"Expected " + to_string(count) + " operands"};
+}
+
+/*Assemble one statement, with labels and comments already removed.
+location is the address of the statement within its unit; relocations
+for its label-dependent fields are added to object.*/
+unsigned assemble_statement(string_view line, unsigned location, const SymbolTable& labels, ObjectFile& object){
+    /*halt instruction*/
+    if (line == "halt") {
+        object.relocations.push_back({location, RELOC_HALT, string(), 0, 0});
+        return 2<<13;
+    }
+
+    size_t space = 0;
+    while (space < line.size() && !isspace_char(line[space]))
+        space++;
+    string_view opcode = line.substr(0, space);
+    string_view rest = line.substr(space);
+
+    /*instore .fill instructions*/
+    if (opcode == ".fill") {
+        string_view value = trim(rest);
+        int number;
+        if (parse_number(value, number))
+            return (unsigned)number;
+        return checklabel(value, RELOC_ABS, location, labels, object);
+    }
+
+    /*convert instructions*/
+    const OpcodeInfo* info = find_opcode(opcode);
+    if (info == nullptr)
+        throw AsmError{"Unknown instruction " + string(opcode)};
+    unsigned machine = (info->opcode << 13) | info->func;
+    string_view operands[3];
+    switch (info->form) {
+    case FORM_REG3:
+        split_operands(rest, operands, 3);
+        machine |= (parse_register(operands[0]) << 4) | (parse_register(operands[1]) << 10) |
+            (parse_register(operands[2]) << 7);
+        break;
+    case FORM_JR:
+        split_operands(rest, operands, 1);
+        machine |= parse_register(operands[0]) << 10;
+        break;
+    case FORM_REG2_IMM:
+        split_operands(rest, operands, 3);
+        machine |= (parse_register(operands[0]) << 7) | (parse_register(operands[1]) << 10) |
+            checklabel(operands[2], RELOC_ABS, location, labels, object);
+        break;
+    case FORM_MOVI:
+        split_operands(rest, operands, 2);
+        machine |= (parse_register(operands[0]) << 7) | checklabel(operands[1], RELOC_ABS, location, labels, object);
+        break;
+    case FORM_MEM: {
+        split_operands(rest, operands, 2);
+        size_t open = operands[1].find('(');
+        if (open == string_view::npos || operands[1].back() != ')')
+            throw AsmError{"Expected imm($reg)"};
+        string_view addr = operands[1].substr(open + 1, operands[1].size() - open - 2);
+        machine |= (parse_register(operands[0]) << 7) | (parse_register(addr) << 10) |
+            checklabel(operands[1].substr(0, open), RELOC_ABS, location, labels, object);
+        break;
+    }
+    case FORM_JUMP:
+        split_operands(rest, operands, 1);
+        machine |= checklabel(operands[0], RELOC_ABS, location, labels, object);
+        break;
+    case FORM_JEQ:
+        split_operands(rest, operands, 3);
+        machine |= (parse_register(operands[0]) << 10) | (parse_register(operands[1]) << 7) |
+            checklabel(operands[2], RELOC_JEQ, location, labels, object);
+        break;
+    case FORM_NONE:
+        if (!trim(rest).empty())
+            throw AsmError{"Too many operands"};
+        break;
+    }
+    return machine;
+}
+
+/*A run of lines of a unit that assembles on its own, and its result.
+Addresses and line numbers are relative to the section.*/
+struct Section {
+    uint64_t hash;
+    unsigned first_line;    // line of the unit the section starts on
+    string_view text;
+    vector<unsigned> code;
+    vector<Symbol> symbols;
+    vector<pair<string, unsigned>> exports;     // .global names and their lines
+    vector<Relocation> relocations;
+};
+
+/**
+    assemble_section(section, error_line, error)
+    Assemble the text of a section in two passes over its lines. The
+    first pass strips comments, records every label in the symbol table
+    and keeps the statements; the second assembles each statement.
+    Lines are only looked at through string_views into the text, so
+    nothing is copied.
+    Parameters:
+        section = the section to assemble, with text set
+        error_line = set to the line of an error, relative to the section
+        error = set to the message on failure
+    Returns false if the section has an error.
+    */
+bool assemble_section(Section& section, unsigned& error_line, string& error){
+    struct Statement {
+        string_view text;
+        unsigned line;
+    };
+    vector<Statement> statements;
+    SymbolTable labels; //detected labels and their addresses
+    labels.reserve(section.text.size() / 64);
+
+    string_view source = section.text;
+    unsigned line_number = 0;
+    while (!source.empty()) {
+        size_t eol = source.find('\n');
+        string_view line = source.substr(0, eol);
+        source.remove_prefix(eol == string_view::npos ? source.size() : eol + 1);
+        line_number++;
+        size_t pos = line.find('#');
+        if (pos != string_view::npos)
+            line = line.substr(0, pos);
+
+        /*The while-loop can help store all labels pointing to the same address.
+        For example, label1: label2: label3: halt*/
+        size_t colon;
+        while ((colon = line.find(':')) != string_view::npos) {
+            string_view label = trim(line.substr(0, colon));
+            if (!label.empty() && labels.emplace(label, (unsigned)statements.size()).second)
+                section.symbols.push_back({string(label), (unsigned)statements.size(), false});
+            line.remove_prefix(colon + 1);
+        }
+        //After erasing labels and comments, it is the instruction if there is something left.
+        line = trim(line);
+        if (line.rfind(".global", 0) == 0 && (line.size() == 7 || isspace_char(line[7])))
+            section.exports.emplace_back(string(trim(line.substr(7))), line_number);
+        else if (!line.empty())
+            statements.push_back({line, line_number});
+    }
+
+    ObjectFile object;
+    object.code.reserve(statements.size());
+    for (const Statement& statement : statements) {
+        size_t first_reloc = object.relocations.size();
+        try {
+            object.code.push_back(assemble_statement(statement.text, object.code.size(), labels, object));
+        } catch (const AsmError& e) {
+            error_line = statement.line;
+            error = e.message;
+            return false;
+        }
+        for (size_t i = first_reloc; i < object.relocations.size(); i++)
+            object.relocations[i].line = statement.line;
+    }
+    section.code = move(object.code);
+    section.relocations = move(object.relocations);
+    return true;
 }
 
+/*Split source into sections. Every label at the very start of a line
+begins a new section, so that each function of a program usually gets a
+section of its own and an edit only changes the sections it touches.*/
+vector<Section> split_sections(string_view source){
+    vector<Section> sections;
+    const char* start = source.data();
+    unsigned start_line = 1;
+    unsigned line_number = 1;
+    for (size_t pos = 0; pos < source.size(); line_number++) {
+        size_t eol = source.find('\n', pos);
+        string_view line = source.substr(pos, eol == string_view::npos ? string_view::npos : eol - pos);
+        size_t colon = line.find(':');
+        if (colon != string_view::npos && colon < line.find('#') && !line.empty() &&
+            !isspace_char(line[0]) && source.data() + pos > start) {
+            sections.push_back(Section());
+            sections.back().text = string_view(start, source.data() + pos - start);
+            sections.back().first_line = start_line;
+            start = source.data() + pos;
+            start_line = line_number;
+        }
+        pos = eol == string_view::npos ? source.size() : eol + 1;
+    }
+    sections.push_back(Section());
+    sections.back().text = string_view(start, source.data() + source.size() - start);
+    sections.back().first_line = start_line;
+    return sections;
+}
+
+/**
+    merge_sections(sections, name, object, error)
+    Put assembled sections one after another into a relocatable object.
+    A label defined in several sections keeps its first definition.
+    Parameters:
+        sections = the assembled sections, in source order
+        name = the file name, used in error messages
+        object = receives the object
+        error = set to a message with the line number on failure
+    Returns false if a .global names a label that is not defined.
+    */
+bool merge_sections(const vector<Section>& sections, const string& name, ObjectFile& object, string& error){
+    object = ObjectFile();
+    object.name = name;
+    size_t num_words = 0, num_symbols = 0, num_relocations = 0;
+    for (const Section& section : sections) {
+        num_words += section.code.size();
+        num_symbols += section.symbols.size();
+        num_relocations += section.relocations.size();
+    }
+    object.code.reserve(num_words);
+    object.symbols.reserve(num_symbols);
+    object.relocations.reserve(num_relocations);
+    unordered_map<string_view, size_t> labels; //index of each label in object.symbols
+    labels.reserve(num_symbols);
+    for (const Section& section : sections) {
+        unsigned base = object.code.size();
+        object.code.insert(object.code.end(), section.code.begin(), section.code.end());
+        for (const Symbol& symbol : section.symbols)
+            if (labels.emplace(symbol.name, object.symbols.size()).second)
+                object.symbols.push_back({symbol.name, base + symbol.address, false});
+        for (const Relocation& reloc : section.relocations) {
+            object.relocations.push_back(reloc);
+            object.relocations.back().offset += base;
+            object.relocations.back().line += section.first_line - 1;
+        }
+    }
+
+    for (const Section& section : sections) {
+        for (const auto& symbol : section.exports) {
+            auto label = labels.find(symbol.first);
+            if (label == labels.end()) {
+                error = source_position(name, section.first_line - 1 + symbol.second) +
+                    "Exported symbol " + symbol.first + " is not defined";
+                return false;
+            }
+            object.symbols[label->second].global = true;
+        }
+    }
+    for (const Relocation& reloc : object.relocations)
+        if (!reloc.symbol.empty() && !labels.count(reloc.symbol))
+            object.imports.push_back(reloc.symbol);
+    sort(object.imports.begin(), object.imports.end());
+    object.imports.erase(unique(object.imports.begin(), object.imports.end()), object.imports.end());
+    return true;
+}
+
+/*Little-endian output for object and cache files. Strings are a 16-bit
+length followed by the bytes.*/
+struct ByteWriter {
+    string data;
+
+    void put(uint64_t value, int bytes){
+        char buffer[8];
+        for (int i = 0; i < bytes; i++)
+            buffer[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+        data.append(buffer, bytes);
+    }
+
+    void put_string(const string& text){
+        put(text.size(), 2);
+        data += text;
+    }
+
+    void put_code(const vector<unsigned>& code){
+        put(code.size(), 4);
+        for (unsigned word : code)
+            put(word, 2);
+    }
+
+    void put_symbols(const vector<Symbol>& symbols){
+        put(symbols.size(), 4);
+        for (const Symbol& symbol : symbols) {
+            put_string(symbol.name);
+            put(symbol.address, 4);
+            put(symbol.global, 1);
+        }
+    }
+
+    void put_relocations(const vector<Relocation>& relocations){
+        put(relocations.size(), 4);
+        for (const Relocation& reloc : relocations) {
+            put(reloc.offset, 4);
+            put(reloc.kind, 1);
+            put_string(reloc.symbol);
+            put(reloc.target, 4);
+            put(reloc.line, 4);
+        }
+    }
+};
+
+/*Reads what ByteWriter wrote. Running past the end clears ok instead of
+reading out of bounds, so callers only check ok at the end.*/
+struct ByteReader {
+    string_view data;
+    size_t pos = 0;
+    bool ok = true;
+
+    uint64_t get(int bytes){
+        uint64_t value = 0;
+        if (pos + bytes > data.size())
+            ok = false;
+        else
+            for (int i = 0; i < bytes; i++)
+                value |= static_cast<uint64_t>(static_cast<unsigned char>(data[pos++])) << (8 * i);
+        return value;
+    }
+
+    string get_string(){
+        size_t size = get(2);
+        if (pos + size > data.size()) {
+            ok = false;
+            return string();
+        }
+        pos += size;
+        return string(data.substr(pos - size, size));
+    }
+
+    /*Read a count of items that take at least min_size bytes each,
+    checked against the bytes left so a corrupt file can't make us
+    allocate much.*/
+    size_t get_count(size_t min_size){
+        size_t count = get(4);
+        if (count > (data.size() - pos) / min_size)
+            ok = false;
+        return ok ? count : 0;
+    }
+
+    void get_code(vector<unsigned>& code){
+        code.resize(get_count(2));
+        for (unsigned& word : code)
+            word = get(2);
+    }
+
+    void get_symbols(vector<Symbol>& symbols){
+        symbols.resize(get_count(7));
+        for (Symbol& symbol : symbols) {
+            symbol.name = get_string();
+            symbol.address = get(4);
+            symbol.global = get(1) != 0;
+        }
+    }
+
+    /*code_size is the size of the code the relocations patch.*/
+    void get_relocations(vector<Relocation>& relocations, size_t code_size){
+        relocations.resize(get_count(15));
+        for (Relocation& reloc : relocations) {
+            reloc.offset = get(4);
+            reloc.kind = static_cast<RelocKind>(get(1));
+            reloc.symbol = get_string();
+            reloc.target = get(4);
+            reloc.line = get(4);
+            if (reloc.offset >= code_size || reloc.kind > RELOC_HALT)
+                ok = false;
+        }
+    }
+};
+
+/*
+    Relocatable object file, as written by -c. All integers are
+    little-endian and strings are a 16-bit length followed by the bytes:
+
+        magic "E20O", version (16 bits), reserved (16 bits)
+        word count (32 bits), then the words (16 bits each)
+        symbol count (32 bits), then per symbol: name, address (32 bits),
+            1 if exported else 0 (8 bits)
+        import count (32 bits), then the names
+        relocation count (32 bits), then per relocation: offset (32
+            bits), RelocKind (8 bits), symbol, target (32 bits), source
+            line (32 bits)
+*/
+const char OBJECT_MAGIC[4] = {'E', '2', '0', 'O'};
+const unsigned OBJECT_VERSION = 1;
+
+/*Write everything in an object after the header.*/
+void put_object_body(ByteWriter& out, const ObjectFile& object){
+    out.put_code(object.code);
+    out.put_symbols(object.symbols);
+    out.put(object.imports.size(), 4);
+    for (const string& name : object.imports)
+        out.put_string(name);
+    out.put_relocations(object.relocations);
+}
+
+/*Read what put_object_body wrote.*/
+void get_object_body(ByteReader& in, ObjectFile& object){
+    in.get_code(object.code);
+    in.get_symbols(object.symbols);
+    object.imports.resize(in.get_count(2));
+    for (string& import : object.imports)
+        import = in.get_string();
+    in.get_relocations(object.relocations, object.code.size());
+}
+
+/**
+    write_object(object)
+    Serialize a relocatable object in the format above.
+    */
+string write_object(const ObjectFile& object){
+    ByteWriter out;
+    out.data.assign(OBJECT_MAGIC, sizeof(OBJECT_MAGIC));
+    out.put(OBJECT_VERSION, 2);
+    out.put(0, 2);
+    put_object_body(out, object);
+    return out.data;
+}
+
+/**
+    read_object(data, name, object, error)
+    Parse an object written by write_object.
+    Parameters:
+        data = contents of the object file
+        name = the file name, used in error messages
+        object = receives the object
+        error = set to a message on failure
+    Returns false if data is not a valid object.
+    */
+bool read_object(string_view data, const string& name, ObjectFile& object, string& error){
+    ByteReader in{data};
+    in.pos = sizeof(OBJECT_MAGIC);
+    in.ok = data.size() >= in.pos && data.substr(0, in.pos) == string_view(OBJECT_MAGIC, in.pos);
+    object = ObjectFile();
+    object.name = name;
+    if (in.ok && in.get(2) != OBJECT_VERSION) {
+        error = name + ": Unsupported object version";
+        return false;
+    }
+    in.get(2);
+    get_object_body(in, object);
+    if (!in.ok || in.pos != data.size()) {
+        error = name + ": Not a valid object file";
+        return false;
+    }
+    return true;
+}
+
+/*Read a whole file into text. Returns false if it can't be opened.*/
+bool read_file(const string& filename, string& text){
+    ifstream f(filename, ios::binary);
+    if (!f.is_open())
+        return false;
+    f.seekg(0, ios::end);
+    streamoff size = f.tellg();
+    if (size < 0) {
+        // Not seekable, e.g. a pipe
+        f.clear();
+        text.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+        return true;
+    }
+    text.resize(size);
+    f.seekg(0);
+    f.read(&text[0], size);
+    return true;
+}
+
+/*
+    Cache of assembled sections, one file per unit in the directory
+    given by --cache-dir, named after a hash of the unit's file name:
+
+        magic "E20C", version (16 bits), reserved (16 bits)
+        hash of the whole unit (64 bits)
+        section count (32 bits), then per section: hash of its text (64
+            bits), its first line (32 bits), its code, symbols, .global
+            names with their lines and relocations, in the same layouts
+            as in an object file
+
+    CACHE_VERSION must change whenever the assembler would encode the
+    same text differently, so that old caches are not used.
+*/
+const char CACHE_MAGIC[4] = {'E', '2', '0', 'C'};
+const unsigned CACHE_VERSION = 1;
+
+/*64-bit FNV-1a hash of text.*/
+uint64_t content_hash(string_view text){
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : text)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    return hash;
+}
+
+/*The cache file for the unit in the file name.*/
+string cache_filename(const string& cache_dir, const string& name){
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(content_hash(name)));
+    return cache_dir + "/" + hex + ".e20c";
+}
+
+/**
+    load_cache(filename, unit_hash, sections)
+    Read a cache file written by save_cache.
+    Parameters:
+        filename = the cache file
+        unit_hash = set to the hash of the unit the cache was made from
+        sections = receives the cached sections
+    Returns false if there is no usable cache file.
+    */
+bool load_cache(const string& filename, uint64_t& unit_hash, vector<Section>& sections){
+    string data;
+    if (!read_file(filename, data))
+        return false;
+    ByteReader in{data};
+    in.pos = sizeof(CACHE_MAGIC);
+    if (data.size() < in.pos || data.compare(0, in.pos, CACHE_MAGIC, in.pos) != 0 ||
+        in.get(2) != CACHE_VERSION)
+        return false;
+    in.get(2);
+    unit_hash = in.get(8);
+    sections.resize(in.get_count(12));
+    for (Section& section : sections) {
+        section.hash = in.get(8);
+        section.first_line = in.get(4);
+        in.get_code(section.code);
+        in.get_symbols(section.symbols);
+        section.exports.resize(in.get_count(6));
+        for (auto& symbol : section.exports) {
+            symbol.first = in.get_string();
+            symbol.second = in.get(4);
+        }
+        in.get_relocations(section.relocations, section.code.size());
+    }
+    return in.ok && in.pos == data.size();
+}
+
+/**
+    save_cache(filename, unit_hash, sections)
+    Write the assembled sections of a unit for the next run. The file is
+    written under a temporary name and then renamed, so that a run that
+    is interrupted, or runs at the same time, never sees half of it.
+    */
+void save_cache(const string& filename, uint64_t unit_hash, const vector<Section>& sections){
+    ByteWriter out;
+    out.data.assign(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    out.put(CACHE_VERSION, 2);
+    out.put(0, 2);
+    out.put(unit_hash, 8);
+    out.put(sections.size(), 4);
+    for (const Section& section : sections) {
+        out.put(section.hash, 8);
+        out.put(section.first_line, 4);
+        out.put_code(section.code);
+        out.put_symbols(section.symbols);
+        out.put(section.exports.size(), 4);
+        for (const auto& symbol : section.exports) {
+            out.put_string(symbol.first);
+            out.put(symbol.second, 4);
+        }
+        out.put_relocations(section.relocations);
+    }
+    string temp = filename + "." + to_string(hash<thread::id>()(this_thread::get_id())) + ".tmp";
+    ofstream f(temp, ios::binary);
+    f.write(out.data.data(), out.data.size());
+    f.close();
+    if (!f || rename(temp.c_str(), filename.c_str()) != 0)
+        remove(temp.c_str());
+}
+
+/**
+    assemble_unit(source, name, object, error, cache_dir)
+    Assemble one translation unit into a relocatable object. Labels are
+    local to the unit unless named by a .global directive. With a cache
+    directory the unit is split into sections, and only the sections
+    whose text changed since the last run are assembled again; the
+    others come from the cache, which is only rewritten if something
+    changed.
+    Parameters:
+        source = the assembly language text
+        name = the file name, used in error messages and for the cache
+        object = receives the code, symbols and relocations
+        error = set to a message with the line number on failure
+        cache_dir = directory of the cache, or empty for none
+    Returns false if the unit has an error.
+    */
+bool assemble_unit(string_view source, const string& name, ObjectFile& object, string& error,
+                   const string& cache_dir = ""){
+    uint64_t unit_hash = content_hash(source);
+    uint64_t cached_hash = 0;
+    vector<Section> cached;
+    string cache_file;
+    if (!cache_dir.empty()) {
+        cache_file = cache_filename(cache_dir, name);
+        if (load_cache(cache_file, cached_hash, cached) && cached_hash == unit_hash)
+            return merge_sections(cached, name, object, error);
+    }
+
+    vector<Section> sections;
+    if (cache_dir.empty())
+        sections.push_back({0, 1, source, {}, {}, {}, {}});
+    else
+        sections = split_sections(source);
+    unordered_map<uint64_t, const Section*> previous;
+    for (const Section& section : cached)
+        previous.emplace(section.hash, &section);
+    for (Section& section : sections) {
+        section.hash = content_hash(section.text);
+        auto old = previous.find(section.hash);
+        if (old != previous.end()) {
+            section.code = old->second->code;
+            section.symbols = old->second->symbols;
+            section.exports = old->second->exports;
+            section.relocations = old->second->relocations;
+            continue;
+        }
+        unsigned line;
+        if (!assemble_section(section, line, error)) {
+            error = source_position(name, section.first_line - 1 + line) + error;
+            return false;
+        }
+    }
+    if (!merge_sections(sections, name, object, error))
+        return false;
+
+    /*A label that looks like a number only takes precedence over the
+    number within its own section, so such units are done whole*/
+    if (sections.size() > 1) {
+        for (const Symbol& symbol : object.symbols) {
+            int number;
+            if (parse_number(symbol.name, number))
+                return assemble_unit(source, name, object, error);
+        }
+    }
+    if (!cache_dir.empty())
+        save_cache(cache_file, unit_hash, sections);
+    return true;
+}
+
+/**
+    link(objects, instructions, error)
+    Place the objects one after another, starting at address 0, and
+    resolve every relocation. A symbol is looked up among the labels of
+    its own unit first and then among the .global labels of all units.
+    Parameters:
+        objects = the units, in the order they go into memory
+        instructions = receives the machine code of the whole program
+        error = set to a message on failure
+    Returns false if a symbol is undefined or exported twice.
+    */
+bool link(const vector<ObjectFile>& objects, vector<unsigned>& instructions, string& error){
+    struct Export {
+        unsigned address;
+        const ObjectFile* object;
+    };
+    unordered_map<string_view, Export> globals;
+    vector<unsigned> bases;
+    unsigned base = 0;
+    for (const ObjectFile& object : objects) {
+        bases.push_back(base);
+        for (const Symbol& symbol : object.symbols) {
+            if (!symbol.global)
+                continue;
+            auto inserted = globals.emplace(symbol.name, Export{base + symbol.address, &object});
+            if (!inserted.second) {
+                error = "Symbol " + symbol.name + " is exported by both " + inserted.first->second.object->name +
+                    " and " + object.name;
+                return false;
+            }
+        }
+        base += object.code.size();
+    }
+
+    instructions.clear();
+    instructions.reserve(base);
+    for (size_t unit = 0; unit < objects.size(); unit++) {
+        const ObjectFile& object = objects[unit];
+        SymbolTable labels;
+        labels.reserve(object.symbols.size());
+        for (const Symbol& symbol : object.symbols)
+            labels.emplace(symbol.name, bases[unit] + symbol.address);
+        size_t start = instructions.size();
+        instructions.insert(instructions.end(), object.code.begin(), object.code.end());
+
+        for (const Relocation& reloc : object.relocations) {
+            unsigned location = bases[unit] + reloc.offset;
+            unsigned target = reloc.target;
+            if (!reloc.symbol.empty()) {
+                auto local = labels.find(reloc.symbol);
+                auto global = globals.find(reloc.symbol);
+                if (local != labels.end())
+                    target = local->second;
+                else if (global != globals.end())
+                    target = global->second.address;
+                else {
+                    error = source_position(object.name, reloc.line) + "Unknown label " + reloc.symbol;
+                    return false;
+                }
+            }
+            unsigned& machine = instructions[start + reloc.offset];
+            if (reloc.kind == RELOC_ABS)
+                machine |= target;
+            else if (reloc.kind == RELOC_HALT)
+                machine |= location;
+            else {
+                int temp_rel = target - location - 1;
+                /*Get the relative value in int*/
+                unsigned rel_imm;
+                if(temp_rel >= 0)
+                    rel_imm =  (unsigned)temp_rel;
+                    //If it is not negative, we can use it directly.
+                else
+                    rel_imm = (unsigned) 127 + temp_rel + 1;
+                    // If it is negaive, we should change it to make its signed 7-bit binary correctly.
+                machine |= rel_imm;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+    assemble(source, instructions, error)
+    Assemble a whole single-file program: one unit, linked at address 0.
+    Parameters:
+        source = the assembly language text
+        instructions = receives the machine code, one word per address
+        error = set to a message with the line number on failure
+    Returns false if the program has an error.
+    */
+bool assemble(string_view source, vector<unsigned>& instructions, string& error){
+    vector<ObjectFile> objects(1);
+    return assemble_unit(source, "", objects[0], error) && link(objects, instructions, error);
+}
+
+
+/*Whether filename names an object file rather than assembly language.*/
+bool is_object_file(const string& filename){
+    return filename.size() > 2 && filename.compare(filename.size() - 2, 2, ".o") == 0;
+}
+
+/*The object file that -c writes for the source file filename.*/
+string object_filename(const string& filename){
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        return filename + ".o";
+    return filename.substr(0, dot) + ".o";
+}
+
+/**
+    build_units(filenames, jobs, objects, errors, cache_dir)
+    Assemble the source files and read the object files among filenames,
+    jobs of them at a time on a pool of threads. Units don't depend on
+    each other until link time, so they can be done in any order.
+    Parameters:
+        filenames = .s files to assemble and .o files to read
+        jobs = number of threads
+        objects = receives one object per file, in the same order
+        errors = receives one message per file, empty if it succeeded
+        cache_dir = directory of the section cache, or empty for none
+    */
+void build_units(const vector<string>& filenames, unsigned jobs, vector<ObjectFile>& objects,
+                 vector<string>& errors, const string& cache_dir = ""){
+    objects.assign(filenames.size(), ObjectFile());
+    errors.assign(filenames.size(), string());
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < filenames.size(); ) {
+            string text;
+            if (!read_file(filenames[i], text))
+                errors[i] = "Can't open file " + filenames[i];
+            else if (is_object_file(filenames[i]))
+                read_object(text, filenames[i], objects[i], errors[i]);
+            else
+                assemble_unit(text, filenames[i], objects[i], errors[i], cache_dir);
+        }
+    };
+    vector<thread> threads;
+    for (unsigned i = 1; i < jobs && i < filenames.size(); i++)
+        threads.emplace_back(worker);
+    worker();
+    for (thread& t : threads)
+        t.join();
+}
 
 /**
     print_line(address, num)
@@ -55,9 +987,42 @@ unsigned checklabel(const string& imm, map<string, unsigned>& labels){
     */
 void print_machine_code(unsigned address, unsigned num) {
     bitset<16> instruction_in_binary(num);
-    cout << "ram[" << address << "] = 16'b" << instruction_in_binary <<";"<<endl;
+    cout << "ram[" << address << "] = 16'b" << instruction_in_binary <<";\n";
+}
+
+/**
+    write_binary_image(instructions, source)
+    Write the machine code as a binary E20 image, which sim and simcache
+    load without parsing. All fields are little-endian: the magic
+    "E20B", version (16 bits), flags (16 bits), word count (32 bits),
+    entry pc (16 bits), metadata length (16 bits), the metadata and
+    then the words.
+    Parameters:
+        instructions = numeric values of the machine instructions
+        source = name of the assembly file, stored as metadata
+    */
+void write_binary_image(const vector<unsigned>& instructions, const string& source) {
+    string image = "E20B";
+    auto put16 = [&image](unsigned value) {
+        image.push_back(static_cast<char>(value & 0xFF));
+        image.push_back(static_cast<char>((value >> 8) & 0xFF));
+    };
+    string metadata = "source=" + source;
+    if (metadata.size() % 2)
+        metadata.push_back('\0');
+    put16(1);                                   // version
+    put16(0);                                   // flags: no entry, start at 0
+    put16(instructions.size() & 0xFFFF);
+    put16(instructions.size() >> 16);
+    put16(0);                                   // entry pc
+    put16(metadata.size());
+    image += metadata;
+    for (unsigned instruction : instructions)
+        put16(instruction);
+    cout.write(image.data(), image.size());
 }
 
+#ifndef E20_NO_MAIN
 /**
     Main function
     Takes command-line args as documented below
@@ -66,214 +1031,119 @@ int main(int argc, char *argv[]) {
     /*
         Parse the command-line arguments
     */
-    char *filename = nullptr;
+    vector<string> filenames;
     bool do_help = false;
     bool arg_error = false;
+    bool compile_only = false;
+    string format = "text";
+    string cache_dir;
+    unsigned jobs = max(1u, thread::hardware_concurrency());
     for (int i=1; i<argc; i++) {
         string arg(argv[i]);
         if (arg.rfind("-",0)==0) {
             if (arg== "-h" || arg == "--help")
                 do_help = true;
+            else if (arg == "-c")
+                compile_only = true;
+            else if (arg.rfind("--format=",0)==0) {
+                format = arg.substr(9);
+                if (format != "text" && format != "bin")
+                    arg_error = true;
+            }
+            else if (arg.rfind("--cache-dir=",0)==0) {
+                cache_dir = arg.substr(12);
+                if (cache_dir.empty())
+                    arg_error = true;
+            }
+            else if (arg.rfind("--jobs=",0)==0) {
+                char *end;
+                long value = strtol(arg.c_str() + 7, &end, 10);
+                if (arg.size() == 7 || *end != '\0' || value < 1 ||
+                    static_cast<unsigned>(value) != value)
+                    arg_error = true;
+                else
+                    jobs = value;
+            }
             else
                 arg_error = true;
-        } else {
-            if (filename == nullptr)
-                filename = argv[i];
-            else
-                arg_error = true;
-        }
+        } else
+            filenames.push_back(argv[i]);
     }
     /* Display error message if appropriate */
-    if (arg_error || do_help || filename == nullptr) {
-        cerr << "usage " << argv[0] << " [-h] filename" << endl << endl; 
+    if (arg_error || do_help || filenames.empty()) {
+        cerr << "usage " << argv[0] << " [-h] [-c] [--format=FORMAT] [--jobs=N] [--cache-dir=DIR]" << endl;
+        cerr << "       filename..." << endl << endl; 
         cerr << "Assemble E20 files into machine code" << endl << endl;
         cerr << "positional arguments:" << endl;
-        cerr << "  filename    The file containing assembly language, typically with .s suffix" << endl<<endl;
+        cerr << "  filename    A file containing assembly language, typically with .s suffix," << endl;
+        cerr << "              or an object file with .o suffix. Several files are linked" << endl;
+        cerr << "              into one program, placed in memory in the order given" << endl<<endl;
         cerr << "optional arguments:"<<endl;
         cerr << "  -h, --help  show this help message and exit"<<endl;
+        cerr << "  -c          Only assemble each file into a relocatable object file.o;"<<endl;
+        cerr << "              labels named by .global can be used from other files"<<endl;
+        cerr << "  --format=FORMAT  Output format: text (ram[i] listing, default) or bin"<<endl;
+        cerr << "                   (binary image)"<<endl;
+        cerr << "  --jobs=N    Assemble up to N files at once (default: one per CPU)"<<endl;
+        cerr << "  --cache-dir=DIR  Keep assembled sections in DIR and only reassemble the"<<endl;
+        cerr << "                   sections that changed since the last run"<<endl;
         return 1;
     }
 
-    /* iterate through the line in the file, construct a list
-       of numeric values representing machine code */
-    ifstream f(filename);
-    if (!f.is_open()) {
-        cerr << "Can't open file "<<filename<<endl;
+    error_code ec;
+    if (!cache_dir.empty() && !filesystem::create_directories(cache_dir, ec) && ec) {
+        cerr << "Can't create cache directory "<<cache_dir<<endl;
         return 1;
     }
 
-    /* our final output is a list of ints values representing
-       machine code instructions */
-    vector<unsigned> instructions;
-    string line;
-
-    unsigned machine;
-    unsigned location = 0;
-    vector<string> lines;
-    map <string, unsigned> labels; //map to store detected labels
-    map <string, unsigned> assembly; //map to store all opcode with corresponding machine language
-    assembly.insert(pair <string, unsigned> ("add", 0));
-    assembly.insert(pair <string, unsigned> ("sub", 0));
-    assembly.insert(pair <string, unsigned> ("or", 0));
-    assembly.insert(pair <string, unsigned> ("and", 0));
-    assembly.insert(pair <string, unsigned> ("slt", 0));
-    assembly.insert(pair <string, unsigned> ("jr", 0));
-    assembly.insert(pair <string, unsigned> ("slti", 7));
-    assembly.insert(pair <string, unsigned> ("lw", 4));
-    assembly.insert(pair <string, unsigned> ("sw", 5));
-    assembly.insert(pair <string, unsigned> ("jeq", 6));
-    assembly.insert(pair <string, unsigned> ("addi", 1));
-    assembly.insert(pair <string, unsigned> ("movi", 1));
-    assembly.insert(pair <string, unsigned> ("j", 2));
-    assembly.insert(pair <string, unsigned> ("jal", 3));
-
-    while (getline(f, line)) {
-        size_t pos = line.find("#");
-        if (pos != string::npos)
-            line = line.substr(0, pos);
-
-        lines.push_back(line);
-        /*The while-loop can help store all labels pointing to the same address.
-        For example, label1: label2: label3: halt*/
-        while(islabel(line)){
-            string label = line.substr(0, line.find(':'));
-            size_t firstChar = label.find_first_not_of(" ");
-            label.erase(0, firstChar);
-            labels.insert(pair <string, unsigned> (label, location));
-            size_t position = line.find(':');
-            line = line.substr(position + 1);
+    /* assemble every file into an object */
+    vector<ObjectFile> objects;
+    vector<string> errors;
+    build_units(filenames, jobs, objects, errors, cache_dir);
+    bool failed = false;
+    for (const string& error : errors) {
+        if (!error.empty()) {
+            cerr << error << endl;
+            failed = true;
         }
-        //After erasing labels and comments, it is the instruction if there is something left.
-        if(!line.empty())
-            location++;
     }
+    if (failed)
+        return 1;
 
-    location = 0; //remake location
-    for(size_t i = 0; i < lines.size(); i++){
-        line = lines[i];
-        while(islabel(line)){
-            size_t position = line.find(':');
-            line = line.substr(position + 1);
-        }
-        size_t pos2 = line.find_first_not_of(" \t\n\r\f\v");
-        if (pos2 != string::npos) {
-            line = line.substr(pos2);
-            size_t endpos = line.find_last_not_of(" \t\n");
-            if (endpos != std::string::npos) {
-                line.erase(endpos+1);
-            }
-            /*halt instruction*/
-            if(line == "halt"){
-                machine = (2<<13) | location;
+    if (compile_only) {
+        for (size_t i = 0; i < filenames.size(); i++) {
+            if (is_object_file(filenames[i]))
+                continue;
+            string data = write_object(objects[i]);
+            ofstream out(object_filename(filenames[i]), ios::binary);
+            out.write(data.data(), data.size());
+            if (!out) {
+                cerr << "Can't write file "<<object_filename(filenames[i])<<endl;
+                return 1;
             }
-            /*instore .fill instructions*/
-            else if (hasfill(line)){
-                machine = stoi(line.substr(line.find('.') + 6, line.back()));
-            }
-            /*convert instructions*/
-            else{
-                string opcode = line.substr(0, line.find(' '));
-                for(map<string,unsigned>::iterator pair = assembly.begin(); pair != assembly.end(); ++pair){
-                    if(pair->first == opcode){
-                        machine = pair->second << 13;
-                        if(opcode == "sub"){
-                            machine = machine | 1;
-                        }
-                        else if(opcode == "or"){
-                            machine = machine | 2;
-                        }
-                        else if(opcode == "and"){
-                            machine = machine | 3;
-                        }
-                        else if(opcode == "slt"){
-                            machine = machine | 4;
-                        }
-                        else if(opcode == "jr"){
-                            machine = machine | 8;
-                            unsigned reg = (unsigned)line[line.find('$') + 1] - 48;
-                            /*convert character into unsigned num based on ascii table*/
-                            machine = machine | (reg << 10);
-                        }
-                        if(opcode == "add" || opcode == "sub" || opcode == "or" || opcode == "and" || opcode == "slt"){
-                            size_t firstDollarPos = line.find_first_of("$");
-                            size_t secondDollarPos = line.find_first_of("$", firstDollarPos + 1);
-                            size_t thirdDollarPos = line.find_first_of("$", secondDollarPos + 1);
-                            unsigned dst = (unsigned)line[firstDollarPos + 1] - 48;
-                            unsigned srcA = (unsigned)line[secondDollarPos + 1] - 48;
-                            unsigned srcB = (unsigned)line[thirdDollarPos + 1] - 48;
-                            machine = machine | (dst << 4) | (srcA << 10) | (srcB << 7);
-                        }
-                    }
-
-                }
-                if(opcode == "slti" || opcode == "addi"){
-                    size_t firstDollarPos = line.find_first_of("$");
-                    size_t secondDollarPos = line.find_first_of("$", firstDollarPos + 1);
-                    unsigned dst = (unsigned)line[firstDollarPos + 1] - 48;
-                    unsigned src = (unsigned)line[secondDollarPos + 1] - 48;
-                    machine = machine | (dst << 7) | (src << 10);
-                    size_t comma = line.find_last_of(",");
-                    string imm = line.substr(comma + 1); // locate immediate value
-                    size_t firstCharPos = imm.find_first_not_of(" ");
-                    imm.erase(0, firstCharPos);
-                    machine = machine | checklabel(imm, labels);
-                }
-                if(opcode == "movi"){
-                    unsigned dst = (unsigned)line[line.find('$') + 1] - 48;
-                    unsigned src = 0;
-                    size_t comma = line.find_last_of(",");
-                    string imm = line.substr(comma + 1);
-                    size_t firstCharPos = imm.find_first_not_of(" ");
-                    imm.erase(0, firstCharPos);
-                    machine = machine | (dst << 7) | (src << 10) | checklabel(imm, labels);
-                }
-                if(opcode == "lw" || opcode == "sw"){
-                    unsigned src = (unsigned)line[line.find('$') + 1] - 48;
-                    unsigned add = (unsigned)line[line.find('(') + 2] - 48;
-                    size_t comma = line.find_last_of(",");
-                    string imm = line.substr(comma + 1);
-                    size_t firstCharPos = imm.find_first_not_of(" ");
-                    size_t paren = imm.find_last_of("(");
-                    imm.erase(paren);
-                    imm.erase(0, firstCharPos);
-                    machine = machine | (src << 7) | (add << 10) | checklabel(imm, labels);
-                }
-                if(opcode == "j" || opcode == "jal"){
-                    size_t start = line.find(" ")+1;
-                    size_t end = line.find(" ", start);
-                    string imm = line.substr(start, end - start);
-                    machine = machine | checklabel(imm, labels);
-                }
-                if(opcode == "jeq"){
-                    size_t firstDollarPos = line.find_first_of("$");
-                    size_t secondDollarPos = line.find_first_of("$", firstDollarPos + 1);
-                    unsigned regA = (unsigned)line[firstDollarPos + 1] - 48;
-                    unsigned regB = (unsigned)line[secondDollarPos + 1] - 48;
-                    size_t comma = line.find_last_of(",");
-                    string imm = line.substr(comma + 1);
-                    size_t firstCharPos = imm.find_first_not_of(" ");
-                    imm.erase(0, firstCharPos);
-                    int temp_rel = checklabel(imm, labels) - location - 1;
-                    /*Get the relative value in int*/
-                    unsigned rel_imm;
-                    if(temp_rel >= 0)
-                        rel_imm =  (unsigned)temp_rel;
-                        //If it is not negative, we can use it directly.
-                    else
-                        rel_imm = (unsigned) 127 + temp_rel + 1;
-                        // If it is negaive, we should change it to make its signed 7-bit binary correctly.
-                    machine = machine | (regA << 10) | (regB << 7) | rel_imm;
-                }
-            }
-            instructions.push_back(machine);   // TODO change this. generate the machine code
-            machine = 0;
-            location ++;
-            
         }
+        return 0;
+    }
+
+    /* our final output is a list of ints values representing
+       machine code instructions */
+    vector<unsigned> instructions;
+    string error;
+    if (!link(objects, instructions, error)) {
+        cerr << error << endl;
+        return 1;
+    }
 
+    if (format == "bin") {
+        string sources;
+        for (const string& filename : filenames)
+            sources += (sources.empty() ? "" : ",") + filename;
+        write_binary_image(instructions, sources);
+        return 0;
     }
 
     /* print out each instruction in the required format */
+    ios::sync_with_stdio(false);
     unsigned address = 0;
     for (unsigned instruction : instructions) {
         print_machine_code(address, instruction); 
@@ -282,5 +1152,6 @@ int main(int argc, char *argv[]) {
  
     return 0;
 }
+#endif
 
 //ra0Eequ6ucie6Jei0koh6phishohm9
\ No newline at end of file
@@ -0,0 +1,315 @@
+/*
+Benchmark for the E20 assembler on a large generated program
+asm_bench.cpp
+
+Generates an assembly program with ten thousand labels and times
+assemble() from asm.cpp against the map-walking assembler it replaced.
+The program is also split into units that are assembled in parallel and
+linked, and reassembled through the section cache after a one-line
+edit. All of them must produce the same machine code.
+
+Build and run from the repository root:
+    g++ -O2 -pthread -o asm_bench bench/asm_bench.cpp
+    ./asm_bench [statements] [repetitions]
+*/
+
+#define E20_NO_MAIN
+#include "../asm.cpp"
+
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+/*
+    The previous label lookup, kept as the baseline.
+*/
+unsigned checklabel_map(const string& imm, map<string, unsigned>& labels){
+    for(map<string,unsigned>::iterator pair = labels.begin(); pair != labels.end(); ++pair){
+        if(pair->first == imm){
+            return pair->second;
+        }
+    }
+    int temp = stoi(imm);
+    if(temp >= 0){
+        return (unsigned)temp;
+    }
+        return (unsigned) 127 + temp + 1;
+}
+
+/*
+    The previous assembler, kept as the baseline: both passes as they
+    were in main, minus the output.
+*/
+void assemble_map(istream& f, vector<unsigned>& instructions){
+    string line;
+    unsigned machine = 0;
+    unsigned location = 0;
+    vector<string> lines;
+    map <string, unsigned> labels;
+    map <string, unsigned> assembly;
+    assembly.insert(pair <string, unsigned> ("add", 0));
+    assembly.insert(pair <string, unsigned> ("sub", 0));
+    assembly.insert(pair <string, unsigned> ("or", 0));
+    assembly.insert(pair <string, unsigned> ("and", 0));
+    assembly.insert(pair <string, unsigned> ("slt", 0));
+    assembly.insert(pair <string, unsigned> ("jr", 0));
+    assembly.insert(pair <string, unsigned> ("slti", 7));
+    assembly.insert(pair <string, unsigned> ("lw", 4));
+    assembly.insert(pair <string, unsigned> ("sw", 5));
+    assembly.insert(pair <string, unsigned> ("jeq", 6));
+    assembly.insert(pair <string, unsigned> ("addi", 1));
+    assembly.insert(pair <string, unsigned> ("movi", 1));
+    assembly.insert(pair <string, unsigned> ("j", 2));
+    assembly.insert(pair <string, unsigned> ("jal", 3));
+
+    while (getline(f, line)) {
+        size_t pos = line.find("#");
+        if (pos != string::npos)
+            line = line.substr(0, pos);
+        lines.push_back(line);
+        while(line.find(':') != string::npos){
+            string label = line.substr(0, line.find(':'));
+            size_t firstChar = label.find_first_not_of(" ");
+            label.erase(0, firstChar);
+            labels.insert(pair <string, unsigned> (label, location));
+            size_t position = line.find(':');
+            line = line.substr(position + 1);
+        }
+        if(!line.empty())
+            location++;
+    }
+
+    location = 0;
+    for(size_t i = 0; i < lines.size(); i++){
+        line = lines[i];
+        while(line.find(':') != string::npos){
+            size_t position = line.find(':');
+            line = line.substr(position + 1);
+        }
+        size_t pos2 = line.find_first_not_of(" \t\n\r\f\v");
+        if (pos2 == string::npos)
+            continue;
+        line = line.substr(pos2);
+        size_t endpos = line.find_last_not_of(" \t\n");
+        if (endpos != std::string::npos)
+            line.erase(endpos+1);
+        if(line == "halt"){
+            machine = (2<<13) | location;
+        }
+        else if (line.find(".fill") != string::npos){
+            machine = stoi(line.substr(line.find('.') + 6, line.back()));
+        }
+        else{
+            string opcode = line.substr(0, line.find(' '));
+            for(map<string,unsigned>::iterator pair = assembly.begin(); pair != assembly.end(); ++pair){
+                if(pair->first == opcode){
+                    machine = pair->second << 13;
+                    if(opcode == "sub")
+                        machine = machine | 1;
+                    else if(opcode == "or")
+                        machine = machine | 2;
+                    else if(opcode == "and")
+                        machine = machine | 3;
+                    else if(opcode == "slt")
+                        machine = machine | 4;
+                    else if(opcode == "jr"){
+                        machine = machine | 8;
+                        unsigned reg = (unsigned)line[line.find('$') + 1] - 48;
+                        machine = machine | (reg << 10);
+                    }
+                    if(opcode == "add" || opcode == "sub" || opcode == "or" || opcode == "and" || opcode == "slt"){
+                        size_t firstDollarPos = line.find_first_of("$");
+                        size_t secondDollarPos = line.find_first_of("$", firstDollarPos + 1);
+                        size_t thirdDollarPos = line.find_first_of("$", secondDollarPos + 1);
+                        unsigned dst = (unsigned)line[firstDollarPos + 1] - 48;
+                        unsigned srcA = (unsigned)line[secondDollarPos + 1] - 48;
+                        unsigned srcB = (unsigned)line[thirdDollarPos + 1] - 48;
+                        machine = machine | (dst << 4) | (srcA << 10) | (srcB << 7);
+                    }
+                }
+            }
+            if(opcode == "slti" || opcode == "addi"){
+                size_t firstDollarPos = line.find_first_of("$");
+                size_t secondDollarPos = line.find_first_of("$", firstDollarPos + 1);
+                unsigned dst = (unsigned)line[firstDollarPos + 1] - 48;
+                unsigned src = (unsigned)line[secondDollarPos + 1] - 48;
+                machine = machine | (dst << 7) | (src << 10);
+                string imm = line.substr(line.find_last_of(",") + 1);
+                imm.erase(0, imm.find_first_not_of(" "));
+                machine = machine | checklabel_map(imm, labels);
+            }
+            if(opcode == "movi"){
+                unsigned dst = (unsigned)line[line.find('$') + 1] - 48;
+                string imm = line.substr(line.find_last_of(",") + 1);
+                imm.erase(0, imm.find_first_not_of(" "));
+                machine = machine | (dst << 7) | checklabel_map(imm, labels);
+            }
+            if(opcode == "lw" || opcode == "sw"){
+                unsigned src = (unsigned)line[line.find('$') + 1] - 48;
+                unsigned add = (unsigned)line[line.find('(') + 2] - 48;
+                string imm = line.substr(line.find_last_of(",") + 1);
+                size_t firstCharPos = imm.find_first_not_of(" ");
+                imm.erase(imm.find_last_of("("));
+                imm.erase(0, firstCharPos);
+                machine = machine | (src << 7) | (add << 10) | checklabel_map(imm, labels);
+            }
+            if(opcode == "j" || opcode == "jal"){
+                size_t start = line.find(" ")+1;
+                size_t end = line.find(" ", start);
+                machine = machine | checklabel_map(line.substr(start, end - start), labels);
+            }
+            if(opcode == "jeq"){
+                size_t firstDollarPos = line.find_first_of("$");
+                size_t secondDollarPos = line.find_first_of("$", firstDollarPos + 1);
+                unsigned regA = (unsigned)line[firstDollarPos + 1] - 48;
+                unsigned regB = (unsigned)line[secondDollarPos + 1] - 48;
+                string imm = line.substr(line.find_last_of(",") + 1);
+                imm.erase(0, imm.find_first_not_of(" "));
+                int temp_rel = checklabel_map(imm, labels) - location - 1;
+                unsigned rel_imm = temp_rel >= 0 ? (unsigned)temp_rel : (unsigned) 127 + temp_rel + 1;
+                machine = machine | (regA << 10) | (regB << 7) | rel_imm;
+            }
+        }
+        instructions.push_back(machine);
+        machine = 0;
+        location ++;
+    }
+}
+
+/*
+    Generates statements begin to end of a program of count statements
+    where every other one has a label and most operands refer to
+    labels. Every 64th statement's label starts its line, like the
+    entry of a function; the others are indented. With exports, every label is also made .global so that the
+    statements can go in a unit of their own.
+*/
+string generate_program(size_t begin, size_t end, size_t count, bool exports){
+    ostringstream out;
+    const char *alu[] = {"add", "sub", "or", "and", "slt"};
+    for (size_t i = begin; i < end; i++) {
+        if (i % 2 == 0 && exports)
+            out << ".global label" << i << "\n";
+        if (i % 2 == 0)
+            out << (i % 64 == 0 ? "" : "  ") << "label" << i << ":\n";
+        size_t target = (i * 7919) % count & ~size_t(1);
+        switch (i % 8) {
+        case 0: out << "    " << alu[i / 8 % 5] << " $" << i % 8 << ", $" << (i + 1) % 8 << ", $" << (i + 2) % 8; break;
+        case 1: out << "    addi $" << i % 7 + 1 << ", $" << i % 5 << ", " << int(i % 128) - 64; break;
+        case 2: out << "    lw $" << i % 7 + 1 << ", label" << target << "($0)"; break;
+        case 3: out << "    sw $" << i % 7 + 1 << ", label" << target << "($2)"; break;
+        case 4: out << "    jeq $1, $2, label" << (i & ~size_t(1)); break;
+        case 5: out << "    movi $3, label" << target << "   # address of a label"; break;
+        case 6: out << "    jal label" << target; break;
+        default: out << (i % 16 == 15 ? "    nop" : "    .fill " + to_string(i)); break;
+        }
+        out << "\n";
+    }
+    if (end == count)
+        out << "    halt\n";
+    return out.str();
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = argc > 1 ? atoi(argv[1]) : 20000;
+    int reps = argc > 2 ? atoi(argv[2]) : 3;
+    string source = generate_program(0, count, count, false);
+
+    vector<unsigned> old_code, new_code;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < reps; i++) {
+        istringstream in(source);
+        old_code.clear();
+        assemble_map(in, old_code);
+    }
+    chrono::duration<double, milli> old_ms = chrono::steady_clock::now() - start;
+
+    start = chrono::steady_clock::now();
+    string error;
+    for (int i = 0; i < reps; i++) {
+        if (!assemble(source, new_code, error)) {
+            cerr << error << endl;
+            return 1;
+        }
+    }
+    chrono::duration<double, milli> new_ms = chrono::steady_clock::now() - start;
+
+    // The same program split into units, assembled on one thread and
+    // then on all of them
+    const size_t num_units = 16;
+    vector<string> filenames;
+    for (size_t unit = 0; unit < num_units; unit++) {
+        size_t begin = count * unit / num_units & ~size_t(1);
+        size_t end = unit + 1 == num_units ? count : count * (unit + 1) / num_units & ~size_t(1);
+        filenames.push_back("asm_bench_unit" + to_string(unit) + ".s");
+        ofstream out(filenames.back());
+        out << generate_program(begin, end, count, true);
+    }
+    unsigned jobs = max(1u, thread::hardware_concurrency());
+    double unit_ms[2];
+    vector<unsigned> linked_code[2];
+    for (int parallel = 0; parallel < 2; parallel++) {
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < reps; i++) {
+            vector<ObjectFile> objects;
+            vector<string> errors;
+            build_units(filenames, parallel ? jobs : 1, objects, errors);
+            if (!link(objects, linked_code[parallel], error)) {
+                cerr << error << endl;
+                return 1;
+            }
+        }
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        unit_ms[parallel] = elapsed.count() / reps;
+    }
+    for (const string &filename : filenames)
+        remove(filename.c_str());
+
+    // Reassembly with the section cache: from scratch, with nothing
+    // changed, and with one statement edited
+    string cache_dir = "asm_bench_cache";
+    filesystem::remove_all(cache_dir);
+    filesystem::create_directories(cache_dir);
+    string edited = source;
+    size_t edit = edited.find("addi", edited.size() / 2);
+    edited[edit + 6] = edited[edit + 6] == '1' ? '2' : '1';
+    vector<unsigned> edited_code, cached_code[3];
+    if (!assemble(edited, edited_code, error)) {
+        cerr << error << endl;
+        return 1;
+    }
+    double cache_ms[3];
+    for (int run = 0; run < 3; run++) {
+        start = chrono::steady_clock::now();
+        vector<ObjectFile> objects(1);
+        if (!assemble_unit(run == 2 ? edited : source, "asm_bench.s", objects[0], error, cache_dir) ||
+            !link(objects, cached_code[run], error)) {
+            cerr << error << endl;
+            return 1;
+        }
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        cache_ms[run] = elapsed.count();
+    }
+    filesystem::remove_all(cache_dir);
+
+    if (old_code != new_code || linked_code[0] != new_code || linked_code[1] != new_code ||
+        cached_code[0] != new_code || cached_code[1] != new_code || cached_code[2] != edited_code) {
+        cerr << "Assemblers disagree" << endl;
+        return 1;
+    }
+    size_t lines = count + count / 2 + 1;
+    cout << fixed << setprecision(3);
+    cout << "program: " << count + 1 << " statements, " << (count + 1) / 2 << " labels, " << lines << " lines" << endl;
+    cout << "map assembler:    " << old_ms.count() / reps << " ms (" <<
+        lines / (old_ms.count() / reps) / 1000 << " Mlines/s)" << endl;
+    cout << "hashed assembler: " << new_ms.count() / reps << " ms (" <<
+        lines / (new_ms.count() / reps) / 1000 << " Mlines/s, " << old_ms.count() / new_ms.count() << "x)" << endl;
+    cout << num_units << " units, 1 thread:  " << unit_ms[0] << " ms, including reading, linking and "
+        "the .global lines" << endl;
+    cout << num_units << " units, " << jobs << " threads: " << unit_ms[1] << " ms (" <<
+        unit_ms[0] / unit_ms[1] << "x)" << endl;
+    cout << "cached, cold:      " << cache_ms[0] << " ms, including writing the cache" << endl;
+    cout << "cached, unchanged: " << cache_ms[1] << " ms" << endl;
+    cout << "cached, one edit:  " << cache_ms[2] << " ms" << endl;
+    return 0;
+}
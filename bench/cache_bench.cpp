@@ -0,0 +1,133 @@
+/*
+Throughput benchmark for the simcache cache model
+cache_bench.cpp
+
+Drives the flat-array CacheLevel from simcache.cpp and the list+map
+LRUcache rows it replaced with the same stream of loads and stores,
+checks that both report the same hits and misses, and prints the
+accesses per second of each.
+
+Build and run from the repository root:
+    g++ -O2 -o cache_bench bench/cache_bench.cpp
+    ./cache_bench [accesses]
+*/
+
+#define E20_NO_MAIN
+#include "../simcache.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <map>
+
+/*
+    The previous cache row, kept as the baseline.
+*/
+class LRUcache{
+public:
+    list<int> m_list;
+    map<int, vector<uint16_t>> block;
+};
+
+/*
+    One access through the previous model, as simcache used to do it
+    for a single cache.
+
+    @return true on a hit
+*/
+bool access_lrucache(vector<LRUcache> &cache, int assoc, int blocksize, int num_rows,
+                     const uint16_t mem[], int addr, bool store) {
+    int blockid = addr / blocksize;
+    int row_num = blockid % num_rows;
+    int tag = blockid / num_rows;
+    LRUcache &row = cache[row_num];
+    if (row.block.find(tag) != row.block.end()) {
+        if (store)
+            row.block.at(tag)[addr & (blocksize - 1)] = mem[addr];
+        auto it = find(row.m_list.begin(), row.m_list.end(), tag);
+        row.m_list.splice(row.m_list.begin(), row.m_list, it);
+        return true;
+    }
+    if (row.block.size() == static_cast<size_t>(assoc)) {
+        row.block.erase(row.m_list.back());
+        row.m_list.pop_back();
+    }
+    vector<uint16_t> load;
+    for (int i = blockid * blocksize; i < blockid * blocksize + blocksize; i++)
+        load.push_back(mem[i]);
+    row.block.insert({tag, load});
+    row.m_list.push_front(tag);
+    return false;
+}
+
+/*
+    The same access through the flat-array model.
+*/
+bool access_cache(CacheLevel<LRUPolicy> &cache, const uint16_t mem[], int addr, bool store) {
+    int blockid = addr / cache.blocksize;
+    int row_num = blockid % cache.num_rows;
+    int tag = blockid / cache.num_rows;
+    int way = cache.find(row_num, tag);
+    if (way >= 0) {
+        if (store)
+            cache.word(row_num, way, addr & (cache.blocksize - 1)) = mem[addr];
+        cache.touch(row_num, way);
+        return true;
+    }
+    cache.fill(row_num, tag, blockid, mem);
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    size_t accesses = 2000000;
+    if (argc > 1)
+        accesses = strtoul(argv[1], nullptr, 10);
+
+    // A mix of a sequential sweep, a strided walk and random accesses
+    vector<uint16_t> addrs(accesses);
+    vector<uint8_t> stores(accesses);
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < accesses; i++) {
+        seed = seed * 1103515245 + 12345;
+        switch (i % 3) {
+        case 0: addrs[i] = (i / 3) % MEM_SIZE; break;
+        case 1: addrs[i] = ((i / 3) * 72) % 2048; break;
+        default: addrs[i] = (seed >> 8) % 1024; break;
+        }
+        stores[i] = (seed >> 20) % 4 == 0;
+    }
+    static uint16_t mem[MEM_SIZE];
+
+    const int configs[][3] = {{64, 2, 8}, {256, 4, 4}, {1024, 16, 4}, {512, 1, 16}, {2048, 64, 1}};
+    cout << "config            list+map Macc/s   flat Macc/s   speedup" << endl;
+    for (auto &config : configs) {
+        int size = config[0], assoc = config[1], blocksize = config[2];
+        int num_rows = size / assoc / blocksize;
+
+        vector<LRUcache> old_cache(num_rows);
+        vector<uint8_t> old_hits(accesses);
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < accesses; i++)
+            old_hits[i] = access_lrucache(old_cache, assoc, blocksize, num_rows, mem, addrs[i], stores[i]);
+        chrono::duration<double> old_time = chrono::steady_clock::now() - start;
+
+        CacheLevel<LRUPolicy> cache;
+        cache.init("L1", size, assoc, blocksize);
+        vector<uint8_t> hits(accesses);
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < accesses; i++)
+            hits[i] = access_cache(cache, mem, addrs[i], stores[i]);
+        chrono::duration<double> new_time = chrono::steady_clock::now() - start;
+
+        if (hits != old_hits) {
+            cerr << "Models disagree for " << size << "," << assoc << "," << blocksize << endl;
+            return 1;
+        }
+        double old_rate = accesses / old_time.count() / 1e6;
+        double new_rate = accesses / new_time.count() / 1e6;
+        cout << left << setw(18) << to_string(size) + "," + to_string(assoc) + "," + to_string(blocksize)
+             << right << fixed << setprecision(2) << setw(15) << old_rate
+             << setw(14) << new_rate << setw(9) << new_rate / old_rate << "x" << endl;
+    }
+    return 0;
+}
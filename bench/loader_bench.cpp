@@ -0,0 +1,119 @@
+/*
+Startup benchmark for the E20 machine code loader
+loader_bench.cpp
+
+Times load_image from sim.cpp, on a full 8192-word image both as a
+machine code listing and as a binary image, against the std::regex
+loader the listing scanner replaced.
+
+Build and run from the repository root:
+    g++ -O2 -o loader_bench bench/loader_bench.cpp
+    ./loader_bench [image.bin] [repetitions]
+*/
+
+#define E20_NO_MAIN
+#include "../sim.cpp"
+
+#include <chrono>
+#include <regex>
+
+/*
+    The previous regex-based loader, kept as the baseline.
+*/
+void load_machine_code_regex(ifstream &f, uint16_t mem[]) {
+    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
+    size_t expectedaddr = 0;
+    string line;
+    while (getline(f, line)) {
+        smatch sm;
+        if (!regex_match(line, sm, machine_code_re)) {
+            cerr << "Can't parse line: " << line << endl;
+            exit(1);
+        }
+        size_t addr = stoi(sm[1], nullptr, 10);
+        unsigned instr = stoi(sm[2], nullptr, 2);
+        if (addr != expectedaddr) {
+            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
+            exit(1);
+        }
+        if (addr >= MEM_SIZE) {
+            cerr << "Program too big for memory" << endl;
+            exit(1);
+        }
+        expectedaddr ++;
+        mem[addr] = instr;
+    }
+}
+
+/*
+    Loads filename reps times with the regex loader, or with
+    load_image if regex is false.
+
+    @return Average milliseconds per load
+*/
+double time_loader(bool regex, const char *filename, int reps, uint16_t mem[]) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < reps; i++) {
+        if (regex) {
+            ifstream f(filename);
+            load_machine_code_regex(f, mem);
+        } else {
+            uint16_t entry = 0;
+            string error;
+            load_image(filename, mem, entry, error);
+        }
+    }
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / reps;
+}
+
+int main(int argc, char *argv[]) {
+    string filename = "loader_bench_image.bin";
+    string binname = "loader_bench_image.img";
+    int reps = 20;
+    bool generated = argc <= 1;
+    if (!generated)
+        filename = argv[1];
+    else {
+        // Generate a full-memory image with varied instruction words
+        ofstream out(filename);
+        for (size_t addr = 0; addr < MEM_SIZE; addr++) {
+            uint16_t word = static_cast<uint16_t>(addr * 40503u);
+            out << "ram[" << addr << "] = 16'b";
+            for (int bit = 15; bit >= 0; bit--)
+                out << ((word >> bit) & 1);
+            out << ";" << endl;
+        }
+    }
+    if (argc > 2)
+        reps = atoi(argv[2]);
+
+    static uint16_t mem_regex[MEM_SIZE];
+    static uint16_t mem_fast[MEM_SIZE];
+    static uint16_t mem_bin[MEM_SIZE];
+    double regex_ms = time_loader(true, filename.c_str(), reps, mem_regex);
+    double fast_ms = time_loader(false, filename.c_str(), reps, mem_fast);
+
+    // The same words as a binary image
+    {
+        ofstream out(binname, ios::binary);
+        out.write(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+        uint16_t header[6] = {IMAGE_VERSION, 0, MEM_SIZE & 0xFFFF, MEM_SIZE >> 16, 0, 0};
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(mem_fast), sizeof(mem_fast));
+    }
+    double bin_ms = time_loader(false, binname.c_str(), reps, mem_bin);
+    remove(binname.c_str());
+    if (generated)
+        remove(filename.c_str());
+
+    if (memcmp(mem_regex, mem_fast, sizeof(mem_fast)) != 0 || memcmp(mem_fast, mem_bin, sizeof(mem_bin)) != 0) {
+        cerr << "Loaders disagree on " << filename << endl;
+        return 1;
+    }
+    cout << fixed << setprecision(3);
+    cout << "regex loader:   " << regex_ms << " ms/load" << endl;
+    cout << "scanner loader: " << fast_ms << " ms/load (" << regex_ms / fast_ms << "x)" << endl;
+    cout << "binary image:   " << bin_ms << " ms/load (" << regex_ms / bin_ms << "x)" << endl;
+    return 0;
+}
@@ -0,0 +1,440 @@
+/*
+Benchmark suite for the sim, simcache and asm programs
+suite_bench.cpp
+
+Generates representative E20 workloads (a tight ALU loop, memory
+streaming, pointer chasing and a chain of jal/jr calls), assembles them
+with asm and runs them with every sim engine, as batches of sixteen
+copies, in one lockstep group with short programs that branch apart,
+and with simcache. Prints the assembler lines per second, the
+simulated MIPS and the cache accesses per second of each. Every output is hashed and checked against
+the hashes recorded in bench/expected.txt, so a change in behaviour
+fails the run just like a slowdown shows in the numbers.
+
+Built and run by the bench target:
+    cmake --build build --target bench
+or by hand, with the directory holding the built tools:
+    ./suite_bench TOOLDIR EXPECTED [--update] [repetitions]
+--update writes the hashes of the current outputs to EXPECTED instead of
+checking them.
+*/
+
+#define E20_NO_MAIN
+#include "../sim.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <sstream>
+
+/*
+    A generated workload: its assembly text and its name.
+*/
+struct Workload {
+    string name;
+    string source;
+};
+
+/*
+    xorshift32, so that the generated programs are the same on every
+    platform.
+*/
+uint32_t next_random(uint32_t &state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/*
+    Nested loop of ALU instructions, with no memory accesses.
+*/
+Workload tight_loop() {
+    ostringstream s;
+    s << "        lw $1, count($0)\n"
+         "outer:  movi $2, 60\n"
+         "inner:  addi $2, $2, -1\n"
+         "        add $3, $3, $1\n"
+         "        sub $4, $3, $2\n"
+         "        or $5, $4, $1\n"
+         "        and $5, $5, $3\n"
+         "        slt $6, $2, $1\n"
+         "        slti $6, $2, 30\n"
+         "        add $3, $3, $6\n"
+         "        jeq $2, $0, next\n"
+         "        j inner\n"
+         "next:   addi $1, $1, -1\n"
+         "        jeq $1, $0, done\n"
+         "        j outer\n"
+         "done:   halt\n"
+         "count:  .fill 60000\n";
+    return {"loop", s.str()};
+}
+
+/*
+    Passes over a 4096-word array that load, add to and store back
+    every word in turn.
+*/
+Workload streaming() {
+    ostringstream s;
+    s << "        lw $5, passes($0)\n"
+         "pass:   lw $1, base($0)\n"
+         "        lw $2, words($0)\n"
+         "word:   lw $3, 0($1)\n"
+         "        add $4, $4, $3\n"
+         "        addi $3, $3, 1\n"
+         "        sw $3, 0($1)\n"
+         "        addi $1, $1, 1\n"
+         "        addi $2, $2, -1\n"
+         "        jeq $2, $0, end\n"
+         "        j word\n"
+         "end:    addi $5, $5, -1\n"
+         "        jeq $5, $0, done\n"
+         "        j pass\n"
+         "done:   sw $4, 0($0)\n"
+         "        halt\n"
+         "passes: .fill 240\n"
+         "base:   .fill 2048\n"
+         "words:  .fill 4096\n";
+    return {"stream", s.str()};
+}
+
+/*
+    Walks a linked list whose nodes are laid out in random order, so
+    that nearly every hop lands in another cache block.
+*/
+Workload pointer_chase() {
+    const size_t NODES = 6000;
+    vector<size_t> order(NODES);
+    for (size_t i = 0; i < NODES; i++)
+        order[i] = i;
+    uint32_t state = 2214;
+    for (size_t i = NODES - 1; i > 0; i--)
+        swap(order[i], order[next_random(state) % (i + 1)]);
+
+    // Address of n0: the nodes follow the ten instructions and three
+    // words below. The links are plain numbers so that any assembler
+    // can take the program.
+    const size_t FIRST_NODE = 13;
+    ostringstream s;
+    s << "        lw $3, laps($0)\n"
+         "lap:    lw $1, head($0)\n"
+         "        lw $2, hops($0)\n"
+         "hop:    lw $1, 0($1)\n"
+         "        addi $2, $2, -1\n"
+         "        jeq $2, $0, end\n"
+         "        j hop\n"
+         "end:    addi $3, $3, -1\n"
+         "        jeq $3, $0, done\n"
+         "        j lap\n"
+         "done:   halt\n"
+         "laps:   .fill 160\n"
+         "hops:   .fill " << NODES << "\n"
+         "head:   .fill " << FIRST_NODE + order[0] << "\n";
+    // Node order[i] points to node order[i + 1], and the last one
+    // back to the first
+    vector<size_t> successor(NODES);
+    for (size_t i = 0; i < NODES; i++)
+        successor[order[i]] = order[(i + 1) % NODES];
+    for (size_t i = 0; i < NODES; i++)
+        s << "n" << i << ": .fill " << FIRST_NODE + successor[i] << "\n";
+    return {"chase", s.str()};
+}
+
+/*
+    Calls a chain of functions, each of which saves $7 on a stack,
+    does a little work and calls the next one.
+*/
+Workload call_chain() {
+    const size_t DEPTH = 16;
+    ostringstream s;
+    s << "        lw $6, stack($0)\n"
+         "        lw $5, calls($0)\n"
+         "call:   jal f0\n"
+         "        addi $5, $5, -1\n"
+         "        jeq $5, $0, done\n"
+         "        j call\n"
+         "done:   halt\n"
+         "calls:  .fill 60000\n"
+         "stack:  .fill 7000\n";
+    for (size_t i = 0; i < DEPTH; i++) {
+        s << "f" << i << ":     addi $1, $1, " << i + 1 << "\n";
+        if (i + 1 < DEPTH) {
+            s << "        sw $7, 0($6)\n"
+                 "        addi $6, $6, 1\n"
+                 "        jal f" << i + 1 << "\n"
+                 "        addi $6, $6, -1\n"
+                 "        lw $7, 0($6)\n";
+        }
+        s << "        add $2, $2, $1\n"
+             "        jr $7\n";
+    }
+    return {"calls", s.str()};
+}
+
+/*
+    A short loop whose trip count and branches depend on variant, so
+    that lanes of a lockstep group running different variants split up
+    and halt, on a jeq to itself, at different times and places.
+*/
+Workload split_loop(unsigned variant) {
+    ostringstream s;
+    s << "        movi $1, " << 5 + 3 * variant << "\n"
+         "        movi $5, 3\n"
+         "        movi $6, " << variant % 4 << "\n"
+         "loop:   addi $1, $1, -1\n"
+         "        and $2, $1, $5\n"
+         "        jeq $2, $0, skip\n"
+         "        addi $3, $3, 1\n"
+         "        sw $3, 100($2)\n"
+         "skip:   jeq $1, $0, out\n"
+         "        j loop\n"
+         "out:    and $4, $3, $5\n"
+         "stop:   jeq $4, $6, stop\n"
+         "done:   jeq $0, $0, done\n";
+    return {"split" + to_string(variant), s.str()};
+}
+
+/*
+    Instructions executed and memory accesses made by a program.
+*/
+struct Counts {
+    uint64_t instructions = 0;
+    uint64_t accesses = 0;
+};
+
+/*
+    Runs a program with a plain fetch-decode-execute loop, only to
+    count what it does; the timed runs are those of the real tools.
+*/
+Counts count_program(const string &filename) {
+    Counts counts;
+    static uint16_t mem[MEM_SIZE];
+    memset(mem, 0, sizeof(mem));
+    uint16_t regs[NUM_REGS + 1] = {0};
+    uint16_t pc = 0;
+    string error;
+    if (!load_image(filename.c_str(), mem, pc, error))
+        return counts;
+    while (true) {
+        Decoded d = decode(mem[pc], true);
+        uint16_t next = isoverflow(pc + 1);
+        counts.instructions++;
+        switch (d.op) {
+        case OP_ADD: regs[d.dst] = regs[d.regA] + regs[d.regB]; break;
+        case OP_SUB: regs[d.dst] = regs[d.regA] - regs[d.regB]; break;
+        case OP_OR: regs[d.dst] = regs[d.regA] | regs[d.regB]; break;
+        case OP_AND: regs[d.dst] = regs[d.regA] & regs[d.regB]; break;
+        case OP_SLT: regs[d.dst] = static_cast<int16_t>(regs[d.regA]) < static_cast<int16_t>(regs[d.regB]); break;
+        case OP_SLTI: regs[d.dst] = static_cast<int16_t>(regs[d.regA]) < static_cast<int16_t>(d.imm); break;
+        case OP_ADDI: regs[d.dst] = regs[d.regA] + d.imm; break;
+        case OP_LW:
+            regs[d.dst] = mem[isoverflow(regs[d.regA] + d.imm)];
+            counts.accesses++;
+            break;
+        case OP_SW:
+            mem[isoverflow(regs[d.regA] + d.imm)] = regs[d.regB];
+            counts.accesses++;
+            break;
+        case OP_JR: next = isoverflow(regs[d.regA]); break;
+        case OP_J: next = d.imm; break;
+        case OP_JAL: regs[7] = pc + 1; next = d.imm; break;
+        case OP_JEQ:
+            if (regs[d.regA] == regs[d.regB])
+                next = isoverflow(pc + 1 + d.imm);
+            break;
+        }
+        if (next == pc)
+            return counts;
+        pc = next;
+    }
+}
+
+/*
+    FNV-1a hash of a tool's output.
+*/
+uint64_t output_hash(const string &text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/*
+    Runs command reps times and keeps the fastest run.
+
+    @param output Set to what the command printed on stdout
+    @return Seconds taken by the fastest run, or a negative number if
+        the command failed
+*/
+double time_command(const string &command, int reps, string &output) {
+    double best = -1;
+    for (int i = 0; i < reps; i++) {
+        auto start = chrono::steady_clock::now();
+        FILE *pipe = popen(command.c_str(), "r");
+        if (pipe == nullptr)
+            return -1;
+        output.clear();
+        char chunk[1 << 16];
+        size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), pipe)) > 0)
+            output.append(chunk, got);
+        if (pclose(pipe) != 0)
+            return -1;
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        if (best < 0 || elapsed.count() < best)
+            best = elapsed.count();
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "usage " << argv[0] << " TOOLDIR EXPECTED [--update] [repetitions]" << endl;
+        return 1;
+    }
+    string tools = argv[1];
+    string expected_file = argv[2];
+    bool update = false;
+    int reps = 3;
+    for (int i = 3; i < argc; i++) {
+        if (string(argv[i]) == "--update")
+            update = true;
+        else
+            reps = max(1, atoi(argv[i]));
+    }
+
+    map<string, uint64_t> expected;
+    if (!update) {
+        ifstream in(expected_file);
+        string key;
+        uint64_t hash;
+        while (in >> key >> hex >> hash)
+            expected[key] = hash;
+        if (expected.empty()) {
+            cerr << "Can't read expected outputs from " << expected_file << endl;
+            return 1;
+        }
+    }
+    map<string, uint64_t> actual;
+    bool ok = true;
+    auto check = [&](const string &key, double seconds, const string &output) {
+        if (seconds < 0) {
+            cerr << key << ": command failed" << endl;
+            ok = false;
+            return;
+        }
+        actual[key] = output_hash(output);
+        if (!update && expected[key] != actual[key]) {
+            cerr << key << ": output differs from the expected one" << endl;
+            ok = false;
+        }
+    };
+
+    vector<Workload> workloads = {tight_loop(), streaming(), pointer_chase(), call_chain()};
+    const char *engines[] = {"switch", "threaded", "jit"};
+    // Copies of each program in a --batch run, one lockstep group
+    const size_t BATCH = LOCKSTEP_LANES;
+    const string cache = "--cache 64,2,4,512,4,8 --log=summary";
+    cout << fixed << setprecision(1);
+    size_t lines = 0;
+    double asm_seconds = 0;
+    for (const Workload &w : workloads) {
+        ofstream(w.name + ".s") << w.source;
+        string output;
+        double seconds = time_command("\"" + tools + "/asm\" " + w.name + ".s", reps, output);
+        check("asm/" + w.name, seconds, output);
+        ofstream(w.name + ".bin") << output;
+        lines += count(w.source.begin(), w.source.end(), '\n');
+        asm_seconds += seconds;
+    }
+    cout << "asm: " << lines << " lines, " << lines / asm_seconds / 1e3 << " k lines/s" << endl;
+
+    for (const Workload &w : workloads) {
+        string image = w.name + ".bin";
+        Counts counts = count_program(image);
+        string output;
+        for (const char *engine : engines) {
+            double seconds = time_command("\"" + tools + "/sim\" --engine=" + engine + " " + image, reps, output);
+            check("sim/" + w.name, seconds, output);
+            cout << setw(8) << w.name << "  sim " << setw(8) << engine << setw(10)
+                 << counts.instructions / seconds / 1e6 << " MIPS" << endl;
+        }
+
+        // The same program many times over, for the batch engines; the
+        // output must be that of a single run, repeated
+        ofstream manifest(w.name + ".batch");
+        string repeated;
+        for (size_t i = 0; i < BATCH; i++) {
+            manifest << image << "\n";
+            repeated += output;
+        }
+        manifest.close();
+        for (const char *engine : {"switch", "simd"}) {
+            string batch_output;
+            double seconds = time_command("\"" + tools + "/sim\" --jobs=1 --engine=" + engine + " --batch " +
+                                          w.name + ".batch", reps, batch_output);
+            if (seconds < 0 || batch_output != repeated) {
+                cerr << "sim/" << w.name << ": --batch with " << engine << " differs from single runs" << endl;
+                ok = false;
+            }
+            cout << setw(8) << w.name << "  batch " << setw(6) << engine << setw(10)
+                 << BATCH * counts.instructions / seconds / 1e6 << " MIPS" << endl;
+        }
+
+        double seconds = time_command("\"" + tools + "/simcache\" " + cache + " " + image, reps, output);
+        check("simcache/" + w.name, seconds, output);
+        // A rate over a handful of accesses would only measure startup
+        if (counts.accesses >= 1000)
+            cout << setw(8) << w.name << "  simcache    " << setw(10) << counts.accesses / seconds / 1e6
+                 << " M accesses/s" << endl;
+    }
+
+    // A lockstep group of different programs: the workloads, a lone
+    // halting jeq and variants of a loop that split the lanes up. Each
+    // lane must end as the program does on its own.
+    vector<Workload> mixed = {{"halt", "done:   jeq $0, $0, done\n"}};
+    for (unsigned variant = 0; mixed.size() + workloads.size() < BATCH; variant++)
+        mixed.push_back(split_loop(variant));
+    for (const Workload &w : mixed) {
+        ofstream(w.name + ".s") << w.source;
+        string output;
+        if (time_command("\"" + tools + "/asm\" " + w.name + ".s", 1, output) < 0)
+            ok = false;
+        ofstream(w.name + ".bin") << output;
+    }
+    ofstream manifest("mixed.batch");
+    string singles;
+    for (size_t i = 0, next = 0; i < BATCH; i++) {
+        // Every fourth lane runs one of the workloads
+        bool workload = i % 4 == 0 && i / 4 < workloads.size();
+        string image = (workload ? workloads[i / 4].name : mixed[next++].name) + ".bin";
+        string output;
+        if (time_command("\"" + tools + "/sim\" " + image, 1, output) < 0)
+            ok = false;
+        singles += output;
+        manifest << image << "\n";
+    }
+    manifest.close();
+    for (const char *engine : {"switch", "simd"}) {
+        string batch_output;
+        if (time_command("\"" + tools + "/sim\" --jobs=1 --engine=" + engine + " --batch mixed.batch",
+                         1, batch_output) < 0 || batch_output != singles) {
+            cerr << "sim/mixed: --batch with " << engine << " differs from single runs" << endl;
+            ok = false;
+        }
+    }
+
+    if (update) {
+        ofstream out(expected_file);
+        for (const auto &entry : actual)
+            out << entry.first << " " << hex << setw(16) << setfill('0') << entry.second << dec << setfill(' ') << "\n";
+        if (!out.good()) {
+            cerr << "Can't write " << expected_file << endl;
+            return 1;
+        }
+    }
+    return ok ? 0 : 1;
+}
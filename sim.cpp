@@ -13,8 +13,33 @@ sim.cpp
 #include <vector>
 #include <fstream>
 #include <iomanip>
-#include <regex>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define E20_HAVE_JIT 1
+#endif
+
+// The lockstep engine is built for AVX2 and picked at run time if the
+// CPU has it
+#if defined(__GNUC__) && defined(__x86_64__)
+#define E20_HAVE_LOCKSTEP 1
+#define E20_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -31,44 +56,489 @@ size_t const static REG_SIZE = 1<<16;
     @param input the 16-bit binary number stored in uint16_t
 */
 uint16_t isoverflow(uint16_t input){
-    while(!(input < MEM_SIZE)){
-        input -= MEM_SIZE;
+    // MEM_SIZE is a power of two, so the repeated subtraction
+    // is the same as keeping the low 13 bits.
+    return input & (MEM_SIZE - 1);
+}
+
+/*
+    Operations of a predecoded instruction. The ALU functions
+    that share opcode 0 are split into their own entries, and any
+    instruction whose only effect is a write to $0 becomes OP_NOP.
+    OP_DECODE marks a slot that has not been decoded yet (or was
+    overwritten by sw) and must be decoded from memory on fetch.
+*/
+enum Op : uint8_t {
+    OP_DECODE, OP_NOP,
+    OP_ADD, OP_SUB, OP_OR, OP_AND, OP_SLT, OP_JR,
+    OP_SLTI, OP_LW, OP_SW, OP_ADDI, OP_J, OP_JAL, OP_JEQ
+};
+
+/*
+    One predecoded instruction. dst is the register written by the
+    instruction (regB for slti, lw and addi), and imm holds the
+    sign-extended immediate, or the target address for j and jal.
+*/
+struct Decoded {
+    uint8_t op;
+    uint8_t regA;
+    uint8_t regB;
+    uint8_t dst;
+    uint16_t imm;
+};
+
+/*
+    Decodes a single 16-bit instruction word.
+
+    @param num The instruction word
+    @param keep_loads Decode a lw into $0 as a load into the scratch
+        register NUM_REGS rather than as a no-op, so that its memory
+        access still happens
+    @return The predecoded form of num
+*/
+Decoded decode(uint16_t num, bool keep_loads = false) {
+    Decoded d;
+    uint16_t opcode = num >> 13;
+    uint16_t imm7 = num & 0b0000000001111111;
+    d.regA = (num & 0b0001110000000000) >> 10;
+    d.regB = (num & 0b0000001110000000) >> 7;
+    d.dst = d.regB;
+    d.imm = (imm7 & 0x40) ? (imm7 | 0xFF80) : imm7;
+    switch (opcode) {
+    case 0:
+        d.dst = (num & 0b0000000001110000) >> 4;
+        switch (num & 0b0000000000001111) {
+        case 0: d.op = OP_ADD; break;
+        case 1: d.op = OP_SUB; break;
+        case 2: d.op = OP_OR; break;
+        case 3: d.op = OP_AND; break;
+        case 4: d.op = OP_SLT; break;
+        case 8: d.op = OP_JR; return d;
+        default: d.op = OP_NOP; return d;
+        }
+        break;
+    case 1: d.op = OP_ADDI; break;
+    case 2: d.op = OP_J; d.imm = num & 0b0001111111111111; return d;
+    case 3: d.op = OP_JAL; d.imm = num & 0b0001111111111111; return d;
+    case 4: d.op = OP_LW; break;
+    case 5: d.op = OP_SW; return d;
+    case 6: d.op = OP_JEQ; return d;
+    case 7: d.op = OP_SLTI; break;
     }
-    return input;
+    // writes to $0 are discarded, so the instruction does nothing
+    if (d.dst == 0 && keep_loads && d.op == OP_LW)
+        d.dst = NUM_REGS;
+    else if (d.dst == 0)
+        d.op = OP_NOP;
+    return d;
+}
+
+/*
+    Parses one line of the form "ram[N] = 16'bBBBB;" followed by
+    anything, without allocating.
+
+    @param p First character of the line
+    @param eol One past the last character of the line
+    @param addr Set to the decimal address N
+    @param instr Set to the binary value B
+    @return false if the line doesn't have that form
+*/
+bool scan_machine_code_line(const char *p, const char *eol, size_t &addr, unsigned &instr) {
+    static const char prefix[] = "ram[";
+    static const char middle[] = "] = 16'b";
+    for (const char *c = prefix; *c; c++, p++)
+        if (p == eol || *p != *c)
+            return false;
+    if (p == eol || *p < '0' || *p > '9')
+        return false;
+    // Saturate absurdly long addresses; they are out of sequence anyway
+    addr = 0;
+    for (; p != eol && *p >= '0' && *p <= '9'; p++)
+        addr = (addr < 100000000) ? addr * 10 + (*p - '0') : addr;
+    for (const char *c = middle; *c; c++, p++)
+        if (p == eol || *p != *c)
+            return false;
+    if (p == eol || (*p != '0' && *p != '1'))
+        return false;
+    instr = 0;
+    for (; p != eol && (*p == '0' || *p == '1'); p++)
+        instr = (instr << 1) | (*p - '0');
+    return p != eol && *p == ';';
 }
 
 /*
-    Loads an E20 machine code file into the list
+    Loads an E20 machine code listing into the list
     provided by mem. We assume that mem is
     large enough to hold the values in the machine
     code file.
 
-    @param f Open file to read from
+    @param text Contents of the machine code file
+    @param size Length of text in bytes
     @param mem Array represetnting memory into which to read program
+    @param error Set to the reason if the listing is malformed
+    @return false if the listing is malformed
 */
-void load_machine_code(ifstream &f, uint16_t mem[]) {
-    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
+bool load_machine_code(const char *text, size_t size, uint16_t mem[], string &error) {
+    const char *p = text;
+    const char *end = p + size;
     size_t expectedaddr = 0;
-    string line;
-    while (getline(f, line)) {
-        smatch sm;
-        if (!regex_match(line, sm, machine_code_re)) {
-            cerr << "Can't parse line: " << line << endl;
-            exit(1);
-        }
-        size_t addr = stoi(sm[1], nullptr, 10);
-        unsigned instr = stoi(sm[2], nullptr, 2);
+    while (p < end) {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (eol == nullptr)
+            eol = end;
+        size_t addr;
+        unsigned instr;
+        if (!scan_machine_code_line(p, eol, addr, instr)) {
+            error = "Can't parse line: " + string(p, eol);
+            return false;
+        }
         if (addr != expectedaddr) {
-            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
-            exit(1);
+            error = "Memory addresses encountered out of sequence: " + to_string(addr);
+            return false;
         }
         if (addr >= MEM_SIZE) {
-            cerr << "Program too big for memory" << endl;
-            exit(1);
+            error = "Program too big for memory";
+            return false;
         }
         expectedaddr ++;
         mem[addr] = instr;
+        p = eol + 1;
+    }
+    return true;
+}
+
+/*
+    Binary E20 image, as written by asm --format=bin. All fields are
+    little-endian:
+
+        offset  size  field
+        0       4     magic "E20B"
+        4       2     format version, currently 1
+        6       2     flags; IMAGE_HAS_ENTRY if entry is meaningful
+        8       4     number of 16-bit words in the image
+        12      2     entry pc
+        14      2     length of the metadata section in bytes
+        16      ...   metadata (free-form text, e.g. the source name)
+        ...     ...   the words, loaded starting at address 0
+*/
+const char IMAGE_MAGIC[4] = {'E', '2', '0', 'B'};
+uint16_t const static IMAGE_VERSION = 1;
+uint16_t const static IMAGE_HAS_ENTRY = 1;
+size_t const static IMAGE_HEADER_SIZE = 16;
+
+/*
+    Reads a little-endian 16-bit value.
+*/
+uint16_t read_le16(const char *p) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return u[0] | (u[1] << 8);
+}
+
+/*
+    Loads a binary E20 image into mem.
+
+    @param data Contents of the image file
+    @param size Length of data in bytes
+    @param mem Array representing memory into which to read program
+    @param entry Set to the entry pc if the image has one
+    @param error Set to the reason if the image is malformed
+    @return false if the image is malformed
+*/
+bool load_binary_image(const char *data, size_t size, uint16_t mem[], uint16_t &entry, string &error) {
+    if (size < IMAGE_HEADER_SIZE) {
+        error = "Truncated binary image";
+        return false;
+    }
+    if (read_le16(data + 4) != IMAGE_VERSION) {
+        error = "Unsupported binary image version " + to_string(read_le16(data + 4));
+        return false;
+    }
+    uint16_t flags = read_le16(data + 6);
+    size_t words = read_le16(data + 8) | (static_cast<size_t>(read_le16(data + 10)) << 16);
+    size_t metadata = read_le16(data + 14);
+    if (words > MEM_SIZE) {
+        error = "Program too big for memory";
+        return false;
+    }
+    if (size < IMAGE_HEADER_SIZE + metadata + 2 * words) {
+        error = "Truncated binary image";
+        return false;
+    }
+    const char *p = data + IMAGE_HEADER_SIZE + metadata;
+    for (size_t addr = 0; addr < words; addr++, p += 2)
+        mem[addr] = read_le16(p);
+    if (flags & IMAGE_HAS_ENTRY)
+        entry = read_le16(data + 12) & (MEM_SIZE - 1);
+    return true;
+}
+
+/*
+    A whole file mapped read-only into memory, or read into a
+    buffer where mmap isn't available.
+*/
+class MappedFile {
+public:
+    const char *data = nullptr;
+    size_t size = 0;
+
+    bool open(const char *filename) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            // Pipes and the like can't be mapped, so read them instead
+            char chunk[1 << 16];
+            ssize_t got;
+            while ((got = ::read(fd, chunk, sizeof(chunk))) > 0)
+                buffer.append(chunk, got);
+            ::close(fd);
+            data = buffer.data();
+            size = buffer.size();
+            return got == 0;
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+            mapping = p;
+            data = static_cast<const char *>(p);
+        }
+        ::close(fd);
+        return true;
+#else
+        ifstream f(filename, ios::binary);
+        if (!f.is_open())
+            return false;
+        f.seekg(0, ios::end);
+        buffer.resize(static_cast<size_t>(f.tellg()));
+        f.seekg(0, ios::beg);
+        f.read(&buffer[0], buffer.size());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+#endif
+    }
+
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapping != nullptr)
+            munmap(mapping, size);
+#endif
     }
+
+private:
+    void *mapping = nullptr;
+    string buffer;
+};
+
+/*
+    Loads an E20 program into mem. Binary images are recognized by
+    their magic number; anything else is parsed as a machine code
+    listing.
+
+    @param filename The file to load
+    @param mem Array representing memory into which to read program
+    @param entry Set to the entry pc if the image has one
+    @param error Set to the reason if the program is malformed; left
+        empty if the file can't be opened
+    @return false if the file can't be opened or is malformed
+*/
+bool load_image(const char *filename, uint16_t mem[], uint16_t &entry, string &error) {
+    MappedFile file;
+    if (!file.open(filename))
+        return false;
+    if (file.size >= sizeof(IMAGE_MAGIC) && memcmp(file.data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0)
+        return load_binary_image(file.data, file.size, mem, entry, error);
+    return load_machine_code(file.data, file.size, mem, error);
+}
+
+/*
+    Binary memory trace, as written by --record-trace. An 8-byte header
+    of the magic "E20T", the format version (currently 1) and two
+    reserved bytes is followed by one little-endian 32-bit record per
+    memory access:
+
+        bits 0-12   pc of the lw or sw
+        bits 13-25  address accessed
+        bit 26      set for a store
+*/
+const char TRACE_MAGIC[4] = {'E', '2', '0', 'T'};
+uint16_t const static TRACE_VERSION = 1;
+size_t const static TRACE_HEADER_SIZE = 8;
+uint32_t const static TRACE_STORE = 1u << 26;
+
+/*
+    Writes a binary memory trace, buffering the records so that
+    recording costs little more than a store per access.
+*/
+class TraceWriter {
+public:
+    static const bool ENABLED = true;
+
+    /*
+        @param filename The trace file to create
+    */
+    explicit TraceWriter(const char *filename) : out(filename, ios::binary) {
+        char header[TRACE_HEADER_SIZE] = {0};
+        memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        header[4] = TRACE_VERSION & 0xFF;
+        header[5] = TRACE_VERSION >> 8;
+        out.write(header, sizeof(header));
+    }
+
+    ~TraceWriter() {
+        flush();
+    }
+
+    /*
+        @return false if the file couldn't be created or written
+    */
+    bool good() const {
+        return out.good();
+    }
+
+    void load(uint16_t pc, uint16_t addr) {
+        put(pc | addr << 13);
+    }
+
+    void store(uint16_t pc, uint16_t addr) {
+        put(pc | addr << 13 | TRACE_STORE);
+    }
+
+    void execute(uint16_t, const Decoded &) {}
+    void branch(uint16_t, bool) {}
+
+    bool stop() {
+        return false;
+    }
+
+    void flush() {
+        out.write(buffer, used);
+        out.flush();
+        used = 0;
+    }
+
+private:
+    ofstream out;
+    char buffer[1 << 16];
+    size_t used = 0;
+
+    void put(uint32_t record) {
+        if (used == sizeof(buffer))
+            flush();
+        for (int i = 0; i < 4; i++)
+            buffer[used++] = (record >> (8 * i)) & 0xFF;
+    }
+};
+
+/*
+    Checkpoint file, as written by --checkpoint-every: a snapshot of
+    the machine taken between two instructions, from which --restore
+    resumes the run. The 4-byte magic "E20K" is followed by, all
+    little-endian:
+
+        16 bits   format version (currently 4)
+        16 bits   number of cache levels whose state follows (0 from sim)
+        64 bits   instructions executed before the snapshot
+        16 bits   pc
+        16 bits   each of the NUM_REGS registers
+        16 bits   each of the MEM_SIZE words of memory
+
+    simcache then appends the state of every cache level; sim skips it.
+*/
+const char CHECKPOINT_MAGIC[4] = {'E', '2', '0', 'K'};
+uint16_t const static CHECKPOINT_VERSION = 4;
+size_t const static CHECKPOINT_SIZE = 16 + 2 * (1 + NUM_REGS + MEM_SIZE);
+
+/*
+    The machine state held by a checkpoint. Memory is kept apart, in
+    the array the simulator runs on.
+*/
+struct Checkpoint {
+    uint64_t instructions = 0;
+    uint16_t pc = 0;
+    uint16_t regs[NUM_REGS] = {0};
+    // Number of cache levels saved in caches, and their state
+    uint16_t levels = 0;
+    string caches;
+};
+
+/*
+    Appends the low bytes bytes of value to out, least significant first.
+*/
+void put_le(string &out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++)
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+/*
+    Reads a little-endian value of the given number of bytes.
+*/
+uint64_t read_le(const char *p, size_t bytes) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    uint64_t value = 0;
+    for (size_t i = bytes; i-- > 0; )
+        value = value << 8 | u[i];
+    return value;
+}
+
+/*
+    Writes a checkpoint. The file is written under a temporary name
+    and then renamed, so a crash while saving leaves the previous
+    checkpoint intact.
+
+    @return false if the file couldn't be written
+*/
+bool save_checkpoint(const string &filename, const Checkpoint &state, const uint16_t mem[]) {
+    string out(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    put_le(out, CHECKPOINT_VERSION, 2);
+    put_le(out, state.levels, 2);
+    put_le(out, state.instructions, 8);
+    put_le(out, state.pc, 2);
+    for (size_t reg = 0; reg < NUM_REGS; reg++)
+        put_le(out, state.regs[reg], 2);
+    for (size_t addr = 0; addr < MEM_SIZE; addr++)
+        put_le(out, mem[addr], 2);
+    out += state.caches;
+
+    string temp = filename + ".tmp";
+    ofstream file(temp, ios::binary);
+    file.write(out.data(), out.size());
+    file.close();
+    return !file.fail() && rename(temp.c_str(), filename.c_str()) == 0;
+}
+
+/*
+    Reads a checkpoint into state and mem.
+
+    @return false if the file can't be opened or isn't a checkpoint
+*/
+bool load_checkpoint(const char *filename, Checkpoint &state, uint16_t mem[]) {
+    MappedFile file;
+    if (!file.open(filename) || file.size < CHECKPOINT_SIZE)
+        return false;
+    const char *p = file.data;
+    if (memcmp(p, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 || read_le16(p + 4) != CHECKPOINT_VERSION)
+        return false;
+    state.levels = read_le16(p + 6);
+    state.instructions = read_le(p + 8, 8);
+    state.pc = read_le16(p + 16) & (MEM_SIZE - 1);
+    p += 18;
+    for (size_t reg = 0; reg < NUM_REGS; reg++, p += 2)
+        state.regs[reg] = read_le16(p);
+    for (size_t addr = 0; addr < MEM_SIZE; addr++, p += 2)
+        mem[addr] = read_le16(p);
+    state.caches.assign(p, file.data + file.size);
+    return true;
 }
 
 /*
@@ -80,29 +550,1434 @@ void load_machine_code(ifstream &f, uint16_t mem[]) {
     @param regs Final value of all registers
     @param memory Final value of memory
     @param memquantity How many words of memory to dump
+    @param out Stream to print to; it is left in hex mode
 */
-void print_state(uint16_t pc, uint16_t regs[], uint16_t memory[], size_t memquantity) {
-    cout << setfill(' ');
-    cout << "Final state:" << endl;
-    cout << "\tpc=" <<setw(5)<< pc << endl;
+void print_state(uint16_t pc, uint16_t regs[], uint16_t memory[], size_t memquantity, ostream &out = cout) {
+    out << setfill(' ');
+    out << "Final state:" << endl;
+    out << "\tpc=" <<setw(5)<< pc << endl;
 //uint16_t
     for (size_t reg=0; reg<NUM_REGS; reg++)
-        cout << "\t$" << reg << "="<<setw(5)<<regs[reg]<<endl;
+        out << "\t$" << reg << "="<<setw(5)<<regs[reg]<<endl;
 
-    cout << setfill('0');
+    out << setfill('0');
     bool cr = false;
     for (size_t count=0; count<memquantity; count++) {
-        cout << hex << setw(4) << memory[count] << " ";
+        out << hex << setw(4) << memory[count] << " ";
         cr = true;
         if (count % 8 == 7) {
-            cout << endl;
+            out << endl;
             cr = false;
         }
     }
     if (cr)
-        cout << endl;
+        out << endl;
+}
+
+/*
+    Runs the program in mem until it halts, that is, until an
+    instruction jumps to its own address. Each memory word is decoded
+    the first time it is executed and the decoded form is reused
+    afterwards; a sw into a word only invalidates that word's slot.
+
+    @param mem Memory holding the program, updated by sw
+    @param final_regs Register values, updated in place
+    @param final_pc Initial program counter, set to the final one on return
+    @param trace Told about every lw and sw, e.g. a TraceWriter, and
+        about every instruction executed and every jeq; it can end the
+        run early by returning true from trace.stop(), which is asked
+        before every instruction
+    @return false if the tracer stopped the run before the halt
+*/
+template <class Tracer>
+bool simulate(uint16_t mem[], uint16_t final_regs[], uint16_t &final_pc, Tracer &trace) {
+    // One decode cache per thread, so that --batch can run programs
+    // side by side
+    static thread_local Decoded cache[MEM_SIZE];
+    Decoded *code = cache;
+    for (size_t i = 0; i < MEM_SIZE; i++)
+        code[i].op = OP_DECODE;
+
+    // Work on local copies so that stores into mem cannot alias them.
+    // The extra register is the target of traced loads into $0.
+    uint16_t pc = final_pc;
+    uint16_t regs[NUM_REGS + 1];
+    for (size_t reg = 0; reg < NUM_REGS; reg++)
+        regs[reg] = final_regs[reg];
+    bool halted = true;
+    while (true) {
+        Decoded d = code[pc];
+        uint16_t target;
+        if (d.op != OP_DECODE && trace.stop()) {
+            halted = false;
+            break;
+        }
+        trace.execute(pc, d);
+        switch (d.op) {
+        case OP_DECODE:
+            code[pc] = decode(mem[pc], Tracer::ENABLED);
+            continue;
+        case OP_NOP:
+            break;
+        case OP_ADD:
+            regs[d.dst] = regs[d.regA] + regs[d.regB];
+            break;
+        case OP_SUB:
+            regs[d.dst] = regs[d.regA] - regs[d.regB];
+            break;
+        case OP_OR:
+            regs[d.dst] = regs[d.regA] | regs[d.regB];
+            break;
+        case OP_AND:
+            regs[d.dst] = regs[d.regA] & regs[d.regB];
+            break;
+        case OP_SLT:
+            regs[d.dst] = static_cast<int16_t>(regs[d.regA]) < static_cast<int16_t>(regs[d.regB]) ? 1 : 0;
+            break;
+        case OP_SLTI:
+            regs[d.dst] = static_cast<int16_t>(regs[d.regA]) < static_cast<int16_t>(d.imm) ? 1 : 0;
+            break;
+        case OP_LW: {
+            uint16_t addr = isoverflow(regs[d.regA] + d.imm);
+            trace.load(pc, addr);
+            regs[d.dst] = mem[addr];
+            break;
+        }
+        case OP_SW: {
+            uint16_t addr = isoverflow(regs[d.regA] + d.imm);
+            trace.store(pc, addr);
+            mem[addr] = regs[d.regB];
+            code[addr].op = OP_DECODE;
+            break;
+        }
+        case OP_ADDI:
+            regs[d.dst] = regs[d.regA] + d.imm;
+            break;
+        // Only control transfers can jump to their own address, so
+        // they are the only instructions that check for a halt.
+        case OP_JR:
+            target = isoverflow(regs[d.regA]);
+            if (target == pc)
+                goto halt;
+            pc = target;
+            continue;
+        case OP_J:
+            if (d.imm == pc)
+                goto halt;
+            pc = d.imm;
+            continue;
+        case OP_JAL:
+            regs[7] = pc + 1;
+            if (d.imm == pc)
+                goto halt;
+            pc = d.imm;
+            continue;
+        case OP_JEQ:
+            trace.branch(pc, regs[d.regA] == regs[d.regB]);
+            if (regs[d.regA] != regs[d.regB])
+                break;
+            target = pc + 1 + d.imm;
+            if (target == pc)
+                goto halt;
+            pc = isoverflow(target);
+            continue;
+        }
+        pc = isoverflow(pc + 1);
+    }
+halt:
+    final_pc = pc;
+    for (size_t reg = 0; reg < NUM_REGS; reg++)
+        final_regs[reg] = regs[reg];
+    return halted;
+}
+
+/*
+    Tracer for simulate that ignores every access.
+*/
+struct NoTrace {
+    static const bool ENABLED = false;
+    void load(uint16_t, uint16_t) {}
+    void store(uint16_t, uint16_t) {}
+    void execute(uint16_t, const Decoded &) {}
+    void branch(uint16_t, bool) {}
+    bool stop() { return false; }
+};
+
+void simulate(uint16_t mem[], uint16_t final_regs[], uint16_t &final_pc) {
+    NoTrace trace;
+    simulate(mem, final_regs, final_pc, trace);
+}
+
+/*
+    Tracer for simulate that stops the run once limit instructions
+    have been executed, so that a checkpoint can be taken there.
+*/
+struct Checkpointer {
+    static const bool ENABLED = false;
+    // Instructions executed so far, including those before a restore
+    uint64_t instructions = 0;
+    uint64_t limit = 0;
+
+    void load(uint16_t, uint16_t) {}
+    void store(uint16_t, uint16_t) {}
+    void execute(uint16_t, const Decoded &) {}
+    void branch(uint16_t, bool) {}
+
+    bool stop() {
+        if (instructions == limit)
+            return true;
+        instructions++;
+        return false;
+    }
+};
+
+/*
+    Tracer for simulate that times the instructions on a classic
+    in-order five-stage pipeline: fetch, decode, execute, memory and
+    writeback, one instruction per stage. Fetch predicts every branch
+    not taken. A j or jal is redirected in decode, costing one bubble;
+    a taken jeq and a jr are resolved in execute, costing two. With
+    forwarding, a result reaches the execute stage of the next
+    instruction, except that a lw's value comes a cycle later (the
+    load-use stall). Without it, a consumer waits in decode until the
+    producer has written the register file, which is written in the
+    first half of a cycle and read in the second.
+*/
+struct PipelineModel {
+    static const bool ENABLED = true;
+    bool forwarding = true;
+
+    uint64_t instructions = 0;
+    // Bubbles and stalls, by cause
+    uint64_t load_use = 0;
+    uint64_t data = 0;
+    uint64_t branch_flush = 0;
+    uint64_t jump_flush = 0;
+
+    void load(uint16_t, uint16_t) {}
+    void store(uint16_t, uint16_t) {}
+
+    void execute(uint16_t, const Decoded &d) {
+        if (d.op == OP_DECODE)
+            return;
+        instructions++;
+        uint64_t at = ex + 1 + bubbles;
+        if (bubbles != 0)
+            *bubble_cause += bubbles;
+        bubbles = 0;
+
+        uint8_t sources[2];
+        size_t count = 0;
+        switch (d.op) {
+        case OP_ADD: case OP_SUB: case OP_OR: case OP_AND: case OP_SLT:
+        case OP_SW: case OP_JEQ:
+            sources[count++] = d.regA;
+            sources[count++] = d.regB;
+            break;
+        case OP_SLTI: case OP_ADDI: case OP_LW: case OP_JR:
+            sources[count++] = d.regA;
+            break;
+        }
+        uint64_t start = at;
+        bool waits_for_load = false;
+        for (size_t i = 0; i < count; i++)
+            if (sources[i] != 0 && ready[sources[i]] > start) {
+                start = ready[sources[i]];
+                waits_for_load = loaded[sources[i]];
+            }
+        (waits_for_load ? load_use : data) += start - at;
+        ex = start;
+
+        switch (d.op) {
+        case OP_ADD: case OP_SUB: case OP_OR: case OP_AND: case OP_SLT:
+        case OP_SLTI: case OP_ADDI: case OP_LW:
+            produce(d.dst, d.op == OP_LW);
+            break;
+        case OP_JAL:
+            produce(7, false);
+            set_bubbles(1, jump_flush);
+            break;
+        case OP_J:
+            set_bubbles(1, jump_flush);
+            break;
+        case OP_JR:
+            set_bubbles(2, jump_flush);
+            break;
+        }
+    }
+
+    void branch(uint16_t, bool taken) {
+        if (taken)
+            set_bubbles(2, branch_flush);
+    }
+
+    bool stop() {
+        return false;
+    }
+
+    // The last instruction leaves writeback two cycles after execute
+    uint64_t cycles() const {
+        return instructions == 0 ? 0 : ex + 2;
+    }
+
+private:
+    // The first instruction is in execute in cycle 3
+    uint64_t ex = 2;
+    // Bubbles before the next instruction, counted once it comes
+    uint64_t bubbles = 0;
+    uint64_t *bubble_cause = nullptr;
+    // First cycle in which an instruction reading each register can
+    // be in execute, and whether that register was last loaded by lw.
+    // The extra register takes loads into $0.
+    uint64_t ready[NUM_REGS + 1] = {0};
+    bool loaded[NUM_REGS + 1] = {false};
+
+    void produce(uint8_t reg, bool is_load) {
+        ready[reg] = ex + (!forwarding ? 3 : is_load ? 2 : 1);
+        loaded[reg] = is_load;
+    }
+
+    void set_bubbles(uint64_t count, uint64_t &cause) {
+        bubbles = count;
+        bubble_cause = &cause;
+    }
+};
+
+/*
+    Prints the timing of a run on the pipeline model: the cycles, CPI
+    and the cycles lost to every kind of hazard.
+*/
+void print_pipeline(const PipelineModel &model, ostream &out = cout) {
+    uint64_t cycles = model.cycles();
+    out << dec << setfill(' ') << fixed << setprecision(3);
+    out << "Pipeline timing (forwarding " << (model.forwarding ? "on" : "off") << "):" << endl;
+    out << "\tinstructions=" << model.instructions << endl;
+    out << "\tcycles=" << cycles << endl;
+    out << "\tCPI=" << (model.instructions ? double(cycles) / model.instructions : 0.0) << endl;
+    out << "Stall cycles:" << endl;
+    out << "\tfill=" << (model.instructions ? 4 : 0) << endl;
+    out << "\tload-use=" << model.load_use << endl;
+    out << "\tdata=" << model.data << endl;
+    out << "\tbranch=" << model.branch_flush << endl;
+    out << "\tjump=" << model.jump_flush << endl;
 }
 
+// Names of the operations, indexed by Op. OP_NOP covers every
+// instruction whose only effect is a write to $0.
+const char *const OP_NAMES[] = {
+    "decode", "nop", "add", "sub", "or", "and", "slt", "jr",
+    "slti", "lw", "sw", "addi", "j", "jal", "jeq"
+};
+size_t const static NUM_OPS = OP_JEQ + 1;
+
+/*
+    Cycles taken by each operation, for the cycle estimate of
+    --profile. A taken jeq costs jeq_taken instead of cycles[OP_JEQ].
+*/
+struct LatencyTable {
+    unsigned cycles[NUM_OPS];
+    unsigned jeq_taken;
+
+    LatencyTable() {
+        for (size_t op = 0; op < NUM_OPS; op++)
+            cycles[op] = 1;
+        cycles[OP_DECODE] = 0;
+        cycles[OP_LW] = 3;
+        cycles[OP_SW] = 2;
+        cycles[OP_J] = cycles[OP_JAL] = cycles[OP_JR] = 2;
+        jeq_taken = 3;
+    }
+
+    /*
+        Overrides latencies from a list like "lw=4,jeq_taken=2".
+
+        @return false if the list names an unknown operation or a
+            latency isn't a non-negative number
+    */
+    bool parse(const string &list) {
+        size_t start = 0;
+        while (start < list.size()) {
+            size_t end = list.find(',', start);
+            if (end == string::npos)
+                end = list.size();
+            string item = list.substr(start, end - start);
+            size_t eq = item.find('=');
+            if (eq == string::npos)
+                return false;
+            string name = item.substr(0, eq);
+            const char *digits = item.c_str() + eq + 1;
+            char *stop;
+            long number = strtol(digits, &stop, 10);
+            // strtol would take a sign or leading blanks
+            if (*digits < '0' || *digits > '9' || *stop != '\0' ||
+                static_cast<unsigned>(number) != number)
+                return false;
+            unsigned value = number;
+            if (name == "jeq_taken")
+                jeq_taken = value;
+            else {
+                size_t op = 1;
+                while (op < NUM_OPS && name != OP_NAMES[op])
+                    op++;
+                if (op == NUM_OPS)
+                    return false;
+                cycles[op] = value;
+            }
+            start = end + 1;
+        }
+        return true;
+    }
+};
+
+/*
+    Tracer for simulate that counts how often every operation and
+    every pc is executed, and how often every jeq is taken. The
+    counters only exist in this tracer, so runs without --profile
+    don't pay for them.
+*/
+struct Profiler {
+    static const bool ENABLED = true;
+    uint64_t ops[NUM_OPS] = {0};
+    uint64_t pcs[MEM_SIZE] = {0};
+    uint64_t taken[MEM_SIZE] = {0};
+    uint8_t op_at[MEM_SIZE] = {0};
+
+    void load(uint16_t, uint16_t) {}
+    void store(uint16_t, uint16_t) {}
+
+    void execute(uint16_t pc, const Decoded &d) {
+        // A slot that still has to be decoded is executed right after
+        if (d.op == OP_DECODE)
+            return;
+        ops[d.op]++;
+        pcs[pc]++;
+        op_at[pc] = d.op;
+    }
+
+    void branch(uint16_t pc, bool is_taken) {
+        taken[pc] += is_taken;
+    }
+
+    bool stop() {
+        return false;
+    }
+
+    uint64_t instructions() const {
+        uint64_t total = 0;
+        for (size_t op = 0; op < NUM_OPS; op++)
+            total += ops[op];
+        return total;
+    }
+
+    uint64_t cycles(const LatencyTable &latency) const {
+        uint64_t total = 0, total_taken = 0;
+        for (size_t op = 0; op < NUM_OPS; op++)
+            total += ops[op] * latency.cycles[op];
+        for (size_t pc = 0; pc < MEM_SIZE; pc++)
+            total_taken += taken[pc];
+        return total + total_taken * latency.jeq_taken - total_taken * latency.cycles[OP_JEQ];
+    }
+
+    // Cycle estimate of everything executed at pc, as if it all was
+    // the operation last executed there
+    uint64_t cycles_at(uint16_t pc, const LatencyTable &latency) const {
+        uint64_t cycles = pcs[pc] * latency.cycles[op_at[pc]];
+        if (op_at[pc] == OP_JEQ)
+            cycles += taken[pc] * latency.jeq_taken - taken[pc] * latency.cycles[OP_JEQ];
+        return cycles;
+    }
+
+    // The pcs that were executed, most executed first
+    vector<uint16_t> hot_spots() const {
+        vector<uint16_t> order;
+        for (size_t pc = 0; pc < MEM_SIZE; pc++)
+            if (pcs[pc] != 0)
+                order.push_back(pc);
+        stable_sort(order.begin(), order.end(), [this](uint16_t a, uint16_t b) {
+            return pcs[a] > pcs[b];
+        });
+        return order;
+    }
+};
+
+/*
+    Prints the operation counts, the cycle estimate and the hot spots
+    of a profile, in that order.
+
+    @param limit How many of the most executed pcs to list
+*/
+void print_profile(const Profiler &profile, const LatencyTable &latency, size_t limit, ostream &out = cout) {
+    uint64_t total = profile.instructions();
+    uint64_t cycles = profile.cycles(latency);
+    out << dec << setfill(' ') << fixed << setprecision(2);
+    out << "Profile:" << endl;
+    out << "\tinstructions=" << total << endl;
+    out << "\tcycles=" << cycles << " (CPI " << (total ? double(cycles) / total : 0.0) << ")" << endl;
+    out << "Operations:" << endl;
+    for (size_t op = 1; op < NUM_OPS; op++)
+        if (profile.ops[op] != 0)
+            out << "\t" << left << setw(6) << OP_NAMES[op] << right << setw(14) << profile.ops[op]
+                << setw(8) << 100.0 * profile.ops[op] / total << "%" << endl;
+    out << "Hot spots:" << endl;
+    out << "\t   pc  op             count       %        cycles  jeq taken" << endl;
+    vector<uint16_t> order = profile.hot_spots();
+    for (size_t i = 0; i < order.size() && i < limit; i++) {
+        uint16_t pc = order[i];
+        out << "\t" << setw(5) << pc << "  " << left << setw(6) << OP_NAMES[profile.op_at[pc]] << right
+            << setw(14) << profile.pcs[pc] << setw(8) << 100.0 * profile.pcs[pc] / total
+            << setw(14) << profile.cycles_at(pc, latency);
+        if (profile.op_at[pc] == OP_JEQ)
+            out << setw(10) << 100.0 * profile.taken[pc] / profile.pcs[pc] << "%";
+        out << endl;
+    }
+}
+
+/*
+    Writes a profile as JSON: the totals, the latency table, the count
+    of every operation and every executed pc, most executed first.
+
+    @return false if the file couldn't be written
+*/
+bool write_profile_json(const char *filename, const Profiler &profile, const LatencyTable &latency) {
+    ofstream out(filename);
+    out << "{\n  \"instructions\": " << profile.instructions() << ",\n  \"cycles\": " << profile.cycles(latency) << ",\n";
+    out << "  \"latency\": {";
+    for (size_t op = 1; op < NUM_OPS; op++)
+        out << "\"" << OP_NAMES[op] << "\": " << latency.cycles[op] << ", ";
+    out << "\"jeq_taken\": " << latency.jeq_taken << "},\n";
+    out << "  \"operations\": {";
+    for (size_t op = 1; op < NUM_OPS; op++)
+        out << (op > 1 ? ", " : "") << "\"" << OP_NAMES[op] << "\": " << profile.ops[op];
+    out << "},\n  \"pcs\": [";
+    vector<uint16_t> order = profile.hot_spots();
+    for (size_t i = 0; i < order.size(); i++) {
+        uint16_t pc = order[i];
+        out << (i ? ",\n" : "\n") << "    {\"pc\": " << pc << ", \"op\": \"" << OP_NAMES[profile.op_at[pc]]
+            << "\", \"count\": " << profile.pcs[pc] << ", \"cycles\": " << profile.cycles_at(pc, latency);
+        if (profile.op_at[pc] == OP_JEQ)
+            out << ", \"taken\": " << profile.taken[pc] << ", \"not_taken\": " << profile.pcs[pc] - profile.taken[pc];
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.good();
+}
+
+/*
+    Same as simulate, but with direct-threaded dispatch: every decoded
+    slot holds the address of the code that executes it, and every
+    handler jumps straight to the handler of the next instruction.
+    This relies on the GCC labels-as-values extension; other compilers
+    fall back to the switch-based simulate.
+
+    @param mem Memory holding the program, updated by sw
+    @param final_regs Register values, updated in place
+    @param final_pc Initial program counter, set to the final one on return
+*/
+void simulate_threaded(uint16_t mem[], uint16_t final_regs[], uint16_t &final_pc) {
+#if defined(__GNUC__)
+    // Indexed by Op
+    static void *const handlers[] = {
+        &&do_decode, &&do_nop,
+        &&do_add, &&do_sub, &&do_or, &&do_and, &&do_slt, &&do_jr,
+        &&do_slti, &&do_lw, &&do_sw, &&do_addi, &&do_j, &&do_jal, &&do_jeq
+    };
+    struct Slot {
+        void *handler;
+        Decoded d;
+    };
+    static thread_local Slot cache[MEM_SIZE];
+    Slot *code = cache;
+    for (size_t i = 0; i < MEM_SIZE; i++)
+        code[i].handler = &&do_decode;
+
+    uint16_t pc = final_pc;
+    uint16_t regs[NUM_REGS];
+    for (size_t reg = 0; reg < NUM_REGS; reg++)
+        regs[reg] = final_regs[reg];
+    const Decoded *d;
+    uint16_t target;
+
+#define DISPATCH() do { d = &code[pc].d; goto *code[pc].handler; } while (0)
+#define NEXT() do { pc = isoverflow(pc + 1); DISPATCH(); } while (0)
+
+    DISPATCH();
+
+do_decode:
+    code[pc].d = decode(mem[pc]);
+    code[pc].handler = handlers[code[pc].d.op];
+    DISPATCH();
+do_nop:
+    NEXT();
+do_add:
+    regs[d->dst] = regs[d->regA] + regs[d->regB];
+    NEXT();
+do_sub:
+    regs[d->dst] = regs[d->regA] - regs[d->regB];
+    NEXT();
+do_or:
+    regs[d->dst] = regs[d->regA] | regs[d->regB];
+    NEXT();
+do_and:
+    regs[d->dst] = regs[d->regA] & regs[d->regB];
+    NEXT();
+do_slt:
+    regs[d->dst] = static_cast<int16_t>(regs[d->regA]) < static_cast<int16_t>(regs[d->regB]) ? 1 : 0;
+    NEXT();
+do_slti:
+    regs[d->dst] = static_cast<int16_t>(regs[d->regA]) < static_cast<int16_t>(d->imm) ? 1 : 0;
+    NEXT();
+do_lw:
+    regs[d->dst] = mem[isoverflow(regs[d->regA] + d->imm)];
+    NEXT();
+do_sw:
+    target = isoverflow(regs[d->regA] + d->imm);
+    mem[target] = regs[d->regB];
+    code[target].handler = &&do_decode;
+    NEXT();
+do_addi:
+    regs[d->dst] = regs[d->regA] + d->imm;
+    NEXT();
+do_jr:
+    target = isoverflow(regs[d->regA]);
+    if (target == pc)
+        goto halt;
+    pc = target;
+    DISPATCH();
+do_j:
+    if (d->imm == pc)
+        goto halt;
+    pc = d->imm;
+    DISPATCH();
+do_jal:
+    regs[7] = pc + 1;
+    if (d->imm == pc)
+        goto halt;
+    pc = d->imm;
+    DISPATCH();
+do_jeq:
+    if (regs[d->regA] != regs[d->regB])
+        NEXT();
+    target = pc + 1 + d->imm;
+    if (target == pc)
+        goto halt;
+    pc = isoverflow(target);
+    DISPATCH();
+
+#undef NEXT
+#undef DISPATCH
+
+halt:
+    final_pc = pc;
+    for (size_t reg = 0; reg < NUM_REGS; reg++)
+        final_regs[reg] = regs[reg];
+#else
+    simulate(mem, final_regs, final_pc);
+#endif
+}
+
+#ifdef E20_HAVE_JIT
+/*
+    Basic-block compiler from E20 to x86-64.
+
+    A block starts at a jump target (or after a block that was cut
+    off at MAX_BLOCK instructions) and ends with the first control
+    transfer. Once a block start has been reached HOT_THRESHOLD times
+    it is compiled into an executable buffer. Inside compiled code
+    register $k lives in host register r8+k, with r8 kept at zero for
+    $0; rbx points at mem, rsi at the covered map and rbp at the entry
+    table.
+
+    Block exits with a known target jump straight into the target's
+    compiled code. If the target is not compiled yet, the exit returns
+    to simulate_jit, and its jump is patched once the target is
+    compiled. A sw into a word covered by compiled code leaves the
+    block and throws away every translation.
+*/
+class E20Jit {
+public:
+    static const size_t BUFFER_SIZE = 4 << 20;
+    static const size_t MAX_BLOCK = 64;
+    static const uint32_t HOT_THRESHOLD = 50;
+    // Flags returned next to the pc by compiled code
+    static const uint32_t HALT = 1 << 16;
+    static const uint32_t FLUSH = 1 << 17;
+
+    void *entry[MEM_SIZE];
+    uint8_t covered[MEM_SIZE];
+    uint32_t hits[MEM_SIZE];
+
+    E20Jit() {
+        void *p = mmap(nullptr, BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        buf = (p == MAP_FAILED) ? nullptr : static_cast<uint8_t *>(p);
+        if (buf != nullptr)
+            emit_trampoline();
+        flush();
+    }
+
+    ~E20Jit() {
+        if (buf != nullptr)
+            munmap(buf, BUFFER_SIZE);
+    }
+
+    bool ok() const {
+        return buf != nullptr;
+    }
+
+    /*
+        Drops every translation.
+    */
+    void flush() {
+        used = code_start;
+        memset(entry, 0, sizeof(entry));
+        memset(covered, 0, sizeof(covered));
+        memset(hits, 0, sizeof(hits));
+        for (size_t i = 0; i < MEM_SIZE; i++)
+            pending[i].clear();
+    }
+
+    /*
+        Runs compiled code starting with the block at pc.
+
+        @return The pc where execution left compiled code, or'ed
+            with HALT or FLUSH
+    */
+    uint32_t run(uint16_t regs[], uint16_t mem[], uint16_t pc) {
+        typedef uint32_t (*EnterFn)(uint16_t *, uint16_t *, uint8_t *, void *, void **);
+        EnterFn enter = reinterpret_cast<EnterFn>(buf);
+        return enter(regs, mem, covered, entry[pc], entry);
+    }
+
+    /*
+        Translates the block starting at pc.
+
+        @return false if the buffer is full; the caller should flush
+    */
+    bool compile(uint16_t mem[], uint16_t pc) {
+        if (BUFFER_SIZE - used < 64 * MAX_BLOCK)
+            return false;
+        size_t start = used;
+        uint16_t p = pc;
+        for (size_t count = 1; ; count++) {
+            covered[p] = 1;
+            Decoded d = decode(mem[p]);
+            uint16_t next = isoverflow(p + 1);
+            int A = 8 + d.regA, B = 8 + d.regB, D = 8 + d.dst;
+            switch (d.op) {
+            case OP_NOP:
+                break;
+            case OP_ADD: alu_rr(0x03, D, A, B); break;
+            case OP_SUB: alu_rr(0x2B, D, A, B); break;
+            case OP_OR: alu_rr(0x0B, D, A, B); break;
+            case OP_AND: alu_rr(0x23, D, A, B); break;
+            case OP_SLT:
+                emit(0x31); emit(0xC0);                     // xor eax, eax
+                emit(0x66); rr(0x39, B, A);                 // cmp A16, B16
+                emit(0x0F); emit(0x9C); emit(0xC0);         // setl al
+                rr(0x89, 0, D);                             // mov D, eax
+                break;
+            case OP_SLTI:
+                emit(0x31); emit(0xC0);                     // xor eax, eax
+                emit(0x66); rr(0x81, 7, A);                 // cmp A16, imm16
+                emit16(d.imm);
+                emit(0x0F); emit(0x9C); emit(0xC0);         // setl al
+                rr(0x89, 0, D);                             // mov D, eax
+                break;
+            case OP_ADDI:
+                rr(0x8B, 0, A);                             // mov eax, A
+                emit(0x05); emit32(static_cast<int16_t>(d.imm)); // add eax, imm
+                rr2(0xB7, D, 0);                            // movzx D, ax
+                break;
+            case OP_LW:
+                address(A, d.imm);
+                mem_op(0, 0xB7, D);                         // movzx D, [rbx+rax*2]
+                break;
+            case OP_SW:
+                address(A, d.imm);
+                emit(0x66); mem_op(0x89, 0, B);             // mov [rbx+rax*2], B16
+                emit(0x80); emit(0x3C); emit(0x06); emit(0x00); // cmp byte [rsi+rax], 0
+                emit(0x0F); emit(0x85);                     // jne flush exit
+                {
+                    size_t jump = used;
+                    emit32(0);
+                    size_t skip = jmp8();
+                    patch32(jump, used);
+                    exit_to(next | FLUSH);
+                    patch8(skip, used);
+                }
+                break;
+            case OP_J:
+            case OP_JAL:
+                if (d.op == OP_JAL) {
+                    emit(0x41); emit(0xBF); emit32(static_cast<uint16_t>(p + 1)); // mov r15d, pc+1
+                }
+                if (d.imm == p)
+                    exit_to(p | HALT);
+                else
+                    chain(d.imm);
+                return finish(pc, start);
+            case OP_JR:
+                rr(0x8B, 0, A);                             // mov eax, A
+                emit(0x25); emit32(MEM_SIZE - 1);           // and eax, 0x1FFF
+                emit(0x3D); emit32(p);                      // cmp eax, pc
+                emit(0x0F); emit(0x85);                     // jne dynamic exit
+                {
+                    size_t jump = used;
+                    emit32(0);
+                    exit_to(p | HALT);
+                    patch32(jump, used);
+                }
+                emit(0x48); emit(0x8B); emit(0x4C); emit(0xC5); emit(0x00); // mov rcx, [rbp+rax*8]
+                emit(0x48); emit(0x85); emit(0xC9);         // test rcx, rcx
+                emit(0x0F); emit(0x84);                     // jz epilogue, with eax = target
+                emit32(static_cast<uint32_t>(epilogue - (used + 4)));
+                emit(0xFF); emit(0xE1);                     // jmp rcx
+                return finish(pc, start);
+            case OP_JEQ: {
+                uint16_t target = p + 1 + d.imm;
+                rr(0x39, B, A);                             // cmp A, B
+                emit(0x0F); emit(0x85);                     // jne not taken
+                size_t jump = used;
+                emit32(0);
+                if (target == p)
+                    exit_to(p | HALT);
+                else
+                    chain(isoverflow(target));
+                patch32(jump, used);
+                chain(next);
+                return finish(pc, start);
+            }
+            }
+            p = next;
+            if (count == MAX_BLOCK) {
+                chain(p);
+                return finish(pc, start);
+            }
+        }
+    }
+
+private:
+    uint8_t *buf;
+    size_t used;
+    size_t code_start;
+    size_t epilogue;
+    // Offsets of rel32 exit jumps waiting for their target to be compiled
+    vector<uint32_t> pending[MEM_SIZE];
+
+    void emit(uint8_t byte) {
+        buf[used++] = byte;
+    }
+
+    void emit16(uint16_t value) {
+        memcpy(buf + used, &value, 2);
+        used += 2;
+    }
+
+    void emit32(uint32_t value) {
+        memcpy(buf + used, &value, 4);
+        used += 4;
+    }
+
+    // Makes the rel32 at offset jump to target
+    void patch32(size_t offset, size_t target) {
+        uint32_t rel = static_cast<uint32_t>(target - (offset + 4));
+        memcpy(buf + offset, &rel, 4);
+    }
+
+    // jmp rel8 with a placeholder, returns the offset of the rel8
+    size_t jmp8() {
+        emit(0xEB);
+        emit(0);
+        return used - 1;
+    }
+
+    void patch8(size_t offset, size_t target) {
+        buf[offset] = static_cast<uint8_t>(target - (offset + 1));
+    }
+
+    // REX prefix for a reg/rm pair of host registers, if one is needed
+    void rex(int reg, int rm) {
+        if (reg >= 8 || rm >= 8)
+            emit(0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+    }
+
+    // op with a register-direct ModRM byte
+    void rr(uint8_t op, int reg, int rm) {
+        rex(reg, rm);
+        emit(op);
+        emit(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // Two-byte 0F op with a register-direct ModRM byte
+    void rr2(uint8_t op, int reg, int rm) {
+        rex(reg, rm);
+        emit(0x0F);
+        emit(op);
+        emit(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // op (or 0F op2 if op is 0) on [rbx+rax*2]
+    void mem_op(uint8_t op, uint8_t op2, int reg) {
+        rex(reg, 0);
+        if (op == 0) {
+            emit(0x0F);
+            emit(op2);
+        } else
+            emit(op);
+        emit(0x04 | ((reg & 7) << 3));
+        emit(0x43);
+    }
+
+    // eax = A op B, D = zero-extended ax
+    void alu_rr(uint8_t op, int D, int A, int B) {
+        rr(0x8B, 0, A);                                     // mov eax, A
+        rr(op, 0, B);                                       // op eax, B
+        rr2(0xB7, D, 0);                                    // movzx D, ax
+    }
+
+    // eax = (A + imm) & 0x1FFF
+    void address(int A, uint16_t imm) {
+        rr(0x8B, 0, A);                                     // mov eax, A
+        emit(0x05); emit32(static_cast<int16_t>(imm));      // add eax, imm
+        emit(0x25); emit32(MEM_SIZE - 1);                   // and eax, 0x1FFF
+    }
+
+    // Leaves compiled code returning value
+    void exit_to(uint32_t value) {
+        emit(0xB8); emit32(value);                          // mov eax, value
+        emit(0xE9);                                         // jmp epilogue
+        emit32(static_cast<uint32_t>(epilogue - (used + 4)));
+    }
+
+    // Continues at target, directly if it is compiled
+    void chain(uint16_t target) {
+        emit(0xE9);
+        size_t jump = used;
+        emit32(0);
+        if (entry[target] != nullptr) {
+            patch32(jump, static_cast<uint8_t *>(entry[target]) - buf);
+            return;
+        }
+        exit_to(target);
+        pending[target].push_back(jump);
+    }
+
+    bool finish(uint16_t pc, size_t start) {
+        entry[pc] = buf + start;
+        for (uint32_t jump : pending[pc])
+            patch32(jump, start);
+        pending[pc].clear();
+        return true;
+    }
+
+    /*
+        enter(regs, mem, covered, code, entry) saves the callee-saved
+        registers, loads the E20 registers and jumps to code. Exits
+        jump to the epilogue with the return value in eax.
+    */
+    void emit_trampoline() {
+        used = 0;
+        emit(0x53); emit(0x55);                             // push rbx, rbp
+        emit(0x41); emit(0x54); emit(0x41); emit(0x55);     // push r12, r13
+        emit(0x41); emit(0x56); emit(0x41); emit(0x57);     // push r14, r15
+        emit(0x48); emit(0x89); emit(0xF3);                 // mov rbx, rsi
+        emit(0x48); emit(0x89); emit(0xD6);                 // mov rsi, rdx
+        emit(0x4C); emit(0x89); emit(0xC5);                 // mov rbp, r8
+        emit(0x48); emit(0x89); emit(0xC8);                 // mov rax, rcx
+        emit(0x45); emit(0x31); emit(0xC0);                 // xor r8d, r8d
+        for (int reg = 1; reg < static_cast<int>(NUM_REGS); reg++) {
+            emit(0x44); emit(0x0F); emit(0xB7);             // movzx r8+reg, [rdi+2*reg]
+            emit(0x47 | (reg << 3)); emit(2 * reg);
+        }
+        emit(0xFF); emit(0xE0);                             // jmp rax
+        epilogue = used;
+        for (int reg = 1; reg < static_cast<int>(NUM_REGS); reg++) {
+            emit(0x66); emit(0x44); emit(0x89);             // mov [rdi+2*reg], r8+reg
+            emit(0x47 | (reg << 3)); emit(2 * reg);
+        }
+        emit(0x41); emit(0x5F); emit(0x41); emit(0x5E);     // pop r15, r14
+        emit(0x41); emit(0x5D); emit(0x41); emit(0x5C);     // pop r13, r12
+        emit(0x5D); emit(0x5B);                             // pop rbp, rbx
+        emit(0xC3);                                         // ret
+        code_start = used;
+    }
+};
+#endif
+
+/*
+    Same as simulate, but hot basic blocks are compiled to native
+    x86-64 code by E20Jit; everything else is interpreted one block
+    at a time. Falls back to simulate where the JIT is not available.
+
+    @param mem Memory holding the program, updated by sw
+    @param final_regs Register values, updated in place
+    @param final_pc Initial program counter, set to the final one on return
+*/
+void simulate_jit(uint16_t mem[], uint16_t final_regs[], uint16_t &final_pc) {
+#ifdef E20_HAVE_JIT
+    static thread_local E20Jit jit;
+    if (!jit.ok()) {
+        cerr << "Can't allocate executable memory, JIT disabled" << endl;
+        simulate(mem, final_regs, final_pc);
+        return;
+    }
+    // Translations of an earlier program run on this thread are stale
+    jit.flush();
+
+    uint16_t pc = final_pc;
+    uint16_t regs[NUM_REGS];
+    for (size_t reg = 0; reg < NUM_REGS; reg++)
+        regs[reg] = final_regs[reg];
+
+    while (true) {
+        if (jit.entry[pc] != nullptr) {
+            uint32_t result = jit.run(regs, mem, pc);
+            pc = result & 0xFFFF;
+            if (result & E20Jit::HALT)
+                break;
+            if (result & E20Jit::FLUSH)
+                jit.flush();
+            continue;
+        }
+        if (++jit.hits[pc] >= E20Jit::HOT_THRESHOLD) {
+            if (!jit.compile(mem, pc))
+                jit.flush();
+            continue;
+        }
+
+        // Interpret one block
+        bool halted = false;
+        for (size_t count = 0; count < E20Jit::MAX_BLOCK; count++) {
+            Decoded d = decode(mem[pc]);
+            uint16_t pc_next = pc + 1;
+            bool jumped = true;
+            switch (d.op) {
+            case OP_NOP: jumped = false; break;
+            case OP_ADD: regs[d.dst] = regs[d.regA] + regs[d.regB]; jumped = false; break;
+            case OP_SUB: regs[d.dst] = regs[d.regA] - regs[d.regB]; jumped = false; break;
+            case OP_OR: regs[d.dst] = regs[d.regA] | regs[d.regB]; jumped = false; break;
+            case OP_AND: regs[d.dst] = regs[d.regA] & regs[d.regB]; jumped = false; break;
+            case OP_SLT:
+                regs[d.dst] = static_cast<int16_t>(regs[d.regA]) < static_cast<int16_t>(regs[d.regB]) ? 1 : 0;
+                jumped = false;
+                break;
+            case OP_SLTI:
+                regs[d.dst] = static_cast<int16_t>(regs[d.regA]) < static_cast<int16_t>(d.imm) ? 1 : 0;
+                jumped = false;
+                break;
+            case OP_LW:
+                regs[d.dst] = mem[isoverflow(regs[d.regA] + d.imm)];
+                jumped = false;
+                break;
+            case OP_SW: {
+                uint16_t addr = isoverflow(regs[d.regA] + d.imm);
+                mem[addr] = regs[d.regB];
+                if (jit.covered[addr])
+                    jit.flush();
+                jumped = false;
+                break;
+            }
+            case OP_ADDI: regs[d.dst] = regs[d.regA] + d.imm; jumped = false; break;
+            case OP_JR: pc_next = isoverflow(regs[d.regA]); break;
+            case OP_J: pc_next = d.imm; break;
+            case OP_JAL: regs[7] = pc_next; pc_next = d.imm; break;
+            case OP_JEQ:
+                if (regs[d.regA] == regs[d.regB])
+                    pc_next += d.imm;
+                break;
+            }
+            if (pc_next == pc) {
+                halted = true;
+                break;
+            }
+            pc = isoverflow(pc_next);
+            if (jumped)
+                break;
+        }
+        if (halted)
+            break;
+    }
+
+    final_pc = pc;
+    for (size_t reg = 0; reg < NUM_REGS; reg++)
+        final_regs[reg] = regs[reg];
+#else
+    simulate(mem, final_regs, final_pc);
+#endif
+}
+
+// Number of machines run side by side by simulate_lockstep
+size_t const static LOCKSTEP_LANES = 16;
+
+#ifdef E20_HAVE_LOCKSTEP
+/*
+    Helpers for simulate_lockstep. A lane mask is a vector with all
+    bits of a lane set if the lane takes part; a lane set is the same
+    thing as an int with one bit per lane.
+*/
+E20_AVX2 inline __m256i lanes_mask(uint32_t set) {
+    const __m256i bits = _mm256_setr_epi16(1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+        1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, static_cast<short>(1 << 15));
+    __m256i spread = _mm256_set1_epi16(static_cast<short>(set));
+    return _mm256_cmpeq_epi16(_mm256_and_si256(spread, bits), bits);
+}
+
+E20_AVX2 inline uint32_t lanes_set(__m256i mask) {
+    // packs keeps the 128-bit halves apart: lanes 0-7 land in bytes
+    // 0-7 and lanes 8-15 in bytes 16-23
+    uint32_t bytes = _mm256_movemask_epi8(_mm256_packs_epi16(mask, mask));
+    return (bytes & 0xFF) | ((bytes >> 8) & 0xFF00);
+}
+
+E20_AVX2 inline void blend(uint16_t *lanes, __m256i value, __m256i mask) {
+    __m256i old = _mm256_load_si256(reinterpret_cast<const __m256i *>(lanes));
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), _mm256_blendv_epi8(old, value, mask));
+}
+
+E20_AVX2 inline __m256i lanes_of(const uint16_t *lanes) {
+    return _mm256_load_si256(reinterpret_cast<const __m256i *>(lanes));
+}
+
+/*
+    simulate_lockstep for CPUs with AVX2.
+*/
+E20_AVX2 void simulate_lockstep_avx2(uint16_t mem[], uint16_t final_regs[], uint16_t final_pc[],
+                                            size_t lanes) {
+    // Registers and pcs in structure-of-arrays form, one 16-bit
+    // element per lane, so that one AVX2 register holds a register
+    // of every machine.
+    alignas(32) uint16_t regs[NUM_REGS][LOCKSTEP_LANES] = {};
+    alignas(32) uint16_t pcs[LOCKSTEP_LANES] = {};
+    for (size_t lane = 0; lane < lanes; lane++) {
+        pcs[lane] = final_pc[lane];
+        for (size_t reg = 0; reg < NUM_REGS; reg++)
+            regs[reg][lane] = final_regs[lane * NUM_REGS + reg];
+    }
+
+    // A word holds the same value in every image unless the images
+    // differ there or a sw wrote it. Those words are decoded once for
+    // all lanes, the others every time they run.
+    static thread_local Decoded cache[MEM_SIZE];
+    static thread_local uint8_t same[MEM_SIZE];
+    Decoded *code = cache;
+    for (size_t addr = 0; addr < MEM_SIZE; addr++) {
+        code[addr].op = OP_DECODE;
+        same[addr] = 1;
+        for (size_t lane = 1; lane < lanes; lane++)
+            if (mem[lane * MEM_SIZE + addr] != mem[addr])
+                same[addr] = 0;
+    }
+
+    const __m256i all = _mm256_set1_epi16(-1);
+    uint32_t running = (1u << lanes) - 1;
+    // While every running lane is at the same pc, that pc is kept in
+    // pc alone and pcs is only written for lanes that halt.
+    uint16_t pc = pcs[0];
+    bool together = (lanes_set(_mm256_cmpeq_epi16(lanes_of(pcs), _mm256_set1_epi16(pc))) & running) == running;
+    while (running != 0) {
+        __m256i here;
+        uint32_t set;
+        if (together) {
+            set = running;
+            here = lanes_mask(set);
+        } else {
+            // The lowest pc of the running lanes goes next, so that
+            // lanes that took different branches meet again after them.
+            __m256i live = lanes_mask(running);
+            __m256i pc_vec = lanes_of(pcs);
+            __m256i waiting = _mm256_or_si256(pc_vec, _mm256_andnot_si256(live, all));
+            __m128i lowest = _mm_min_epu16(_mm256_castsi256_si128(waiting), _mm256_extracti128_si256(waiting, 1));
+            pc = _mm_cvtsi128_si32(_mm_minpos_epu16(lowest));
+            here = _mm256_and_si256(_mm256_cmpeq_epi16(pc_vec, _mm256_set1_epi16(pc)), live);
+            set = lanes_set(here);
+            together = set == running;
+        }
+
+        Decoded d;
+        if (same[pc]) {
+            if (code[pc].op == OP_DECODE)
+                code[pc] = decode(mem[pc]);
+            d = code[pc];
+        } else {
+            // Only the lanes that hold the same word as the first one
+            // run now; the others run it on a later step.
+            uint16_t word = mem[__builtin_ctz(set) * MEM_SIZE + pc];
+            for (uint32_t rest = set; rest != 0; rest &= rest - 1) {
+                size_t lane = __builtin_ctz(rest);
+                if (mem[lane * MEM_SIZE + pc] != word)
+                    set &= ~(1u << lane);
+            }
+            if (set != running && together) {
+                together = false;
+                blend(pcs, _mm256_set1_epi16(pc), here);
+            }
+            here = lanes_mask(set);
+            d = decode(word);
+        }
+
+        __m256i a = lanes_of(regs[d.regA]);
+        __m256i b = lanes_of(regs[d.regB]);
+        __m256i imm = _mm256_set1_epi16(static_cast<short>(d.imm));
+        uint16_t next = isoverflow(pc + 1);
+        switch (d.op) {
+        case OP_NOP:
+            break;
+        case OP_ADD:
+            blend(regs[d.dst], _mm256_add_epi16(a, b), here);
+            break;
+        case OP_SUB:
+            blend(regs[d.dst], _mm256_sub_epi16(a, b), here);
+            break;
+        case OP_OR:
+            blend(regs[d.dst], _mm256_or_si256(a, b), here);
+            break;
+        case OP_AND:
+            blend(regs[d.dst], _mm256_and_si256(a, b), here);
+            break;
+        case OP_SLT:
+            blend(regs[d.dst], _mm256_srli_epi16(_mm256_cmpgt_epi16(b, a), 15), here);
+            break;
+        case OP_SLTI:
+            blend(regs[d.dst], _mm256_srli_epi16(_mm256_cmpgt_epi16(imm, a), 15), here);
+            break;
+        case OP_ADDI:
+            blend(regs[d.dst], _mm256_add_epi16(a, imm), here);
+            break;
+        case OP_LW:
+            for (uint32_t rest = set; rest != 0; rest &= rest - 1) {
+                size_t lane = __builtin_ctz(rest);
+                regs[d.dst][lane] = mem[lane * MEM_SIZE + isoverflow(regs[d.regA][lane] + d.imm)];
+            }
+            break;
+        case OP_SW:
+            for (uint32_t rest = set; rest != 0; rest &= rest - 1) {
+                size_t lane = __builtin_ctz(rest);
+                uint16_t addr = isoverflow(regs[d.regA][lane] + d.imm);
+                mem[lane * MEM_SIZE + addr] = regs[d.regB][lane];
+                same[addr] = 0;
+            }
+            break;
+        // A lane halts by jumping to its own address; it stops running
+        // with its pc left at that address.
+        case OP_JR: {
+            __m256i dest = _mm256_and_si256(a, _mm256_set1_epi16(MEM_SIZE - 1));
+            __m256i halting = _mm256_and_si256(_mm256_cmpeq_epi16(dest, _mm256_set1_epi16(pc)), here);
+            uint32_t halted = lanes_set(halting);
+            blend(pcs, dest, here);
+            running &= ~halted;
+            set &= ~halted;
+            if (together && set != 0) {
+                uint16_t first = regs[d.regA][__builtin_ctz(set)] & (MEM_SIZE - 1);
+                if ((lanes_set(_mm256_cmpeq_epi16(dest, _mm256_set1_epi16(first))) & set) == set)
+                    pc = first;
+                else
+                    together = false;
+            }
+            continue;
+        }
+        case OP_J:
+        case OP_JAL:
+            if (d.op == OP_JAL)
+                blend(regs[7], _mm256_set1_epi16(static_cast<short>(pc + 1)), here);
+            if (d.imm == pc) {
+                blend(pcs, imm, here);
+                running &= ~set;
+            } else if (together)
+                pc = d.imm;
+            else
+                blend(pcs, imm, here);
+            continue;
+        case OP_JEQ: {
+            __m256i taken = _mm256_and_si256(_mm256_cmpeq_epi16(a, b), here);
+            uint32_t taken_set = lanes_set(taken);
+            uint16_t target = pc + 1 + d.imm;
+            if (target == pc) {
+                blend(pcs, _mm256_set1_epi16(pc), taken);
+                running &= ~taken_set;
+                set &= ~taken_set;
+                here = lanes_mask(set);
+                taken_set = 0;
+                taken = _mm256_setzero_si256();
+            }
+            if (together && (taken_set == 0 || taken_set == set))
+                pc = taken_set == 0 ? next : isoverflow(target);
+            else {
+                together = false;
+                blend(pcs, _mm256_set1_epi16(isoverflow(target)), taken);
+                blend(pcs, _mm256_set1_epi16(next), _mm256_andnot_si256(taken, here));
+            }
+            continue;
+        }
+        }
+        if (together)
+            pc = next;
+        else
+            blend(pcs, _mm256_set1_epi16(next), here);
+    }
+
+    for (size_t lane = 0; lane < lanes; lane++) {
+        final_pc[lane] = pcs[lane];
+        for (size_t reg = 0; reg < NUM_REGS; reg++)
+            final_regs[lane * NUM_REGS + reg] = regs[reg][lane];
+    }
+}
+#endif
+
+/*
+    Runs up to LOCKSTEP_LANES machines at once, in lockstep: every
+    step picks one pc and executes its instruction in every machine
+    that is at that pc, with AVX2 for the ALU instructions and masks
+    for the machines that are elsewhere. This pays off when the
+    machines run the same program on different data. Without AVX2
+    the machines run one after another.
+
+    @param mem Memory of every machine, MEM_SIZE words each, one
+        after another
+    @param final_regs Registers of every machine, NUM_REGS each,
+        updated in place
+    @param final_pc Initial pc of every machine, set to the final ones
+    @param lanes Number of machines
+*/
+void simulate_lockstep(uint16_t mem[], uint16_t final_regs[], uint16_t final_pc[], size_t lanes) {
+#ifdef E20_HAVE_LOCKSTEP
+    if (__builtin_cpu_supports("avx2")) {
+        simulate_lockstep_avx2(mem, final_regs, final_pc, lanes);
+        return;
+    }
+#endif
+    for (size_t lane = 0; lane < lanes; lane++)
+        simulate(mem + lane * MEM_SIZE, final_regs + lane * NUM_REGS, final_pc[lane]);
+}
+
+/*
+    Runs the program in mem with the named engine.
+
+    @param engine switch, threaded, jit or simd
+*/
+void run_engine(const string &engine, uint16_t mem[], uint16_t regs[], uint16_t &pc) {
+    if (engine == "simd")
+        simulate_lockstep(mem, regs, &pc, 1);
+    else if (engine == "threaded")
+        simulate_threaded(mem, regs, pc);
+    else if (engine == "jit")
+        simulate_jit(mem, regs, pc);
+    else
+        simulate(mem, regs, pc);
+}
+
+/*
+    Simulates every program named in a manifest, one image filename per
+    line, on jobs threads. Each thread keeps its own memory, registers
+    and decode cache and reuses them from one program to the next. The
+    final states are printed in manifest order, each one as soon as it
+    and every state before it are done. With the simd engine every
+    thread runs LOCKSTEP_LANES programs at a time. An image that can't
+    be opened or parsed is reported in its place and the batch goes on.
+
+    @param manifest File listing the images; blank lines are skipped
+    @param engine Interpreter to use, as for a single program
+    @param jobs Number of threads
+    @return false if the manifest or any image couldn't be read
+*/
+bool simulate_batch(const char *manifest, const string &engine, unsigned jobs) {
+    ifstream list(manifest);
+    if (!list.is_open()) {
+        cerr << "Can't open file " << manifest << endl;
+        return false;
+    }
+    vector<string> filenames;
+    for (string line; getline(list, line); ) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            filenames.push_back(line);
+    }
+
+    // Whether each program is still running, done or failed to load,
+    // and its final state or why it failed
+    enum Status : char {PENDING, DONE, FAILED};
+    vector<string> states(filenames.size());
+    vector<Status> status(filenames.size(), PENDING);
+    size_t printed = 0;
+    bool ok = true;
+    mutex lock;
+    atomic<size_t> next(0);
+    // The simd engine takes its programs a group of lanes at a time
+    size_t group = engine == "simd" ? LOCKSTEP_LANES : 1;
+    auto worker = [&]() {
+        vector<uint16_t> mem(group * MEM_SIZE);
+        vector<uint16_t> regs(group * NUM_REGS);
+        vector<uint16_t> pcs(group);
+        vector<size_t> program(group);
+        vector<string> out(group);
+        for (size_t first; (first = next.fetch_add(group)) < filenames.size(); ) {
+            size_t last = min(first + group, filenames.size());
+            fill(mem.begin(), mem.end(), 0);
+            fill(regs.begin(), regs.end(), 0);
+            fill(pcs.begin(), pcs.end(), 0);
+            size_t lanes = 0;
+            vector<string> errors;
+            for (size_t i = first; i < last; i++) {
+                string error;
+                if (load_image(filenames[i].c_str(), &mem[lanes * MEM_SIZE], pcs[lanes], error))
+                    program[lanes++] = i;
+                else {
+                    // A half-loaded program mustn't leak into the next lane
+                    fill(&mem[lanes * MEM_SIZE], &mem[(lanes + 1) * MEM_SIZE], 0);
+                    pcs[lanes] = 0;
+                    if (error.empty())
+                        errors.push_back("Can't open file " + filenames[i]);
+                    else
+                        errors.push_back(filenames[i] + ": " + error);
+                }
+            }
+            if (group > 1)
+                simulate_lockstep(mem.data(), regs.data(), pcs.data(), lanes);
+            else if (lanes > 0)
+                run_engine(engine, mem.data(), regs.data(), pcs[0]);
+            for (size_t lane = 0; lane < lanes; lane++) {
+                // A fresh stream, since print_state leaves its stream in hex
+                ostringstream state;
+                print_state(pcs[lane], &regs[lane * NUM_REGS], &mem[lane * MEM_SIZE], 128, state);
+                out[lane] = state.str();
+            }
+
+            lock_guard<mutex> guard(lock);
+            for (size_t i = first, failed = 0, lane = 0; i < last; i++)
+                if (lane < lanes && program[lane] == i)
+                    lane++;
+                else {
+                    states[i] = move(errors[failed++]);
+                    status[i] = FAILED;
+                }
+            for (size_t lane = 0; lane < lanes; lane++) {
+                states[program[lane]] = move(out[lane]);
+                status[program[lane]] = DONE;
+            }
+            for (; printed < filenames.size() && status[printed] != PENDING; printed++) {
+                if (status[printed] == DONE)
+                    cout << states[printed];
+                else {
+                    // Keep the report in order with the states before it
+                    cout.flush();
+                    cerr << states[printed] << endl;
+                    ok = false;
+                }
+                string().swap(states[printed]);
+            }
+        }
+    };
+    vector<thread> threads;
+    for (unsigned i = 1; i < jobs && i * group < filenames.size(); i++)
+        threads.emplace_back(worker);
+    worker();
+    for (thread &t : threads)
+        t.join();
+    cout.flush();
+    return ok;
+}
+
+#ifndef E20_NO_MAIN
 /**
     Main function
     Takes command-line args as documented below
@@ -114,11 +1989,81 @@ int main(int argc, char *argv[]) {
     char *filename = nullptr;
     bool do_help = false;
     bool arg_error = false;
+    string engine = "switch";
+    const char *trace_file = nullptr;
+    const char *manifest = nullptr;
+    const char *profile_file = nullptr;
+    LatencyTable latency;
+    bool pipeline = false;
+    PipelineModel timing;
+    uint64_t checkpoint_every = 0;
+    const char *restore_file = nullptr;
+    unsigned jobs = max(1u, thread::hardware_concurrency());
     for (int i=1; i<argc; i++) {
         string arg(argv[i]);
         if (arg.rfind("-",0)==0) {
             if (arg== "-h" || arg == "--help")
                 do_help = true;
+            else if (arg.rfind("--engine=",0)==0) {
+                engine = arg.substr(9);
+                if (engine != "switch" && engine != "threaded" && engine != "jit" && engine != "simd")
+                    arg_error = true;
+            }
+            else if (arg == "--jit")
+                engine = "jit";
+            else if (arg == "--record-trace") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    trace_file = argv[i];
+            }
+            else if (arg == "--batch") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    manifest = argv[i];
+            }
+            else if (arg.rfind("--jobs=",0)==0) {
+                char *end;
+                long value = strtol(arg.c_str() + 7, &end, 10);
+                if (arg.size() == 7 || *end != '\0' || value < 1 ||
+                    static_cast<unsigned>(value) != value)
+                    arg_error = true;
+                else
+                    jobs = value;
+            }
+            else if (arg == "--profile") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    profile_file = argv[i];
+            }
+            else if (arg == "--timing=pipeline")
+                pipeline = true;
+            else if (arg == "--forwarding=on" || arg == "--forwarding=off")
+                timing.forwarding = arg == "--forwarding=on";
+            else if (arg.rfind("--latency=",0)==0) {
+                if (!latency.parse(arg.substr(10)))
+                    arg_error = true;
+            }
+            else if (arg == "--checkpoint-every") {
+                i++;
+                char *end;
+                // strtoull would take a sign or leading blanks
+                if (i>=argc || argv[i][0] < '0' || argv[i][0] > '9' ||
+                    (checkpoint_every = strtoull(argv[i], &end, 10)) == 0 || *end != '\0')
+                    arg_error = true;
+            }
+            else if (arg == "--restore") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    restore_file = argv[i];
+            }
             else
                 arg_error = true;
         } else {
@@ -129,117 +2074,128 @@ int main(int argc, char *argv[]) {
         }
     }
     /* Display error message if appropriate */
-    if (arg_error || do_help || filename == nullptr) {
-        cerr << "usage " << argv[0] << " [-h] filename" << endl << endl; 
+    if (manifest != nullptr && (filename != nullptr || trace_file != nullptr || profile_file != nullptr))
+        arg_error = true;
+    if (manifest != nullptr && pipeline)
+        arg_error = true;
+    if ((trace_file != nullptr) + (profile_file != nullptr) + pipeline + (checkpoint_every != 0) > 1)
+        arg_error = true;
+    /* A checkpoint takes the place of the program */
+    if (restore_file != nullptr && (filename != nullptr || manifest != nullptr))
+        arg_error = true;
+    if (manifest != nullptr && checkpoint_every != 0)
+        arg_error = true;
+    if (arg_error || do_help || (filename == nullptr && manifest == nullptr && restore_file == nullptr)) {
+        cerr << "usage " << argv[0] << " [-h] [--engine=ENGINE] [--jit] [--record-trace FILE]" << endl;
+        cerr << "       [--profile FILE] [--latency=LIST] [--timing=pipeline] [--forwarding=on|off]" << endl;
+        cerr << "       [--checkpoint-every N] {filename | --restore FILE}" << endl;
+        cerr << "      " << argv[0] << " [-h] [--engine=ENGINE] [--jit] [--jobs=N] --batch MANIFEST" << endl << endl;
         cerr << "Simulate E20 machine" << endl << endl;
         cerr << "positional arguments:" << endl;
-        cerr << "  filename    The file containing machine code, typically with .bin suffix" << endl<<endl;
+        cerr << "  filename    The file containing machine code, typically with .bin suffix," << endl;
+        cerr << "              either as a listing or as a binary image" << endl<<endl;
         cerr << "optional arguments:"<<endl;
         cerr << "  -h, --help  show this help message and exit"<<endl;
+        cerr << "  --engine=ENGINE  Interpreter to use: switch (default), threaded, jit or simd;"<<endl;
+        cerr << "              simd runs the programs of a batch 16 at a time in lockstep"<<endl;
+        cerr << "  --jit       Same as --engine=jit: compile hot blocks to x86-64"<<endl;
+        cerr << "  --record-trace FILE  Write every memory access to FILE as a binary trace"<<endl;
+        cerr << "              (always uses the switch engine)"<<endl;
+        cerr << "  --batch MANIFEST  Simulate every image listed in MANIFEST, one filename per"<<endl;
+        cerr << "              line, and print their final states in the same order"<<endl;
+        cerr << "  --jobs=N    Simulate up to N programs of a batch at once (default: one per CPU)"<<endl;
+        cerr << "  --profile FILE  Count every operation, pc and jeq outcome, print a hot-spot"<<endl;
+        cerr << "              report after the final state and write it all to FILE as JSON"<<endl;
+        cerr << "              (always uses the switch engine)"<<endl;
+        cerr << "  --latency=LIST  Cycles per operation for the cycle estimate of --profile,"<<endl;
+        cerr << "              as in lw=3,sw=2,jeq=1,jeq_taken=3 (others default to 1, jumps 2)"<<endl;
+        cerr << "  --timing=pipeline  Also time the program on a five-stage pipeline and print"<<endl;
+        cerr << "              its cycles, CPI and stalls after the final state"<<endl;
+        cerr << "  --forwarding=on|off  Whether that pipeline forwards results (default on)"<<endl;
+        cerr << "  --checkpoint-every N  Save the machine to a checkpoint every N instructions,"<<endl;
+        cerr << "              replacing filename.ckpt, or FILE when restoring from it"<<endl;
+        cerr << "              (always uses the switch engine)"<<endl;
+        cerr << "  --restore FILE  Resume the run saved in the checkpoint FILE instead of"<<endl;
+        cerr << "              starting a program"<<endl;
         return 1;
     }
 
-    ifstream f(filename);
-    if (!f.is_open()) {
-        cerr << "Can't open file "<<filename<<endl;
-        return 1;
-    }
+    if (manifest != nullptr)
+        return simulate_batch(manifest, engine, jobs) ? 0 : 1;
+
     // TODO: your code here. Load f and parse using load_machine_code
     uint16_t mem[MEM_SIZE] = {0};
-    load_machine_code(f, mem);
+    uint16_t pc = 0;
+    uint16_t regs[NUM_REGS] = {0};
+    Checkpoint state;
+    string error;
+    if (restore_file != nullptr) {
+        if (!load_checkpoint(restore_file, state, mem)) {
+            cerr << "Can't restore checkpoint "<<restore_file<<endl;
+            return 1;
+        }
+        pc = state.pc;
+        for (size_t reg = 0; reg < NUM_REGS; reg++)
+            regs[reg] = state.regs[reg];
+        // The run goes on without caches, so theirs would go stale
+        state.levels = 0;
+        state.caches.clear();
+    } else if (!load_image(filename, mem, pc, error)) {
+        if (error.empty())
+            cerr << "Can't open file "<<filename<<endl;
+        else
+            cerr << error << endl;
+        return 1;
+    }
 
     // TODO: your code here. Do simulation.
-    uint16_t regs[NUM_REGS] = {0};
-    uint16_t pc = 0;
-    bool goahead = true;
-    while(goahead){
-        uint16_t num = mem[pc];
-        uint16_t pc_next = pc + 1;
-        uint16_t msb_mask = 0b1110000000000000;
-        uint16_t opcode = (num & msb_mask) >> 13;
-        if(opcode == 0){
-            uint16_t imm = (num & 0b0000000000001111);
-            uint16_t regA = (num & 0b0001110000000000) >> 10;
-            uint16_t regB = (num & 0b0000001110000000) >> 7;
-            uint16_t dst = (num & 0b0000000001110000) >> 4;
-            if(imm == 0){ // opcode = add
-                regs[dst] = (dst == 0 ? 0 : regs[regA] + regs[regB]);
-            }
-            else if(imm == 1){ //opcode = sub
-                regs[dst] = (dst == 0 ? 0 : regs[regA] - regs[regB]);
-            }
-            else if(imm == 2){ //opcode = or
-                regs[dst] = (dst == 0 ? 0 : regs[regA] | regs[regB]);
-            }
-            else if(imm == 3){ //opcode = and
-                regs[dst] = (dst == 0 ? 0 : regs[regA] & regs[regB]);
-            }
-            else if (imm  == 4){ //opcode = slt
-                int16_t regA4 = static_cast<int16_t>(regs[regA]);
-                int16_t regB4 = static_cast<int16_t>(regs[regB]);
-                regs[dst] = dst == 0 ? 0 :(regA4 < regB4 ? 1 : 0);
-            }
-            else if(imm == 8){ //opcode = jr
-                pc_next = isoverflow(regs[regA]);
-            }
-        }
-        else if(opcode == 7){ //opcode = slti
-            uint16_t imm = (num & 0b0000000001111111);
-            uint16_t regSrc = (num & 0b0001110000000000) >> 10;
-            uint16_t regDst = (num & 0b0000001110000000) >> 7;
-            int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-            int16_t regSrcs = static_cast<int16_t>(regs[regSrc]);
-            regs[regDst] = regDst == 0 ? 0 :(regSrcs < sign_extended ? 1 : 0);
-        }
-        else if(opcode == 4){ //opcode = lw
-            uint16_t imm = (num & 0b0000000001111111);
-            int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-            uint16_t Add = (num & 0b0001110000000000) >> 10;
-            uint16_t regDst = (num & 0b0000001110000000) >> 7;
-            regs[regDst] = (regDst == 0)? 0 : mem[isoverflow(regs[Add] + sign_extended)];
-        }
-        else if(opcode == 5){ //opcode = sw
-            uint16_t src = (num & 0b0000001110000000)>>7;
-            uint16_t Add = (num & 0b0001110000000000) >> 10;
-            uint16_t imm = (num & 0b0000000001111111);
-            int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-            mem[(isoverflow(sign_extended + regs[Add]))] = regs[src];
-        }
-        else if(opcode == 1){ // opcode = addi
-            uint16_t src = (num & 0b0001110000000000) >> 10;
-            uint16_t dst = (num & 0b0000001110000000) >> 7;
-            uint16_t imm = (num & 0b0000000001111111);
-            int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-            regs[dst] = dst == 0 ? 0 : regs[src] + sign_extended;
-        }
-        else if (opcode == 2){ // opcode = j
-            uint16_t address = isoverflow(num & 0b0001111111111111);
-            pc_next = (address & 0b0001111111111111);
-        }
-        else if (opcode == 3) { //opcode = jal
-            regs[7] = pc_next;
-            pc_next = isoverflow(num & 0b0001111111111111);
-        }
-        else if (opcode == 6) { //opcode = jeq
-            uint16_t regA = (num & 0b0001110000000000) >> 10;
-            uint16_t regB = (num & 0b0000001110000000) >> 7;
-            if(regs[regA] == regs[regB]){
-                uint16_t rel_imm = (num & 0b0000000001111111);
-                int16_t sign_extended = (rel_imm & 0x40) ? (rel_imm | 0xFF80) : rel_imm;
-                pc_next += sign_extended;
-            }
-        }
-
-        if(pc_next == pc){
-            goahead = false;
-        }
-        else {
-            pc = isoverflow(pc_next);
+    static Profiler profile;
+    if (profile_file != nullptr)
+        simulate(mem, regs, pc, profile);
+    else if (pipeline)
+        simulate(mem, regs, pc, timing);
+    else if (trace_file != nullptr) {
+        TraceWriter trace(trace_file);
+        simulate(mem, regs, pc, trace);
+        trace.flush();
+        if (!trace.good()) {
+            cerr << "Can't write trace file "<<trace_file<<endl;
+            return 1;
         }
     }
+    else if (checkpoint_every != 0) {
+        string checkpoint_file = restore_file != nullptr ? restore_file : string(filename) + ".ckpt";
+        Checkpointer checkpoints;
+        checkpoints.instructions = state.instructions;
+        checkpoints.limit = (state.instructions / checkpoint_every + 1) * checkpoint_every;
+        while (!simulate(mem, regs, pc, checkpoints)) {
+            state.instructions = checkpoints.instructions;
+            state.pc = pc;
+            for (size_t reg = 0; reg < NUM_REGS; reg++)
+                state.regs[reg] = regs[reg];
+            if (!save_checkpoint(checkpoint_file, state, mem)) {
+                cerr << "Can't write checkpoint "<<checkpoint_file<<endl;
+                return 1;
+            }
+            checkpoints.limit += checkpoint_every;
+        }
+    }
+    else
+        run_engine(engine, mem, regs, pc);
+
     // TODO: your code here. print the final state of the simulator before ending, using print_state
     print_state(pc, regs, mem, 128);
 
+    if (pipeline)
+        print_pipeline(timing);
+    if (profile_file != nullptr) {
+        print_profile(profile, latency, 20);
+        if (!write_profile_json(profile_file, profile, latency)) {
+            cerr << "Can't write profile "<<profile_file<<endl;
+            return 1;
+        }
+    }
     return 0;
 }
+#endif
 //ra0Eequ6ucie6Jei0koh6phishohm9
\ No newline at end of file
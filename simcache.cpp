@@ -10,97 +10,3271 @@ simcache.cpp
 #include <iostream>
 #include <string>
 #include <vector>
+#include <deque>
 #include <fstream>
 #include <limits>
 #include <iomanip>
-#include <regex>
-#include <map>
-#include <list>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
-class LRUcache{
+/*
+    Appends the low bytes bytes of value to out, least significant first.
+*/
+void put_le(string &out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++)
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+/*
+    Reads a little-endian value of the given number of bytes.
+*/
+uint64_t read_le(const char *p, size_t bytes) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    uint64_t value = 0;
+    for (size_t i = bytes; i-- > 0; )
+        value = value << 8 | u[i];
+    return value;
+}
+
+/*
+    Reads little-endian values one after another from a buffer, as
+    written by put_le. Reading past the end gives zeros and makes
+    good() false.
+*/
+class ByteReader {
+public:
+    ByteReader(const string &data) : p(data.data()), end(data.data() + data.size()) {}
+
+    uint64_t get(size_t bytes) {
+        if (static_cast<size_t>(end - p) < bytes) {
+            p = end;
+            failed = true;
+            return 0;
+        }
+        uint64_t value = read_le(p, bytes);
+        p += bytes;
+        return value;
+    }
+
+    bool good() const {
+        return !failed;
+    }
+
+    bool at_end() const {
+        return p == end;
+    }
+
+private:
+    const char *p;
+    const char *end;
+    bool failed = false;
+};
+
+/*
+    Replacement policies. A policy keeps the replacement state of one
+    cache level and is a template parameter of CacheLevel, so each one
+    gets its own specialized access loops. Every policy has:
+
+        NAME                 its name for --policy
+        init(rows, assoc)    sets up an empty cache
+        touch(row, way)      records a hit on a line
+        fill(row, way)       records a new line, placed where victim said
+                             or in a way that was still invalid
+        victim(row)          picks the line to evict from a full row
+        save(out)            appends the state to a checkpoint
+        restore(in)          reads it back
+
+    Only LRUPolicy keeps a word per line; the others pack their state
+    into a few bits per line or per row.
+*/
+
+/*
+    True LRU replacement. Every line carries the stamp of its last use,
+    taken from a per-cache access counter, and the victim of a full row
+    is the line with the oldest stamp.
+*/
+class LRUPolicy {
+public:
+    static constexpr const char *NAME = "lru";
+
+    void init(int num_rows, int assoc) {
+        this->assoc = assoc;
+        age.assign(num_rows * assoc, 0);
+        clock = 0;
+    }
+
+    void touch(int row, int way) {
+        age[row * assoc + way] = ++clock;
+    }
+
+    void fill(int row, int way) {
+        touch(row, way);
+    }
+
+    int victim(int row) const {
+        int base = row * assoc;
+        int oldest = 0;
+        for (int way = 1; way < assoc; way++)
+            if (age[base + way] < age[base + oldest])
+                oldest = way;
+        return oldest;
+    }
+
+    /*
+        Appends the replacement state to a checkpoint.
+    */
+    void save(string &out) const {
+        put_le(out, clock, 8);
+        for (uint64_t stamp : age)
+            put_le(out, stamp, 8);
+    }
+
+    /*
+        Reads back what save wrote, into a policy of the same shape.
+    */
+    void restore(ByteReader &in) {
+        clock = in.get(8);
+        for (uint64_t &stamp : age)
+            stamp = in.get(8);
+    }
+
+private:
+    int assoc;
+    vector<uint64_t> age;
+    uint64_t clock;
+};
+
+/*
+    xorshift64* generator for the randomized policies. Every policy
+    starts from seed, which --seed sets, so runs are repeatable.
+*/
+class PolicyRandom {
+public:
+    static uint64_t seed;
+
+    void reset() {
+        state = seed * 0x9E3779B97F4A7C15ull | 1;
+    }
+
+    uint32_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (state * 0x2545F4914F6CDD1Dull) >> 32;
+    }
+
+    uint64_t state = 1;
+};
+uint64_t PolicyRandom::seed = 1;
+
+/*
+    Tree pseudo-LRU. A row of assoc ways keeps assoc - 1 bits, the
+    nodes of a binary tree over its ways, in as few 64-bit words as
+    hold them. A node is set when the victim is in its right half. A
+    use points every node on the way's path away from it, which is
+    precomputed for every way as the bits to clear and set in each
+    word, so a hit costs a masked store or two whatever the
+    associativity. The victim is found by following the nodes from the
+    root. Needs a power-of-two associativity.
+*/
+class TreePLRUPolicy {
+public:
+    static constexpr const char *NAME = "plru";
+
+    void init(int num_rows, int assoc) {
+        this->assoc = assoc;
+        words = (assoc - 1 + 63) / 64;
+        bits.assign(static_cast<size_t>(num_rows) * words, 0);
+        paths.clear();
+        path_start.assign(1, 0);
+        for (int way = 0; way < assoc; way++) {
+            // The children of node n are 2n + 1 and 2n + 2
+            size_t node = 0;
+            for (int half = assoc / 2; half > 0; half /= 2) {
+                bool right = (way & half) != 0;
+                if (paths.size() == path_start.back() || paths.back().word != node / 64)
+                    paths.push_back({node / 64, 0, 0});
+                paths.back().mask |= 1ull << (node % 64);
+                if (!right)
+                    paths.back().value |= 1ull << (node % 64);
+                node = 2 * node + 1 + right;
+            }
+            path_start.push_back(paths.size());
+        }
+    }
+
+    void touch(int row, int way) {
+        uint64_t *tree = &bits[static_cast<size_t>(row) * words];
+        for (size_t i = path_start[way]; i < path_start[way + 1]; i++)
+            tree[paths[i].word] = (tree[paths[i].word] & ~paths[i].mask) | paths[i].value;
+    }
+
+    void fill(int row, int way) {
+        touch(row, way);
+    }
+
+    int victim(int row) const {
+        const uint64_t *tree = &bits[static_cast<size_t>(row) * words];
+        size_t node = 0;
+        int way = 0;
+        for (int half = assoc / 2; half > 0; half /= 2) {
+            bool right = (tree[node / 64] >> (node % 64)) & 1;
+            if (right)
+                way |= half;
+            node = 2 * node + 1 + right;
+        }
+        return way;
+    }
+
+    void save(string &out) const {
+        for (uint64_t word : bits)
+            put_le(out, word, 8);
+    }
+
+    void restore(ByteReader &in) {
+        for (uint64_t &word : bits)
+            word = in.get(8);
+    }
+
+private:
+    // The bits a use of a way sets in one word of its row's tree
+    struct PathWord {
+        size_t word;
+        uint64_t mask;
+        uint64_t value;
+    };
+    int assoc;
+    size_t words;
+    vector<uint64_t> bits;
+    // The words of the path of way w are paths[path_start[w]] up to
+    // paths[path_start[w + 1]]
+    vector<PathWord> paths;
+    vector<size_t> path_start;
+};
+
+/*
+    Re-reference interval prediction, with a 2-bit prediction per line
+    packed four lines to a byte. A hit predicts a near re-reference (0).
+    The victim is the first line predicted distant (3), after the whole
+    row has been aged until one is. SRRIP gives new lines a long
+    prediction (2). BRRIP, the bimodal variant, predicts distant for
+    all but one fill in 32, picked at random, so that a scan larger
+    than the cache doesn't flush it.
+*/
+template <bool Bimodal>
+class RRIPPolicy {
+public:
+    static constexpr const char *NAME = Bimodal ? "brrip" : "srrip";
+    static const uint8_t DISTANT = 3;
+
+    void init(int num_rows, int assoc) {
+        this->assoc = assoc;
+        values.assign((static_cast<size_t>(num_rows) * assoc + 3) / 4, 0xFF);
+        random.reset();
+    }
+
+    void touch(int row, int way) {
+        set(static_cast<size_t>(row) * assoc + way, 0);
+    }
+
+    void fill(int row, int way) {
+        bool distant = Bimodal && random.next() % 32 != 0;
+        set(static_cast<size_t>(row) * assoc + way, distant ? DISTANT : DISTANT - 1);
+    }
+
+    int victim(int row) {
+        size_t base = static_cast<size_t>(row) * assoc;
+        uint8_t oldest = 0;
+        int victim = 0;
+        for (int way = 0; way < assoc; way++)
+            if (get(base + way) > oldest) {
+                oldest = get(base + way);
+                victim = way;
+            }
+        // Aging until a line is distant adds the same to every line
+        if (oldest < DISTANT)
+            for (int way = 0; way < assoc; way++)
+                set(base + way, get(base + way) + DISTANT - oldest);
+        return victim;
+    }
+
+    void save(string &out) const {
+        put_le(out, random.state, 8);
+        for (uint8_t byte : values)
+            put_le(out, byte, 1);
+    }
+
+    void restore(ByteReader &in) {
+        random.state = in.get(8);
+        for (uint8_t &byte : values)
+            byte = in.get(1);
+    }
+
+private:
+    int assoc;
+    vector<uint8_t> values;
+    PolicyRandom random;
+
+    uint8_t get(size_t line) const {
+        return (values[line / 4] >> (2 * (line % 4))) & 3;
+    }
+
+    void set(size_t line, uint8_t value) {
+        uint8_t &byte = values[line / 4];
+        byte = (byte & ~(3 << (2 * (line % 4)))) | value << (2 * (line % 4));
+    }
+};
+
+/*
+    First in, first out: the victim is the line filled longest ago,
+    however often it was used since. As lines are never invalidated,
+    every row fills its ways in order, so it only has to keep the way
+    to replace next.
+*/
+class FIFOPolicy {
+public:
+    static constexpr const char *NAME = "fifo";
+
+    void init(int num_rows, int assoc) {
+        this->assoc = assoc;
+        next.assign(num_rows, 0);
+    }
+
+    void touch(int, int) {}
+
+    void fill(int row, int way) {
+        next[row] = (way + 1) % assoc;
+    }
+
+    int victim(int row) const {
+        return next[row];
+    }
+
+    void save(string &out) const {
+        for (uint16_t way : next)
+            put_le(out, way, 2);
+    }
+
+    void restore(ByteReader &in) {
+        for (uint16_t &way : next)
+            way = in.get(2);
+    }
+
+private:
+    int assoc;
+    vector<uint16_t> next;
+};
+
+/*
+    Evicts a line chosen uniformly at random. The only state is the
+    generator.
+*/
+class RandomPolicy {
+public:
+    static constexpr const char *NAME = "random";
+
+    void init(int, int assoc) {
+        this->assoc = assoc;
+        random.reset();
+    }
+
+    void touch(int, int) {}
+    void fill(int, int) {}
+
+    int victim(int) {
+        return random.next() % assoc;
+    }
+
+    void save(string &out) const {
+        put_le(out, random.state, 8);
+    }
+
+    void restore(ByteReader &in) {
+        random.state = in.get(8);
+    }
+
+private:
+    int assoc;
+    PolicyRandom random;
+};
+
+/*
+    One level of a set-associative cache. Every per-line field lives in
+    its own flat array indexed by row * assoc + way (and the block data
+    by (row * assoc + way) * blocksize + offset), so a lookup scans a
+    few adjacent tags and hits and misses never allocate. Policy picks
+    the victim once every way of a row is valid.
+*/
+template <class Policy>
+class CacheLevel {
+public:
+    string name;
+    int size;
+    int assoc;
+    int blocksize;
+    int num_rows;
+    vector<int> tags;
+    vector<uint8_t> valid;
+    // Set for a line written since it was filled, under write-back
+    vector<uint8_t> dirty;
+    // Set for a line put there by a prefetch and not loaded since, and
+    // the cycle its data arrives
+    vector<uint8_t> prefetched;
+    vector<uint64_t> ready;
+    vector<uint16_t> data;
+    Policy policy;
+    // Loads that hit or missed in this level, and stores that reached it
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    // Dirty lines evicted, and words written to the level below
+    uint64_t writebacks;
+    uint64_t written;
+    // Prefetches issued, those a load then used, and the uses that
+    // came before the data had arrived
+    uint64_t prefetches;
+    uint64_t useful;
+    uint64_t late;
+
+    void init(const string &name, int size, int assoc, int blocksize) {
+        this->name = name;
+        this->size = size;
+        this->assoc = assoc;
+        this->blocksize = blocksize;
+        num_rows = size / assoc / blocksize;
+        tags.assign(num_rows * assoc, 0);
+        valid.assign(num_rows * assoc, 0);
+        dirty.assign(num_rows * assoc, 0);
+        prefetched.assign(num_rows * assoc, 0);
+        ready.assign(num_rows * assoc, 0);
+        data.assign(num_rows * assoc * blocksize, 0);
+        policy.init(num_rows, assoc);
+        hits = misses = stores = writebacks = written = prefetches = useful = late = 0;
+    }
+
+    /*
+        @return The way of row holding tag, or -1 on a miss
+    */
+    int find(int row, int tag) const {
+        int base = row * assoc;
+        for (int way = 0; way < assoc; way++)
+            if (valid[base + way] && tags[base + way] == tag)
+                return way;
+        return -1;
+    }
+
+    /*
+        Records a use of a line that is already cached.
+    */
+    void touch(int row, int way) {
+        policy.touch(row, way);
+    }
+
+    /*
+        Loads block blockid from mem into row, evicting a line chosen
+        by the policy if the row is full.
+
+        @param evicted If not null, set to the block id of the line
+            evicted if it was dirty, or to -1
+        @return The way the block was placed in
+    */
+    int fill(int row, int tag, int blockid, const uint16_t mem[], int *evicted = nullptr) {
+        int base = row * assoc;
+        int victim = -1;
+        for (int way = 0; way < assoc; way++)
+            if (!valid[base + way]) {
+                victim = way;
+                break;
+            }
+        if (victim < 0)
+            victim = policy.victim(row);
+        if (evicted != nullptr)
+            *evicted = dirty[base + victim] ? tags[base + victim] * num_rows + row : -1;
+        valid[base + victim] = 1;
+        dirty[base + victim] = 0;
+        prefetched[base + victim] = 0;
+        tags[base + victim] = tag;
+        memcpy(&data[(base + victim) * blocksize], &mem[blockid * blocksize], blocksize * sizeof(uint16_t));
+        policy.fill(row, victim);
+        return victim;
+    }
+
+    /*
+        @return The cached copy of word offset of a line
+    */
+    uint16_t &word(int row, int way, int offset) {
+        return data[(row * assoc + way) * blocksize + offset];
+    }
+
+    /*
+        Appends the shape, counts, lines and replacement state of the
+        level to a checkpoint. A line's dirty bit is bit 1 of its valid
+        byte and its prefetched bit is bit 2; a prefetched line is
+        followed by the cycle its data arrives.
+    */
+    void save(string &out) const {
+        put_le(out, size, 2);
+        put_le(out, assoc, 2);
+        put_le(out, blocksize, 2);
+        put_le(out, hits, 8);
+        put_le(out, misses, 8);
+        put_le(out, stores, 8);
+        put_le(out, writebacks, 8);
+        put_le(out, written, 8);
+        put_le(out, prefetches, 8);
+        put_le(out, useful, 8);
+        put_le(out, late, 8);
+        for (size_t line = 0; line < tags.size(); line++) {
+            put_le(out, valid[line] | dirty[line] << 1 | prefetched[line] << 2, 1);
+            put_le(out, tags[line], 2);
+            if (prefetched[line])
+                put_le(out, ready[line], 8);
+        }
+        for (uint16_t word : data)
+            put_le(out, word, 2);
+        policy.save(out);
+    }
+
+    /*
+        Reads back what save wrote.
+
+        @return false if the saved level has another shape
+    */
+    bool restore(ByteReader &in) {
+        if (int(in.get(2)) != size || int(in.get(2)) != assoc || int(in.get(2)) != blocksize)
+            return false;
+        hits = in.get(8);
+        misses = in.get(8);
+        stores = in.get(8);
+        writebacks = in.get(8);
+        written = in.get(8);
+        prefetches = in.get(8);
+        useful = in.get(8);
+        late = in.get(8);
+        for (size_t line = 0; line < tags.size(); line++) {
+            uint8_t flags = in.get(1);
+            valid[line] = flags & 1;
+            dirty[line] = flags >> 1 & 1;
+            prefetched[line] = flags >> 2 & 1;
+            tags[line] = in.get(2);
+            ready[line] = prefetched[line] ? in.get(8) : 0;
+        }
+        for (uint16_t &word : data)
+            word = in.get(2);
+        policy.restore(in);
+        return in.good();
+    }
+};
+
+/*
+    Interface of the prefetchers that --prefetch attaches to a cache
+    level. The hierarchy shows a prefetcher every load that reaches its
+    level and issues the blocks it asks for:
+
+        observe(pc, addr, miss, used, blocks)
+                             sees a load of addr by the lw at pc;
+                             miss if the level missed, used if the load
+                             was the first use of a prefetched block.
+                             Appends the block ids to prefetch
+        save(out)            appends the state to a checkpoint
+        restore(in)          reads it back
+
+    A prefetcher that is buffered() keeps the blocks it prefetched
+    itself rather than in the level: the hierarchy hands them over
+    with hold(blockid, ready), asks holds(blockid) before issuing a
+    prefetch, and on a miss lets take(blockid, ready) move a block into
+    the level.
+*/
+class Prefetcher {
+public:
+    virtual ~Prefetcher() {}
+    virtual const char *name() const = 0;
+    virtual void observe(int pc, int addr, bool miss, bool used, vector<int> &blocks) = 0;
+    virtual void save(string &out) const = 0;
+    virtual void restore(ByteReader &in) = 0;
+
+    virtual bool buffered() const {
+        return false;
+    }
+
+    virtual void hold(int, uint64_t) {}
+
+    virtual bool holds(int) const {
+        return false;
+    }
+
+    /*
+        @param ready Set to the cycle the block arrives
+        @return Whether the block was held, and is no longer
+    */
+    virtual bool take(int, uint64_t &) {
+        return false;
+    }
+};
+
+/*
+    Tagged next-line prefetcher: a miss, or the first use of a block it
+    prefetched, prefetches the following block.
+*/
+class NextLinePrefetcher : public Prefetcher {
+public:
+    static constexpr const char *NAME = "next-line";
+
+    explicit NextLinePrefetcher(int blocksize) : blocksize(blocksize) {}
+
+    const char *name() const override {
+        return NAME;
+    }
+
+    void observe(int, int addr, bool miss, bool used, vector<int> &blocks) override {
+        if (miss || used)
+            blocks.push_back(addr / blocksize + 1);
+    }
+
+    void save(string &) const override {}
+    void restore(ByteReader &) override {}
+
+private:
+    int blocksize;
+};
+
+/*
+    Stride prefetcher with a reference prediction table indexed by the
+    pc of the lw. Each entry holds the last address the lw loaded, the
+    stride between its last two addresses and a 2-bit confidence that
+    rises when the stride repeats and falls when it doesn't. From a
+    confidence of 2, the blocks of the next DEGREE addresses along the
+    stride are prefetched.
+*/
+class StridePrefetcher : public Prefetcher {
+public:
+    static constexpr const char *NAME = "stride";
+    static const int ENTRIES = 64;
+    static const int DEGREE = 4;
+
+    explicit StridePrefetcher(int blocksize) : blocksize(blocksize), table(ENTRIES) {}
+
+    const char *name() const override {
+        return NAME;
+    }
+
+    void observe(int pc, int addr, bool, bool, vector<int> &blocks) override {
+        Entry &entry = table[pc % ENTRIES];
+        if (entry.pc != pc) {
+            entry = {pc, addr, 0, 0};
+            return;
+        }
+        int stride = addr - entry.last;
+        if (stride == entry.stride && stride != 0)
+            entry.confidence = min(entry.confidence + 1, 3);
+        else if (entry.confidence > 0)
+            entry.confidence--;
+        else
+            entry.stride = stride;
+        entry.last = addr;
+        if (entry.confidence < 2)
+            return;
+        int block = addr / blocksize;
+        for (int k = 1; k <= DEGREE; k++) {
+            int next = addr + k * entry.stride;
+            if (next < 0)
+                break;
+            if (next / blocksize != block) {
+                block = next / blocksize;
+                blocks.push_back(block);
+            }
+        }
+    }
+
+    void save(string &out) const override {
+        for (const Entry &entry : table) {
+            put_le(out, entry.pc, 4);
+            put_le(out, entry.last, 4);
+            put_le(out, entry.stride, 4);
+            put_le(out, entry.confidence, 1);
+        }
+    }
+
+    void restore(ByteReader &in) override {
+        for (Entry &entry : table) {
+            entry.pc = static_cast<int32_t>(in.get(4));
+            entry.last = static_cast<int32_t>(in.get(4));
+            entry.stride = static_cast<int32_t>(in.get(4));
+            entry.confidence = in.get(1);
+        }
+    }
+
+private:
+    struct Entry {
+        int pc = -1;
+        int last = 0;
+        int stride = 0;
+        int confidence = 0;
+    };
+
+    int blocksize;
+    vector<Entry> table;
+};
+
+/*
+    Stream buffers after Jouppi: BUFFERS FIFOs of up to DEPTH blocks
+    that sit beside the level. A miss that no buffer holds restarts the
+    least recently used buffer at the following blocks. A miss that a
+    buffer holds takes the block from it, drops the blocks before it
+    and tops the buffer up further along the stream.
+*/
+class StreamBuffers : public Prefetcher {
+public:
+    static constexpr const char *NAME = "stream";
+    static const int BUFFERS = 4;
+    static const int DEPTH = 4;
+
+    explicit StreamBuffers(int blocksize) : blocksize(blocksize), buffers(BUFFERS) {}
+
+    const char *name() const override {
+        return NAME;
+    }
+
+    void observe(int, int addr, bool miss, bool used, vector<int> &blocks) override {
+        if (miss) {
+            current = 0;
+            for (int i = 1; i < BUFFERS; i++)
+                if (buffers[i].stamp < buffers[current].stamp)
+                    current = i;
+            buffers[current].blocks.clear();
+            buffers[current].next = addr / blocksize + 1;
+        } else if (!used || !taken)
+            return;
+        taken = false;
+        Buffer &buffer = buffers[current];
+        buffer.stamp = ++clock;
+        for (size_t n = buffer.blocks.size(); n < static_cast<size_t>(DEPTH); n++)
+            blocks.push_back(buffer.next++);
+    }
+
+    bool buffered() const override {
+        return true;
+    }
+
+    void hold(int blockid, uint64_t ready) override {
+        buffers[current].blocks.push_back({blockid, ready});
+    }
+
+    bool holds(int blockid) const override {
+        for (const Buffer &buffer : buffers)
+            for (const auto &held : buffer.blocks)
+                if (held.first == blockid)
+                    return true;
+        return false;
+    }
+
+    bool take(int blockid, uint64_t &ready) override {
+        for (int i = 0; i < BUFFERS; i++) {
+            deque<pair<int, uint64_t>> &held = buffers[i].blocks;
+            for (size_t k = 0; k < held.size(); k++)
+                if (held[k].first == blockid) {
+                    ready = held[k].second;
+                    held.erase(held.begin(), held.begin() + k + 1);
+                    current = i;
+                    taken = true;
+                    return true;
+                }
+        }
+        return false;
+    }
+
+    void save(string &out) const override {
+        put_le(out, clock, 8);
+        put_le(out, current, 1);
+        put_le(out, taken, 1);
+        for (const Buffer &buffer : buffers) {
+            put_le(out, buffer.next, 4);
+            put_le(out, buffer.stamp, 8);
+            put_le(out, buffer.blocks.size(), 1);
+            for (const auto &held : buffer.blocks) {
+                put_le(out, held.first, 4);
+                put_le(out, held.second, 8);
+            }
+        }
+    }
+
+    void restore(ByteReader &in) override {
+        clock = in.get(8);
+        current = in.get(1);
+        taken = in.get(1);
+        for (Buffer &buffer : buffers) {
+            buffer.next = in.get(4);
+            buffer.stamp = in.get(8);
+            buffer.blocks.resize(in.get(1));
+            for (auto &held : buffer.blocks) {
+                held.first = in.get(4);
+                held.second = in.get(8);
+            }
+        }
+    }
+
+private:
+    struct Buffer {
+        // Block ids held, oldest first, with the cycle each arrives
+        deque<pair<int, uint64_t>> blocks;
+        int next = 0;
+        uint64_t stamp = 0;
+    };
+
+    int blocksize;
+    vector<Buffer> buffers;
+    uint64_t clock = 0;
+    // The buffer restarted or taken from last, which hold fills
+    int current = 0;
+    bool taken = false;
+};
+
+/*
+    @return The prefetcher --prefetch calls name, for a level with the
+        given blocksize, or nullptr for none or an unknown name
+*/
+unique_ptr<Prefetcher> make_prefetcher(const string &name, int blocksize) {
+    unique_ptr<Prefetcher> prefetcher;
+    if (name == NextLinePrefetcher::NAME)
+        prefetcher.reset(new NextLinePrefetcher(blocksize));
+    else if (name == StridePrefetcher::NAME)
+        prefetcher.reset(new StridePrefetcher(blocksize));
+    else if (name == StreamBuffers::NAME)
+        prefetcher.reset(new StreamBuffers(blocksize));
+    return prefetcher;
+}
+
+size_t const static NUM_REGS = 8; 
+size_t const static MEM_SIZE = 1<<13;
+size_t const static REG_SIZE = 1<<16;
+// Deepest cache hierarchy accepted by --cache
+size_t const static MAX_LEVELS = 4;
+uint16_t isoverflow(uint16_t input){
+    while(!(input < MEM_SIZE)){
+        input -= MEM_SIZE;
+    }
+    return input;
+}
+
+/*
+    Parses one line of the form "ram[N] = 16'bBBBB;" followed by
+    anything, without allocating.
+
+    @param p First character of the line
+    @param eol One past the last character of the line
+    @param addr Set to the decimal address N
+    @param instr Set to the binary value B
+    @return false if the line doesn't have that form
+*/
+bool scan_machine_code_line(const char *p, const char *eol, size_t &addr, unsigned &instr) {
+    static const char prefix[] = "ram[";
+    static const char middle[] = "] = 16'b";
+    for (const char *c = prefix; *c; c++, p++)
+        if (p == eol || *p != *c)
+            return false;
+    if (p == eol || *p < '0' || *p > '9')
+        return false;
+    // Saturate absurdly long addresses; they are out of sequence anyway
+    addr = 0;
+    for (; p != eol && *p >= '0' && *p <= '9'; p++)
+        addr = (addr < 100000000) ? addr * 10 + (*p - '0') : addr;
+    for (const char *c = middle; *c; c++, p++)
+        if (p == eol || *p != *c)
+            return false;
+    if (p == eol || (*p != '0' && *p != '1'))
+        return false;
+    instr = 0;
+    for (; p != eol && (*p == '0' || *p == '1'); p++)
+        instr = (instr << 1) | (*p - '0');
+    return p != eol && *p == ';';
+}
+
+/*
+    Loads an E20 machine code listing into the list
+    provided by mem. We assume that mem is
+    large enough to hold the values in the machine
+    code file.
+
+    @param text Contents of the machine code file
+    @param size Length of text in bytes
+    @param mem Array represetnting memory into which to read program
+*/
+void load_machine_code(const char *text, size_t size, uint16_t mem[]) {
+    const char *p = text;
+    const char *end = p + size;
+    size_t expectedaddr = 0;
+    while (p < end) {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (eol == nullptr)
+            eol = end;
+        size_t addr;
+        unsigned instr;
+        if (!scan_machine_code_line(p, eol, addr, instr)) {
+            cerr << "Can't parse line: " << string(p, eol) << endl;
+            exit(1);
+        }
+        if (addr != expectedaddr) {
+            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
+            exit(1);
+        }
+        if (addr >= MEM_SIZE) {
+            cerr << "Program too big for memory" << endl;
+            exit(1);
+        }
+        expectedaddr ++;
+        mem[addr] = instr;
+        p = eol + 1;
+    }
+}
+
+/*
+    Binary E20 image, as written by asm --format=bin. All fields are
+    little-endian:
+
+        offset  size  field
+        0       4     magic "E20B"
+        4       2     format version, currently 1
+        6       2     flags; IMAGE_HAS_ENTRY if entry is meaningful
+        8       4     number of 16-bit words in the image
+        12      2     entry pc
+        14      2     length of the metadata section in bytes
+        16      ...   metadata (free-form text, e.g. the source name)
+        ...     ...   the words, loaded starting at address 0
+*/
+const char IMAGE_MAGIC[4] = {'E', '2', '0', 'B'};
+uint16_t const static IMAGE_VERSION = 1;
+uint16_t const static IMAGE_HAS_ENTRY = 1;
+size_t const static IMAGE_HEADER_SIZE = 16;
+
+/*
+    Reads a little-endian 16-bit value.
+*/
+uint16_t read_le16(const char *p) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return u[0] | (u[1] << 8);
+}
+
+/*
+    Loads a binary E20 image into mem.
+
+    @param data Contents of the image file
+    @param size Length of data in bytes
+    @param mem Array representing memory into which to read program
+    @param entry Set to the entry pc if the image has one
+*/
+void load_binary_image(const char *data, size_t size, uint16_t mem[], uint16_t &entry) {
+    if (size < IMAGE_HEADER_SIZE) {
+        cerr << "Truncated binary image" << endl;
+        exit(1);
+    }
+    if (read_le16(data + 4) != IMAGE_VERSION) {
+        cerr << "Unsupported binary image version " << read_le16(data + 4) << endl;
+        exit(1);
+    }
+    uint16_t flags = read_le16(data + 6);
+    size_t words = read_le16(data + 8) | (static_cast<size_t>(read_le16(data + 10)) << 16);
+    size_t metadata = read_le16(data + 14);
+    if (words > MEM_SIZE) {
+        cerr << "Program too big for memory" << endl;
+        exit(1);
+    }
+    if (size < IMAGE_HEADER_SIZE + metadata + 2 * words) {
+        cerr << "Truncated binary image" << endl;
+        exit(1);
+    }
+    const char *p = data + IMAGE_HEADER_SIZE + metadata;
+    for (size_t addr = 0; addr < words; addr++, p += 2)
+        mem[addr] = read_le16(p);
+    if (flags & IMAGE_HAS_ENTRY)
+        entry = read_le16(data + 12) & (MEM_SIZE - 1);
+}
+
+/*
+    A whole file mapped read-only into memory, or read into a
+    buffer where mmap isn't available.
+*/
+class MappedFile {
+public:
+    const char *data = nullptr;
+    size_t size = 0;
+
+    bool open(const char *filename) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            // Pipes and the like can't be mapped, so read them instead
+            char chunk[1 << 16];
+            ssize_t got;
+            while ((got = ::read(fd, chunk, sizeof(chunk))) > 0)
+                buffer.append(chunk, got);
+            ::close(fd);
+            data = buffer.data();
+            size = buffer.size();
+            return got == 0;
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                return false;
+            }
+            mapping = p;
+            data = static_cast<const char *>(p);
+        }
+        ::close(fd);
+        return true;
+#else
+        ifstream f(filename, ios::binary);
+        if (!f.is_open())
+            return false;
+        f.seekg(0, ios::end);
+        buffer.resize(static_cast<size_t>(f.tellg()));
+        f.seekg(0, ios::beg);
+        f.read(&buffer[0], buffer.size());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+#endif
+    }
+
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapping != nullptr)
+            munmap(mapping, size);
+#endif
+    }
+
+private:
+    void *mapping = nullptr;
+    string buffer;
+};
+
+/*
+    Loads an E20 program into mem. Binary images are recognized by
+    their magic number; anything else is parsed as a machine code
+    listing.
+
+    @param filename The file to load
+    @param mem Array representing memory into which to read program
+    @param entry Set to the entry pc if the image has one
+    @return false if the file can't be opened
+*/
+bool load_image(const char *filename, uint16_t mem[], uint16_t &entry) {
+    MappedFile file;
+    if (!file.open(filename))
+        return false;
+    if (file.size >= sizeof(IMAGE_MAGIC) && memcmp(file.data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0)
+        load_binary_image(file.data, file.size, mem, entry);
+    else
+        load_machine_code(file.data, file.size, mem);
+    return true;
+}
+
+/*
+    Binary memory trace, as written by --record-trace. An 8-byte header
+    of the magic "E20T", the format version (currently 1) and two
+    reserved bytes is followed by one little-endian 32-bit record per
+    memory access:
+
+        bits 0-12   pc of the lw or sw
+        bits 13-25  address accessed
+        bit 26      set for a store
+*/
+const char TRACE_MAGIC[4] = {'E', '2', '0', 'T'};
+uint16_t const static TRACE_VERSION = 1;
+size_t const static TRACE_HEADER_SIZE = 8;
+uint32_t const static TRACE_STORE = 1u << 26;
+
+/*
+    Writes a binary memory trace, buffering the records so that
+    recording costs little more than a store per access.
+*/
+class TraceWriter {
+public:
+    /*
+        @param filename The trace file to create
+    */
+    explicit TraceWriter(const char *filename) : out(filename, ios::binary) {
+        char header[TRACE_HEADER_SIZE] = {0};
+        memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        header[4] = TRACE_VERSION & 0xFF;
+        header[5] = TRACE_VERSION >> 8;
+        out.write(header, sizeof(header));
+    }
+
+    ~TraceWriter() {
+        flush();
+    }
+
+    /*
+        @return false if the file couldn't be created or written
+    */
+    bool good() const {
+        return out.good();
+    }
+
+    void load(uint16_t pc, uint16_t addr) {
+        put(pc | addr << 13);
+    }
+
+    void store(uint16_t pc, uint16_t addr) {
+        put(pc | addr << 13 | TRACE_STORE);
+    }
+
+    void flush() {
+        out.write(buffer, used);
+        out.flush();
+        used = 0;
+    }
+
+private:
+    ofstream out;
+    char buffer[1 << 16];
+    size_t used = 0;
+
+    void put(uint32_t record) {
+        if (used == sizeof(buffer))
+            flush();
+        for (int i = 0; i < 4; i++)
+            buffer[used++] = (record >> (8 * i)) & 0xFF;
+    }
+};
+
+/*
+    Checkpoint file, as written by --checkpoint-every: a snapshot of
+    the machine taken between two instructions, from which --restore
+    resumes the run. The 4-byte magic "E20K" is followed by, all
+    little-endian:
+
+        16 bits   format version (currently 4)
+        16 bits   number of cache levels whose state follows (0 from sim)
+        64 bits   instructions executed before the snapshot
+        16 bits   pc
+        16 bits   each of the NUM_REGS registers
+        16 bits   each of the MEM_SIZE words of memory
+
+    and then the state of the caches, see CacheHierarchy::save.
+*/
+const char CHECKPOINT_MAGIC[4] = {'E', '2', '0', 'K'};
+uint16_t const static CHECKPOINT_VERSION = 4;
+size_t const static CHECKPOINT_SIZE = 16 + 2 * (1 + NUM_REGS + MEM_SIZE);
+
+/*
+    The machine state held by a checkpoint. Memory is kept apart, in
+    the array the simulator runs on.
+*/
+struct Checkpoint {
+    uint64_t instructions = 0;
+    uint16_t pc = 0;
+    uint16_t regs[NUM_REGS] = {0};
+    // Number of cache levels saved in caches, and their state
+    uint16_t levels = 0;
+    string caches;
+    // Set if the program halted while fast-forwarding; never saved
+    bool halted = false;
+};
+
+/*
+    Writes a checkpoint. The file is written under a temporary name
+    and then renamed, so a crash while saving leaves the previous
+    checkpoint intact.
+
+    @return false if the file couldn't be written
+*/
+bool save_checkpoint(const string &filename, const Checkpoint &state, const uint16_t mem[]) {
+    string out(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    put_le(out, CHECKPOINT_VERSION, 2);
+    put_le(out, state.levels, 2);
+    put_le(out, state.instructions, 8);
+    put_le(out, state.pc, 2);
+    for (size_t reg = 0; reg < NUM_REGS; reg++)
+        put_le(out, state.regs[reg], 2);
+    for (size_t addr = 0; addr < MEM_SIZE; addr++)
+        put_le(out, mem[addr], 2);
+    out += state.caches;
+
+    string temp = filename + ".tmp";
+    ofstream file(temp, ios::binary);
+    file.write(out.data(), out.size());
+    file.close();
+    return !file.fail() && rename(temp.c_str(), filename.c_str()) == 0;
+}
+
+/*
+    Reads a checkpoint into state and mem.
+
+    @return false if the file can't be opened or isn't a checkpoint
+*/
+bool load_checkpoint(const char *filename, Checkpoint &state, uint16_t mem[]) {
+    MappedFile file;
+    if (!file.open(filename) || file.size < CHECKPOINT_SIZE)
+        return false;
+    const char *p = file.data;
+    if (memcmp(p, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 || read_le16(p + 4) != CHECKPOINT_VERSION)
+        return false;
+    state.levels = read_le16(p + 6);
+    state.instructions = read_le(p + 8, 8);
+    state.pc = read_le16(p + 16) & (MEM_SIZE - 1);
+    p += 18;
+    for (size_t reg = 0; reg < NUM_REGS; reg++, p += 2)
+        state.regs[reg] = read_le16(p);
+    for (size_t addr = 0; addr < MEM_SIZE; addr++, p += 2)
+        mem[addr] = read_le16(p);
+    state.caches.assign(p, file.data + file.size);
+    return true;
+}
+
+/*
+    Prints out the correctly-formatted configuration of a cache.
+
+    @param cache_name The name of the cache. "L1" or "L2"
+
+    @param size The total size of the cache, measured in memory cells.
+        Excludes metadata
+
+    @param assoc The associativity of the cache. One of [1,2,4,8,16]
+
+    @param blocksize The blocksize of the cache. One of [1,2,4,8,16,32,64])
+
+    @param num_rows The number of rows in the given cache.
+*/
+void print_cache_config(const string &cache_name, int size, int assoc, int blocksize, int num_rows) {
+    cout << "Cache " << cache_name << " has size " << size <<
+        ", associativity " << assoc << ", blocksize " << blocksize <<
+        ", rows " << num_rows << endl;
+}
+
+/*
+    Prints the configuration of every level, L1 first, and the
+    replacement policy unless it is the default LRU.
+
+    @param parts size,associativity,blocksize for each level
+    @param policy Name of the replacement policy
+*/
+void print_cache_configs(const vector<int> &parts, const string &policy = LRUPolicy::NAME) {
+    for (size_t i = 0; i < parts.size() / 3; i++) {
+        int size = parts[3 * i];
+        int assoc = parts[3 * i + 1];
+        int blocksize = parts[3 * i + 2];
+        print_cache_config("L" + to_string(i + 1), size, assoc, blocksize, size / assoc / blocksize);
+    }
+    if (policy != LRUPolicy::NAME)
+        cout << "Replacement policy " << policy << endl;
+}
+
+/*
+    Prints out a correctly-formatted log entry.
+
+    @param cache_name The name of the cache where the event
+        occurred. "L1" or "L2"
+
+    @param status The kind of cache event. "SW", "HIT", "MISS",
+        or "PF" for a block a prefetcher brought in
+
+    @param pc The program counter of the memory
+        access instruction
+
+    @param addr The memory address being accessed.
+
+    @param row The cache row or set number where the data
+        is stored.
+*/
+void print_log_entry(const string &cache_name, const string &status, int pc, int addr, int row) {
+    cout << left << setw(8) << cache_name + " " + status <<  right <<
+        " pc:" << setw(5) << pc <<
+        "\taddr:" << setw(5) << addr <<
+        "\trow:" << setw(4) << row << endl;
+}
+
+/*
+    Kinds of cache events, in the order of LOG_STATUS_NAMES. A PF event
+    is logged with the address of the first word of the block.
+*/
+enum LogStatus : uint8_t {LOG_HIT, LOG_MISS, LOG_SW, LOG_PF};
+const char *const LOG_STATUS_NAMES[] = {"HIT", "MISS", "SW", "PF"};
+
+/*
+    Binary cache event log, as written by --log=binary. An 8-byte
+    header of the magic "E20L", the format version (currently 1) and
+    the number of levels is followed by the size, associativity and
+    blocksize of every level as little-endian 32-bit values. Then comes
+    one little-endian 32-bit record per event:
+
+        bits 0-12   pc of the lw or sw
+        bits 13-25  address accessed
+        bits 26-27  LogStatus
+        bits 28-29  level, 0 for L1
+*/
+const char LOG_MAGIC[4] = {'E', '2', '0', 'L'};
+uint16_t const static LOG_VERSION = 1;
+
+/*
+    Writes cache events to cout through a large buffer, formatting the
+    numbers by hand. The text produced is exactly that of
+    print_log_entry, without a flush after every line.
+*/
+class LogWriter {
+public:
+    enum Format {TEXT, BINARY};
+
+    explicit LogWriter(Format format) : format(format) {}
+
+    ~LogWriter() {
+        flush();
+    }
+
+    /*
+        Starts a binary log. Does nothing for a text log.
+
+        @param parts size,associativity,blocksize for each level
+    */
+    void header(const vector<int> &parts) {
+        if (format != BINARY)
+            return;
+        memcpy(buffer + used, LOG_MAGIC, sizeof(LOG_MAGIC));
+        used += sizeof(LOG_MAGIC);
+        put_le(LOG_VERSION, 2);
+        put_le(parts.size() / 3, 2);
+        for (int part : parts)
+            put_le(part, 4);
+    }
+
+    /*
+        Logs one event, with the same arguments as print_log_entry
+        plus the level's index.
+    */
+    void entry(const string &cache_name, size_t level, LogStatus status, int pc, int addr, int row) {
+        if (used + cache_name.size() + 64 > sizeof(buffer))
+            flush();
+        if (format == BINARY) {
+            put_le(pc | addr << 13 | status << 26 | level << 28, 4);
+            return;
+        }
+        char *start = buffer + used;
+        char *p = start;
+        memcpy(p, cache_name.data(), cache_name.size());
+        p += cache_name.size();
+        *p++ = ' ';
+        for (const char *s = LOG_STATUS_NAMES[status]; *s; s++)
+            *p++ = *s;
+        while (p < start + 8)
+            *p++ = ' ';
+        p = put_field(p, " pc:", 4, pc, 5);
+        p = put_field(p, "\taddr:", 6, addr, 5);
+        p = put_field(p, "\trow:", 5, row, 4);
+        *p++ = '\n';
+        used = p - buffer;
+    }
+
+    void flush() {
+        cout.write(buffer, used);
+        used = 0;
+    }
+
+private:
+    Format format;
+    char buffer[1 << 16];
+    size_t used = 0;
+
+    void put_le(uint32_t value, int bytes) {
+        for (int i = 0; i < bytes; i++)
+            buffer[used++] = (value >> (8 * i)) & 0xFF;
+    }
+
+    /*
+        Writes label followed by value right-aligned in width columns,
+        like setw(width) does.
+    */
+    static char *put_field(char *p, const char *label, size_t label_size, int value, int width) {
+        memcpy(p, label, label_size);
+        p += label_size;
+        char digits[12];
+        int n = 0;
+        unsigned v = value < 0 ? -static_cast<unsigned>(value) : value;
+        do {
+            digits[n++] = '0' + v % 10;
+            v /= 10;
+        } while (v != 0);
+        if (value < 0)
+            digits[n++] = '-';
+        for (int i = n; i < width; i++)
+            *p++ = ' ';
+        while (n > 0)
+            *p++ = digits[--n];
+        return p;
+    }
+};
+
+/*
+    Hit and miss counts of one cache level, the writes it passed down
+    to the next level or to memory, and the work of its prefetcher.
+*/
+struct LevelStats {
+    string name;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t writebacks;
+    uint64_t written;
+    uint64_t prefetches;
+    uint64_t useful;
+    uint64_t late;
+};
+
+/*
+    How stores are handled, as given by --write-policy. Write-through
+    passes every store on to the next level and to memory; write-back
+    only marks the line dirty, and the whole line is written to the
+    next level when it is evicted. A store that misses allocates its
+    line only under write-allocate.
+*/
+struct WritePolicy {
+    bool back = false;
+    bool allocate = true;
+
+    bool operator==(const WritePolicy &other) const {
+        return back == other.back && allocate == other.allocate;
+    }
+};
+
+/*
+    Latencies for turning cache events into time: the hit latency of
+    every level, L1 first, and the latency of main memory, in cycles.
+    A configuration with fewer levels uses the first hit latencies.
+*/
+struct CacheLatency {
+    vector<int> hit;
+    int memory = 0;
+
+    bool enabled() const {
+        return !hit.empty();
+    }
+};
+
+/*
+    Time spent on loads. A load costs the hit latency of every level
+    it looks in, plus the memory latency if it misses in all of them;
+    its stall cycles are those beyond an L1 hit. Stores are taken to
+    go through a write buffer and cost nothing beyond an L1 hit.
+*/
+struct CacheTiming {
+    uint64_t instructions = 0;
+    uint64_t loads = 0;
+    uint64_t load_cycles = 0;
+    uint64_t stall_cycles = 0;
+
+    double amat() const {
+        return loads ? double(load_cycles) / loads : 0.0;
+    }
+
+    // One cycle per instruction plus the memory stalls
+    uint64_t cycles() const {
+        return instructions + stall_cycles;
+    }
+};
+
+/*
+    A hierarchy of N cache levels, L1 first, all using the same
+    replacement policy. Both are template parameters, so the access
+    loops below are specialized for every configuration.
+
+    A load walks down the levels until one hits, fills every level
+    that missed and logs each level it visited. Only an L1 hit updates
+    the replacement state; a hit in a lower level leaves it alone, as
+    the L2 did in the original two-level simulator. A level can have a
+    prefetcher, which sees the loads that reach it. By default a store
+    writes through to memory and updates or allocates its line in every
+    level; see store for the other write policies.
+
+    Fills always copy from mem, which execute keeps current, so under
+    write-back only the dirty bits and the traffic are modeled; the
+    data a load returns is the same under every write policy.
+*/
+template <class Policy, size_t N>
+class CacheHierarchy {
+public:
+    CacheLevel<Policy> levels[N];
+    const uint16_t *mem;
+    // Where accesses are logged, if anywhere
+    LogWriter *log = nullptr;
+    WritePolicy write;
+    // Prefetcher of every level, if any, set by set_prefetchers
+    unique_ptr<Prefetcher> prefetchers[N];
+    bool prefetching = false;
+    // Cycles so far: one per instruction, plus the stalls of the loads
+    uint64_t clock = 0;
+    // Cycles taken by a load that hits in level i, or that misses in
+    // every level for i == N; all zero unless latencies are set
+    uint64_t load_latency[N + 1] = {0};
+    uint64_t load_cycles = 0;
+    // Instructions run through the caches, as opposed to fast-forwarded
+    uint64_t instructions = 0;
+
+    /*
+        @param parts size,associativity,blocksize for each level
+        @param mem Main memory, read on every fill
+    */
+    CacheHierarchy(const vector<int> &parts, const uint16_t mem[]) : mem(mem) {
+        for (size_t i = 0; i < N; i++)
+            levels[i].init("L" + to_string(i + 1), parts[3 * i], parts[3 * i + 1], parts[3 * i + 2]);
+    }
+
+    /*
+        @param latency Has a hit latency for at least N levels
+    */
+    void set_latency(const CacheLatency &latency) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < N; i++)
+            load_latency[i] = sum += latency.hit[i];
+        load_latency[N] = sum + latency.memory;
+    }
+
+    /*
+        @return The value of the word at addr, as held by L1
+    */
+    uint16_t load(int pc, int addr) {
+        LogStatus status[N];
+        int rows[N];
+        int blockids[N];
+        int tags[N];
+        bool used = false;
+        size_t hit_level = N;
+        int way = -1;
+        uint64_t wait = 0;
+        for (size_t i = 0; i < N; i++) {
+            CacheLevel<Policy> &level = levels[i];
+            blockids[i] = addr / level.blocksize;
+            rows[i] = blockids[i] % level.num_rows;
+            tags[i] = blockids[i] / level.num_rows;
+            int found = level.find(rows[i], tags[i]);
+            if (prefetching)
+                found = use_prefetch(i, rows[i], tags[i], blockids[i], found, used, wait);
+            if (found >= 0) {
+                status[i] = LOG_HIT;
+                level.hits++;
+                if (i == 0) {
+                    level.touch(rows[i], found);
+                    way = found;
+                }
+                hit_level = i;
+                break;
+            }
+            status[i] = LOG_MISS;
+            level.misses++;
+        }
+        load_cycles += load_latency[hit_level] + wait;
+        clock += load_latency[hit_level] + wait - load_latency[0];
+        for (size_t i = (hit_level < N ? hit_level : N); i-- > 0; ) {
+            int filled = fill(i, rows[i], tags[i], blockids[i]);
+            if (i == 0)
+                way = filled;
+        }
+        if (log != nullptr)
+            for (size_t i = 0; i < N && i <= hit_level; i++)
+                log->entry(levels[i].name, i, status[i], pc, addr, rows[i]);
+        uint16_t value = levels[0].word(rows[0], way, addr & (levels[0].blocksize - 1));
+        if (prefetching)
+            for (size_t i = 0; i < N && i <= hit_level; i++)
+                if (prefetchers[i]) {
+                    prefetchers[i]->observe(pc, addr, status[i] == LOG_MISS, used && i == hit_level, pending);
+                    for (int block : pending)
+                        prefetch(i, pc, block);
+                    pending.clear();
+                }
+        return value;
+    }
+
+    /*
+        Models a store of mem[addr], which has already been written.
+
+        Under write-through the store goes to every level: each one
+        updates the line if it has it, allocates it on a miss under
+        write-allocate, and passes the word on. Under write-back the
+        store walks down the levels like a load until one has the line.
+        With write-allocate every level above that one is filled and
+        the L1 line is marked dirty; without it, the level that had the
+        line marks it dirty, and if none had it the word goes to memory.
+        Every level the store looked in is logged.
+    */
+    void store(int pc, int addr) {
+        int rows[N];
+        int blockids[N];
+        int tags[N];
+        size_t hit_level = N;
+        for (size_t i = 0; i < N; i++) {
+            CacheLevel<Policy> &level = levels[i];
+            blockids[i] = addr / level.blocksize;
+            rows[i] = blockids[i] % level.num_rows;
+            tags[i] = blockids[i] / level.num_rows;
+            int way = level.find(rows[i], tags[i]);
+            level.stores++;
+            if (!write.back) {
+                if (way >= 0) {
+                    level.word(rows[i], way, addr & (level.blocksize - 1)) = mem[addr];
+                    level.touch(rows[i], way);
+                } else if (write.allocate)
+                    fill(i, rows[i], tags[i], blockids[i]);
+                level.written++;
+                continue;
+            }
+            if (way >= 0) {
+                hit_level = i;
+                if (i == 0 || !write.allocate) {
+                    level.word(rows[i], way, addr & (level.blocksize - 1)) = mem[addr];
+                    level.dirty[rows[i] * level.assoc + way] = 1;
+                    level.touch(rows[i], way);
+                }
+                break;
+            }
+            if (!write.allocate)
+                level.written++;
+        }
+        if (write.back && write.allocate && hit_level != 0) {
+            int way = -1;
+            for (size_t i = hit_level; i-- > 0; )
+                way = fill(i, rows[i], tags[i], blockids[i]);
+            levels[0].word(rows[0], way, addr & (levels[0].blocksize - 1)) = mem[addr];
+            levels[0].dirty[rows[0] * levels[0].assoc + way] = 1;
+        }
+        if (log != nullptr)
+            for (size_t i = 0; i < N && i <= hit_level; i++)
+                log->entry(levels[i].name, i, LOG_SW, pc, addr, rows[i]);
+    }
+
+    void step(int) {
+        clock++;
+    }
+
+    /*
+        Attaches a prefetcher to every level that names one.
+
+        @param names A prefetcher name or "none" for each of the first
+            levels; the other levels get none
+    */
+    void set_prefetchers(const vector<string> &names) {
+        for (size_t i = 0; i < N && i < names.size(); i++) {
+            prefetchers[i] = make_prefetcher(names[i], levels[i].blocksize);
+            prefetching = prefetching || prefetchers[i];
+        }
+    }
+
+    /*
+        Checks a load that reached level i against what its prefetcher
+        brought in. The first load of a prefetched line counts as a
+        useful prefetch, and as a late one if the data has yet to
+        arrive, in which case the load waits for it. A missing line
+        that a buffered prefetcher holds is moved into the level.
+
+        @param found The way holding the line, or -1
+        @param used Set if a prefetched line was used
+        @param wait Set to the cycles left until its data arrives
+        @return The way now holding the line, or -1
+    */
+    int use_prefetch(size_t i, int row, int tag, int blockid, int found, bool &used, uint64_t &wait) {
+        CacheLevel<Policy> &level = levels[i];
+        uint64_t ready;
+        if (found >= 0 && level.prefetched[row * level.assoc + found]) {
+            level.prefetched[row * level.assoc + found] = 0;
+            ready = level.ready[row * level.assoc + found];
+        } else if (found < 0 && prefetchers[i] && prefetchers[i]->take(blockid, ready))
+            found = fill(i, row, tag, blockid);
+        else
+            return found;
+        used = true;
+        level.useful++;
+        if (ready > clock) {
+            level.late++;
+            wait = ready - clock;
+        }
+        return found;
+    }
+
+    /*
+        Prefetches block blockid into level i for the lw at pc, unless
+        the level or its prefetcher has it already. Like a load, it is
+        brought from the first level below that has it, filling the
+        levels in between, and its data arrives after the time such a
+        load would take. The lower levels count no hits or misses for
+        it, and every level filled is logged as PF.
+    */
+    void prefetch(size_t i, int pc, int blockid) {
+        CacheLevel<Policy> &level = levels[i];
+        if (blockid < 0 || static_cast<size_t>(blockid) * level.blocksize >= MEM_SIZE)
+            return;
+        int row = blockid % level.num_rows;
+        int tag = blockid / level.num_rows;
+        if (level.find(row, tag) >= 0 || prefetchers[i]->holds(blockid))
+            return;
+        int addr = blockid * level.blocksize;
+        int rows[N] = {0};
+        size_t from = i + 1;
+        for (; from < N; from++) {
+            const CacheLevel<Policy> &lower = levels[from];
+            int block = addr / lower.blocksize;
+            rows[from] = block % lower.num_rows;
+            if (lower.find(rows[from], block / lower.num_rows) >= 0)
+                break;
+        }
+        for (size_t j = from; j-- > i + 1; ) {
+            int block = addr / levels[j].blocksize;
+            fill(j, rows[j], block / levels[j].num_rows, block);
+        }
+        uint64_t ready = clock + load_latency[from] - load_latency[i];
+        level.prefetches++;
+        if (prefetchers[i]->buffered())
+            prefetchers[i]->hold(blockid, ready);
+        else {
+            int way = fill(i, row, tag, blockid);
+            level.prefetched[row * level.assoc + way] = 1;
+            level.ready[row * level.assoc + way] = ready;
+        }
+        if (log != nullptr) {
+            log->entry(level.name, i, LOG_PF, pc, addr, row);
+            for (size_t j = i + 1; j < from; j++)
+                log->entry(levels[j].name, j, LOG_PF, pc, addr, rows[j]);
+        }
+    }
+
+    /*
+        Fills a line of level i, writing the line it evicts back to
+        the level below if it was dirty.
+
+        @return The way the block was placed in
+    */
+    int fill(size_t i, int row, int tag, int blockid) {
+        int evicted;
+        int way = levels[i].fill(row, tag, blockid, mem, &evicted);
+        if (evicted >= 0) {
+            levels[i].writebacks++;
+            levels[i].written += levels[i].blocksize;
+            write_back(i + 1, evicted * levels[i].blocksize, levels[i].blocksize);
+        }
+        return way;
+    }
+
+    /*
+        Writes words words from addr on back into level i, or into
+        memory if i == N. A line that is there is marked dirty; one
+        that isn't is allocated dirty under write-allocate and passed
+        further down otherwise.
+    */
+    void write_back(size_t i, int addr, int words) {
+        if (i == N)
+            return;
+        CacheLevel<Policy> &level = levels[i];
+        for (int block = addr / level.blocksize; block * level.blocksize < addr + words; block++) {
+            int row = block % level.num_rows;
+            int tag = block / level.num_rows;
+            int way = level.find(row, tag);
+            if (way < 0 && write.allocate)
+                way = fill(i, row, tag, block);
+            if (way >= 0) {
+                memcpy(&level.word(row, way, 0), &mem[block * level.blocksize],
+                       level.blocksize * sizeof(uint16_t));
+                level.dirty[row * level.assoc + way] = 1;
+            } else {
+                int start = max(addr, block * level.blocksize);
+                int end = min(addr + words, (block + 1) * level.blocksize);
+                level.written += end - start;
+                write_back(i + 1, start, end - start);
+            }
+        }
+    }
+
+    /*
+        @return The counts of every level, L1 first
+    */
+    vector<LevelStats> stats() const {
+        vector<LevelStats> result;
+        for (const auto &level : levels)
+            result.push_back({level.name, level.hits, level.misses, level.stores, level.writebacks,
+                              level.written, level.prefetches, level.useful, level.late});
+        return result;
+    }
+
+    /*
+        @return The time spent on loads and the instructions run
+    */
+    CacheTiming timing() const {
+        CacheTiming result;
+        result.instructions = instructions;
+        result.loads = levels[0].hits + levels[0].misses;
+        result.load_cycles = load_cycles;
+        result.stall_cycles = load_cycles - result.loads * load_latency[0];
+        return result;
+    }
+
+    /*
+        Stores the name of the replacement policy, the write policy as
+        a byte of write-back (bit 0) and write-allocate (bit 1), and the
+        state of every level in a checkpoint, each followed by the name
+        and state of its prefetcher, if any. The latencies and the time
+        accumulated with them come last.
+    */
+    void save(Checkpoint &state) const {
+        state.levels = N;
+        state.caches.clear();
+        put_le(state.caches, strlen(Policy::NAME), 1);
+        state.caches += Policy::NAME;
+        put_le(state.caches, write.back | write.allocate << 1, 1);
+        for (size_t i = 0; i < N; i++) {
+            levels[i].save(state.caches);
+            string name = prefetchers[i] ? prefetchers[i]->name() : "";
+            put_le(state.caches, name.size(), 1);
+            state.caches += name;
+            if (prefetchers[i])
+                prefetchers[i]->save(state.caches);
+        }
+        for (uint64_t latency : load_latency)
+            put_le(state.caches, latency, 8);
+        put_le(state.caches, load_cycles, 8);
+        put_le(state.caches, instructions, 8);
+        put_le(state.caches, clock, 8);
+    }
+
+    /*
+        Takes the state of every level from a checkpoint.
+
+        @return false if it was saved for other levels, latencies,
+            replacement policy, write policy or prefetchers
+    */
+    bool restore(const Checkpoint &state) {
+        if (state.levels != N)
+            return false;
+        ByteReader in(state.caches);
+        string policy;
+        for (size_t length = in.get(1); length > 0; length--)
+            policy += static_cast<char>(in.get(1));
+        uint64_t writes = in.get(1);
+        if (policy != Policy::NAME || writes != static_cast<uint64_t>(write.back | write.allocate << 1))
+            return false;
+        for (size_t i = 0; i < N; i++) {
+            if (!levels[i].restore(in))
+                return false;
+            string name;
+            for (size_t length = in.get(1); length > 0; length--)
+                name += static_cast<char>(in.get(1));
+            if (name != (prefetchers[i] ? prefetchers[i]->name() : ""))
+                return false;
+            if (prefetchers[i])
+                prefetchers[i]->restore(in);
+        }
+        for (uint64_t latency : load_latency)
+            if (in.get(8) != latency)
+                return false;
+        load_cycles = in.get(8);
+        instructions = in.get(8);
+        clock = in.get(8);
+        return in.good() && in.at_end();
+    }
+
+private:
+    // Blocks a prefetcher asked for, reused from load to load
+    vector<int> pending;
+};
+
+/*
+    Runs the program in mem until it halts, that is, until an
+    instruction jumps to its own address. Every lw and sw goes through
+    memory, which models the caches: memory.load(pc, addr) returns the
+    loaded value, and memory.store(pc, addr) is told about a store
+    after mem has been updated. memory.step(pc) is told about every
+    instruction before it runs; all but the profiler of --sample
+    ignore it.
+
+    @param mem Memory holding the program
+    @param regs Register values, updated in place
+    @param pc Initial program counter, set to the final one on return
+    @param memory The memory system model
+    @param instructions Counts the instructions executed, the halt included
+    @param limit Stop before the instruction that would take
+        instructions past this count
+    @return true if the program halted, false if it reached the limit
+*/
+template <class Memory>
+bool execute(uint16_t mem[], uint16_t regs[], uint16_t &pc, Memory &memory, uint64_t &instructions,
+             uint64_t limit) {
+    // A local count, which stores through mem can't alias
+    uint64_t count = instructions;
+    bool halted = false;
+    while (count < limit) {
+        count++;
+        memory.step(pc);
+        uint16_t num = mem[pc];
+        uint16_t pc_next = pc + 1;
+        uint16_t opcode = num >> 13;
+        uint16_t regA = (num & 0b0001110000000000) >> 10;
+        uint16_t regB = (num & 0b0000001110000000) >> 7;
+        uint16_t imm = (num & 0b0000000001111111);
+        uint16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
+        switch (opcode) {
+        case 0: {
+            uint16_t dst = (num & 0b0000000001110000) >> 4;
+            switch (num & 0b0000000000001111) {
+            case 0: //opcode = add
+                regs[dst] = (dst == 0 ? 0 : regs[regA] + regs[regB]);
+                break;
+            case 1: //opcode = sub
+                regs[dst] = (dst == 0 ? 0 : regs[regA] - regs[regB]);
+                break;
+            case 2: //opcode = or
+                regs[dst] = (dst == 0 ? 0 : regs[regA] | regs[regB]);
+                break;
+            case 3: //opcode = and
+                regs[dst] = (dst == 0 ? 0 : regs[regA] & regs[regB]);
+                break;
+            case 4: //opcode = slt
+                regs[dst] = dst == 0 ? 0 : (regs[regA] < regs[regB] ? 1 : 0);
+                break;
+            case 8: //opcode = jr
+                pc_next = isoverflow(regs[regA]);
+                break;
+            }
+            break;
+        }
+        case 7: //opcode = slti
+            regs[regB] = regB == 0 ? 0 : (regs[regA] < sign_extended ? 1 : 0);
+            break;
+        case 4: { //opcode = lw
+            int addr = isoverflow(regs[regA] + sign_extended);
+            uint16_t value = memory.load(pc, addr);
+            regs[regB] = (regB == 0) ? 0 : value;
+            break;
+        }
+        case 5: { //opcode = sw
+            int addr = isoverflow(regs[regA] + sign_extended);
+            mem[addr] = regs[regB];
+            memory.store(pc, addr);
+            break;
+        }
+        case 1: //opcode = addi
+            regs[regB] = regB == 0 ? 0 : regs[regA] + sign_extended;
+            break;
+        case 2: //opcode = j
+            pc_next = num & 0b0001111111111111;
+            break;
+        case 3: //opcode = jal
+            regs[7] = pc_next;
+            pc_next = num & 0b0001111111111111;
+            break;
+        case 6: //opcode = jeq
+            if (regs[regA] == regs[regB])
+                pc_next += sign_extended;
+            break;
+        }
+
+        if (pc_next == pc) {
+            halted = true;
+            break;
+        }
+        pc = isoverflow(pc_next);
+    }
+    instructions = count;
+    return halted;
+}
+
+/*
+    Runs the program in mem until it halts.
+
+    @return The number of instructions executed, the halt included
+*/
+template <class Memory>
+uint64_t execute(uint16_t mem[], uint16_t regs[], uint16_t &pc, Memory &memory) {
+    uint64_t instructions = 0;
+    execute(mem, regs, pc, memory, instructions, numeric_limits<uint64_t>::max());
+    return instructions;
+}
+
+/*
+    Memory model without a cache: loads read mem directly.
+*/
+struct FlatMemory {
+    const uint16_t *mem;
+
+    uint16_t load(int, int addr) {
+        return mem[addr];
+    }
+
+    void store(int, int) {}
+    void step(int) {}
+};
+
+/*
+    Memory model that writes every access to a trace before passing
+    it on to another memory model.
+*/
+template <class Memory>
+class TracedMemory {
+public:
+    TracedMemory(Memory &memory, TraceWriter &trace) : memory(memory), trace(trace) {}
+
+    uint16_t load(int pc, int addr) {
+        trace.load(pc, addr);
+        return memory.load(pc, addr);
+    }
+
+    void store(int pc, int addr) {
+        trace.store(pc, addr);
+        memory.store(pc, addr);
+    }
+
+    void step(int pc) {
+        memory.step(pc);
+    }
+
+private:
+    Memory &memory;
+    TraceWriter &trace;
+};
+
+/*
+    Calls run(Policy(), integral_constant<size_t, N>()) for N levels.
+*/
+template <class Policy, class Run>
+void with_levels(size_t levels, Run &run) {
+    switch (levels) {
+    case 1: run(Policy(), integral_constant<size_t, 1>()); break;
+    case 2: run(Policy(), integral_constant<size_t, 2>()); break;
+    case 3: run(Policy(), integral_constant<size_t, 3>()); break;
+    default: run(Policy(), integral_constant<size_t, 4>()); break;
+    }
+}
+
+/*
+    Calls run with an instance of the replacement policy named policy
+    and the number of levels as an integral_constant, so that run is
+    compiled for every combination and the loops stay specialized.
+    An unknown name means LRU.
+*/
+template <class Run>
+void with_cache(const string &policy, size_t levels, Run run) {
+    if (policy == TreePLRUPolicy::NAME)
+        with_levels<TreePLRUPolicy>(levels, run);
+    else if (policy == RRIPPolicy<false>::NAME)
+        with_levels<RRIPPolicy<false>>(levels, run);
+    else if (policy == RRIPPolicy<true>::NAME)
+        with_levels<RRIPPolicy<true>>(levels, run);
+    else if (policy == FIFOPolicy::NAME)
+        with_levels<FIFOPolicy>(levels, run);
+    else if (policy == RandomPolicy::NAME)
+        with_levels<RandomPolicy>(levels, run);
+    else
+        with_levels<LRUPolicy>(levels, run);
+}
+
+/*
+    @return Whether --policy accepts name, and it can manage every
+        level of the cache configuration parts
+*/
+bool policy_fits(const string &name, const vector<int> &parts) {
+    const char *const names[] = {LRUPolicy::NAME, TreePLRUPolicy::NAME, RRIPPolicy<false>::NAME,
+                                 RRIPPolicy<true>::NAME, FIFOPolicy::NAME, RandomPolicy::NAME};
+    if (find(begin(names), end(names), name) == end(names))
+        return false;
+    // The tree of PLRU needs a power-of-two number of ways
+    for (size_t i = 1; name == TreePLRUPolicy::NAME && i < parts.size(); i += 3)
+        if (parts[i] <= 0 || (parts[i] & (parts[i] - 1)) != 0)
+            return false;
+    return true;
+}
+
+/*
+    Simulates the program in mem with an N-level cache hierarchy,
+    from the machine in state until it halts.
+
+    @param parts size,associativity,blocksize for each level
+    @param state Where to start; if it holds cache state, the caches
+        start from that. Left at the halt
+    @param log Where accesses are logged, or nullptr
+    @param trace If not null, every access is also written to it
+    @param latency Latencies to time the loads with, if enabled
+    @param write How stores are handled
+    @param prefetch Prefetcher of each level, see set_prefetchers
+    @param timing Set to the time spent
+    @param checkpoint_every Save state, caches included, to
+        checkpoint_file every this many instructions, or never if 0
+    @return The counts of every level, L1 first
+*/
+template <class Policy, size_t N>
+vector<LevelStats> simulate(const vector<int> &parts, uint16_t mem[], Checkpoint &state, LogWriter *log,
+                            TraceWriter *trace, const CacheLatency &latency, const WritePolicy &write,
+                            const vector<string> &prefetch, CacheTiming &timing, uint64_t checkpoint_every,
+                            const string &checkpoint_file) {
+    CacheHierarchy<Policy, N> caches(parts, mem);
+    caches.log = log;
+    caches.write = write;
+    caches.set_prefetchers(prefetch);
+    if (latency.enabled())
+        caches.set_latency(latency);
+    if (state.levels != 0 && !caches.restore(state)) {
+        cerr << "Checkpoint was taken with other caches, latencies or policies" << endl;
+        exit(1);
+    }
+    uint64_t every = checkpoint_every != 0 ? checkpoint_every : numeric_limits<uint64_t>::max();
+    uint64_t limit = state.instructions + (every - state.instructions % every);
+    while (!state.halted) {
+        uint64_t start = state.instructions;
+        if (trace != nullptr) {
+            TracedMemory<CacheHierarchy<Policy, N>> traced(caches, *trace);
+            state.halted = execute(mem, state.regs, state.pc, traced, state.instructions, limit);
+        } else
+            state.halted = execute(mem, state.regs, state.pc, caches, state.instructions, limit);
+        caches.instructions += state.instructions - start;
+        if (!state.halted) {
+            caches.save(state);
+            if (!save_checkpoint(checkpoint_file, state, mem)) {
+                cerr << "Can't write checkpoint " << checkpoint_file << endl;
+                exit(1);
+            }
+            limit += every;
+        }
+    }
+    timing = caches.timing();
+    return caches.stats();
+}
+
+/*
+    One memory access made by the program.
+*/
+struct MemRef {
+    uint16_t pc;
+    uint16_t addr;
+    bool store;
+    // Instructions since the previous access, this one's included
+    uint32_t steps;
+};
+
+/*
+    A cache hierarchy of any depth behind a common interface, for
+    driving many configurations from one recorded access stream.
+*/
+class CacheModel {
+public:
+    virtual ~CacheModel() {}
+
+    /*
+        Simulates count recorded accesses.
+    */
+    virtual void replay(const MemRef *refs, size_t count) = 0;
+
+    /*
+        @return The counts of every level, L1 first
+    */
+    virtual vector<LevelStats> stats() const = 0;
+
+    /*
+        @return The time spent on loads, without the instruction count
+    */
+    virtual CacheTiming timing() const = 0;
+};
+
+/*
+    CacheModel for an N-level hierarchy. Which accesses hit does not
+    depend on the data, so unless a memory image is given the caches
+    are filled from an all-zero memory. The clock of the prefetchers
+    advances by the instructions recorded with every access.
+*/
+template <class Policy, size_t N>
+class HierarchyModel : public CacheModel {
+public:
+    HierarchyModel(const vector<int> &parts, const uint16_t mem[], LogWriter *log, const CacheLatency &latency,
+                   const WritePolicy &write, const vector<string> &prefetch) :
+        zero(mem == nullptr ? MEM_SIZE : 0), caches(parts, mem == nullptr ? zero.data() : mem) {
+        caches.log = log;
+        caches.write = write;
+        caches.set_prefetchers(prefetch);
+        if (latency.enabled())
+            caches.set_latency(latency);
+    }
+
+    void replay(const MemRef *refs, size_t count) override {
+        for (size_t i = 0; i < count; i++) {
+            caches.clock += refs[i].steps;
+            if (refs[i].store)
+                caches.store(refs[i].pc, refs[i].addr);
+            else
+                caches.load(refs[i].pc, refs[i].addr);
+        }
+    }
+
+    vector<LevelStats> stats() const override {
+        return caches.stats();
+    }
+
+    CacheTiming timing() const override {
+        return caches.timing();
+    }
+
+private:
+    vector<uint16_t> zero;
+    CacheHierarchy<Policy, N> caches;
+};
+
+/*
+    Creates the CacheModel for a hierarchy with parts.size() / 3 levels.
+
+    @param mem Memory to fill the caches from, or nullptr for zeroes
+    @param log Where accesses are logged, or nullptr
+    @param latency Latencies to time the loads with, if enabled
+    @param policy Name of the replacement policy
+    @param write How stores are handled
+    @param prefetch Prefetcher of each level, see set_prefetchers
+*/
+unique_ptr<CacheModel> make_cache_model(const vector<int> &parts, const uint16_t mem[], LogWriter *log,
+                                        const CacheLatency &latency, const string &policy,
+                                        const WritePolicy &write, const vector<string> &prefetch) {
+    unique_ptr<CacheModel> model;
+    with_cache(policy, parts.size() / 3, [&](auto replacement, auto levels) {
+        typedef HierarchyModel<decltype(replacement), decltype(levels)::value> Model;
+        model.reset(new Model(parts, mem, log, latency, write, prefetch));
+    });
+    return model;
+}
+
+/*
+    Memory model for --sweep. It performs no caching itself; accesses
+    are collected in chunks of CHUNK, and every full chunk is replayed
+    against all models at once, one thread per model at a time, so the
+    whole stream never has to be kept in memory.
+*/
+class SweepRecorder {
+public:
+    static const size_t CHUNK = 1 << 20;
+    const uint16_t *mem;
+    vector<unique_ptr<CacheModel>> &models;
+    uint64_t loads = 0;
+    uint64_t stores = 0;
+
+    SweepRecorder(const uint16_t mem[], vector<unique_ptr<CacheModel>> &models) :
+        mem(mem), models(models) {
+        refs.reserve(CHUNK);
+    }
+
+    uint16_t load(int pc, int addr) {
+        record(pc, addr, false);
+        return mem[addr];
+    }
+
+    void store(int pc, int addr) {
+        record(pc, addr, true);
+    }
+
+    void step(int) {
+        steps++;
+    }
+
+    /*
+        Replays the accesses collected so far against every model.
+    */
+    void flush() {
+        atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i; (i = next++) < models.size(); )
+                models[i]->replay(refs.data(), refs.size());
+        };
+        size_t num_threads = min<size_t>(max(1u, thread::hardware_concurrency()), models.size());
+        vector<thread> threads;
+        for (size_t i = 1; i < num_threads; i++)
+            threads.emplace_back(worker);
+        worker();
+        for (thread &t : threads)
+            t.join();
+        refs.clear();
+    }
+
+private:
+    vector<MemRef> refs;
+    uint32_t steps = 0;
+
+    void record(int pc, int addr, bool store) {
+        refs.push_back({static_cast<uint16_t>(pc), static_cast<uint16_t>(addr), store, steps});
+        steps = 0;
+        (store ? stores : loads)++;
+        if (refs.size() == CHUNK)
+            flush();
+    }
+};
+
+/*
+    Splits a --cache style configuration into its numbers.
+
+    @return The numbers, or an empty vector if they aren't all positive
+        numbers or don't describe one to MAX_LEVELS caches
+*/
+vector<int> parse_cache_config(const string &cache_config) {
+    vector<int> parts;
+    size_t start = 0;
+    while (start <= cache_config.size()) {
+        size_t end = cache_config.find(',', start);
+        if (end == string::npos)
+            end = cache_config.size();
+        char *stop;
+        long value = strtol(cache_config.c_str() + start, &stop, 10);
+        if (stop != cache_config.c_str() + end || end == start || value < 1 ||
+            value > numeric_limits<int>::max())
+            return {};
+        parts.push_back(value);
+        start = end + 1;
+    }
+    if (parts.size() % 3 != 0 || parts.size() / 3 > MAX_LEVELS)
+        parts.clear();
+    return parts;
+}
+
+/*
+    Parses a --latency list: the hit latency of every level, L1 first,
+    followed by the memory latency.
+
+    @return false unless it holds at least two non-negative numbers
+*/
+bool parse_latency(const string &arg, CacheLatency &latency) {
+    vector<int> values;
+    size_t start = 0;
+    while (start <= arg.size()) {
+        size_t end = arg.find(',', start);
+        if (end == string::npos)
+            end = arg.size();
+        char *stop;
+        long value = strtol(arg.c_str() + start, &stop, 10);
+        if (stop != arg.c_str() + end || end == start || value < 0)
+            return false;
+        values.push_back(value);
+        start = end + 1;
+    }
+    if (values.size() < 2)
+        return false;
+    latency.memory = values.back();
+    values.pop_back();
+    latency.hit = values;
+    return true;
+}
+
+/*
+    Prints the latencies a configuration with the given number of
+    levels is timed with, as a line under its banner.
+*/
+void print_latency(const CacheLatency &latency, size_t levels) {
+    cout << "Latency";
+    for (size_t i = 0; i < levels; i++)
+        cout << " L" << i + 1 << " " << latency.hit[i] << ",";
+    cout << " memory " << latency.memory << endl;
+}
+
+/*
+    Prints the average memory access time of the loads and their
+    stall cycles, and the estimated run time if the number of
+    instructions is known.
+*/
+void print_timing(const CacheTiming &timing) {
+    cout << "AMAT " << fixed << setprecision(2) << timing.amat() << " cycles over " << timing.loads <<
+        " loads, " << timing.stall_cycles << " stall cycles";
+    if (timing.instructions != 0)
+        cout << ", " << timing.cycles() << " cycles for " << timing.instructions << " instructions";
+    cout << endl;
+}
+
+/*
+    Parses a --write-policy argument: through or back, optionally
+    followed by ,allocate (the default) or ,no-allocate.
+
+    @return false if it is neither
+*/
+bool parse_write_policy(const string &arg, WritePolicy &write) {
+    size_t comma = arg.find(',');
+    string mode = arg.substr(0, comma);
+    string allocate = comma == string::npos ? "allocate" : arg.substr(comma + 1);
+    if ((mode != "through" && mode != "back") || (allocate != "allocate" && allocate != "no-allocate"))
+        return false;
+    write.back = mode == "back";
+    write.allocate = allocate == "allocate";
+    return true;
+}
+
+/*
+    Prints the write policy as a line under the banner.
+*/
+void print_write_policy(const WritePolicy &write) {
+    cout << "Write policy " << (write.back ? "write-back" : "write-through") << ", " <<
+        (write.allocate ? "write-allocate" : "no-write-allocate") << endl;
+}
+
+/*
+    Prints the words every level wrote to the one below it, the last
+    one to memory, and how many dirty lines it wrote back.
+
+    @param stats The counts of every level, L1 first
+*/
+void print_traffic(const vector<LevelStats> &stats) {
+    cout << "Write traffic";
+    for (size_t i = 0; i < stats.size(); i++)
+        cout << (i ? ", " : " ") << stats[i].name << " to " <<
+            (i + 1 < stats.size() ? stats[i + 1].name : "memory") << " " << stats[i].written << " words (" <<
+            stats[i].writebacks << " writebacks)";
+    cout << endl;
+}
+
+/*
+    Splits a --prefetch list into the prefetcher of every level, L1
+    first.
+
+    @return false unless every entry is none or a prefetcher's name
+*/
+bool parse_prefetch(const string &arg, vector<string> &prefetch) {
+    size_t start = 0;
+    while (start <= arg.size()) {
+        size_t end = arg.find(',', start);
+        if (end == string::npos)
+            end = arg.size();
+        prefetch.push_back(arg.substr(start, end - start));
+        if (prefetch.back() != "none" && !make_prefetcher(prefetch.back(), 1))
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+/*
+    Prints the prefetcher of every level as a line under the banner.
+*/
+void print_prefetchers(const vector<string> &prefetch) {
+    cout << "Prefetch";
+    for (size_t i = 0; i < prefetch.size(); i++)
+        cout << (i ? ", " : " ") << "L" << i + 1 << " " << prefetch[i];
+    cout << endl;
+}
+
+/*
+    Prints how well the prefetcher of every level did: the prefetches
+    issued, their accuracy (the share a load then used), their
+    coverage (the share of the misses they saved), and unless the run
+    was untimed, their timeliness (the share of the used ones whose
+    data had arrived).
+
+    @param stats The counts of every level, L1 first
+    @param prefetch Prefetcher of each level, as given to --prefetch
+    @param timed Whether latencies were set
+*/
+void print_prefetch(const vector<LevelStats> &stats, const vector<string> &prefetch, bool timed) {
+    cout << fixed << setprecision(2);
+    for (size_t i = 0; i < stats.size() && i < prefetch.size(); i++) {
+        if (prefetch[i] == "none")
+            continue;
+        const LevelStats &level = stats[i];
+        cout << "Prefetch " << level.name << " " << prefetch[i] << ": " << level.prefetches << " issued, " <<
+            level.useful << " used, accuracy " <<
+            (level.prefetches ? 100.0 * level.useful / level.prefetches : 0.0) << "%, coverage " <<
+            (level.useful + level.misses ? 100.0 * level.useful / (level.useful + level.misses) : 0.0) << "%";
+        if (timed)
+            cout << ", timely " << (level.useful ? 100.0 * (level.useful - level.late) / level.useful : 0.0) <<
+                "% (" << level.late << " late)";
+        cout << endl;
+    }
+}
+
+/*
+    Prints the column headings for print_stats.
+*/
+void print_stats_header() {
+    cout << left << setw(28) << "config" << setw(6) << "level" << right <<
+        setw(10) << "loads" << setw(10) << "hits" << setw(10) << "misses" <<
+        setw(11) << "miss rate" << setw(10) << "stores" << endl;
+}
+
+/*
+    Prints one table row per level of a cache configuration.
+
+    @param config The configuration as given on the command line
+    @param stats The counts of every level, L1 first
+*/
+void print_stats(const string &config, const vector<LevelStats> &stats) {
+    for (size_t i = 0; i < stats.size(); i++) {
+        const LevelStats &level = stats[i];
+        uint64_t loads = level.hits + level.misses;
+        cout << left << setw(28) << (i == 0 ? config : "") << setw(6) << level.name << right <<
+            setw(10) << loads << setw(10) << level.hits << setw(10) << level.misses <<
+            setw(10) << fixed << setprecision(2) << (loads ? 100.0 * level.misses / loads : 0.0) << "%" <<
+            setw(10) << level.stores << endl;
+    }
+}
+
+/*
+    Runs the program once while simulating its memory accesses against
+    every configuration in configs, spread over all hardware threads,
+    and prints one table row per cache level. The write traffic of
+    every level can follow, and with latencies the configurations are
+    then ranked by their estimated run time.
+
+    @param configs --cache style configurations
+    @param mem Memory holding the program
+    @param pc Initial program counter
+    @param latency Latencies to time the loads with, if enabled
+    @param policy Replacement policy of every configuration
+    @param write How stores are handled in every configuration
+    @param show_traffic Also print the write traffic
+    @param prefetch Prefetcher of each level of every configuration
+*/
+void sweep(const vector<string> &configs, uint16_t mem[], uint16_t pc, const CacheLatency &latency,
+           const string &policy, const WritePolicy &write, bool show_traffic, const vector<string> &prefetch) {
+    vector<vector<int>> parts;
+    for (const string &config : configs) {
+        parts.push_back(parse_cache_config(config));
+        if (parts.back().empty()) {
+            cerr << "Invalid cache config " << config << endl;
+            exit(1);
+        }
+        if (latency.enabled() && parts.back().size() / 3 > latency.hit.size()) {
+            cerr << "No latency for every level of " << config << endl;
+            exit(1);
+        }
+        if (!policy_fits(policy, parts.back())) {
+            cerr << "Policy " << policy << " can't manage " << config << endl;
+            exit(1);
+        }
+        if (prefetch.size() > parts.back().size() / 3) {
+            cerr << "More prefetchers than levels in " << config << endl;
+            exit(1);
+        }
+    }
+
+    vector<unique_ptr<CacheModel>> models;
+    for (const vector<int> &config : parts)
+        models.push_back(make_cache_model(config, nullptr, nullptr, latency, policy, write, prefetch));
+    SweepRecorder recorder(mem, models);
+    uint16_t regs[NUM_REGS] = {0};
+    uint64_t instructions = execute(mem, regs, pc, recorder);
+    recorder.flush();
+
+    cout << "Swept " << configs.size() << " cache configurations over " << recorder.loads + recorder.stores <<
+        " memory accesses (" << recorder.loads << " loads, " << recorder.stores << " stores)" << endl;
+    print_stats_header();
+    for (size_t i = 0; i < configs.size(); i++)
+        print_stats(configs[i], models[i]->stats());
+    if (show_traffic) {
+        cout << endl << "Words written to the next level or memory:" << endl;
+        cout << left << setw(28) << "config" << setw(6) << "level" << right << setw(12) << "writebacks" <<
+            setw(12) << "words" << endl;
+        for (size_t i = 0; i < configs.size(); i++) {
+            vector<LevelStats> stats = models[i]->stats();
+            for (size_t level = 0; level < stats.size(); level++)
+                cout << left << setw(28) << (level == 0 ? configs[i] : "") << setw(6) << stats[level].name <<
+                    right << setw(12) << stats[level].writebacks << setw(12) << stats[level].written << endl;
+        }
+    }
+    if (!prefetch.empty()) {
+        cout << endl << "Prefetches:" << endl;
+        cout << left << setw(28) << "config" << setw(6) << "level" << right << setw(10) << "issued" <<
+            setw(10) << "used" << setw(10) << "accuracy" << setw(10) << "coverage";
+        if (latency.enabled())
+            cout << setw(10) << "timely";
+        cout << endl;
+        for (size_t i = 0; i < configs.size(); i++) {
+            vector<LevelStats> stats = models[i]->stats();
+            for (size_t level = 0; level < prefetch.size(); level++) {
+                const LevelStats &counts = stats[level];
+                cout << left << setw(28) << (level == 0 ? configs[i] : "") << setw(6) << counts.name << right <<
+                    setw(10) << counts.prefetches << setw(10) << counts.useful << fixed << setprecision(2) <<
+                    setw(9) << (counts.prefetches ? 100.0 * counts.useful / counts.prefetches : 0.0) << "%" <<
+                    setw(9) << (counts.useful + counts.misses ?
+                                100.0 * counts.useful / (counts.useful + counts.misses) : 0.0) << "%";
+                if (latency.enabled())
+                    cout << setw(9) << (counts.useful ? 100.0 * (counts.useful - counts.late) / counts.useful : 0.0) <<
+                        "%";
+                cout << endl;
+            }
+        }
+    }
+    if (!latency.enabled())
+        return;
+
+    vector<CacheTiming> timings;
+    vector<size_t> order;
+    for (size_t i = 0; i < configs.size(); i++) {
+        timings.push_back(models[i]->timing());
+        timings.back().instructions = instructions;
+        order.push_back(i);
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return timings[a].cycles() < timings[b].cycles();
+    });
+    cout << endl << "Ranked by estimated cycles for " << instructions << " instructions:" << endl;
+    cout << left << setw(6) << "rank" << setw(28) << "config" << right << setw(10) << "AMAT" <<
+        setw(14) << "stall cycles" << setw(14) << "cycles" << endl;
+    for (size_t rank = 0; rank < order.size(); rank++) {
+        const CacheTiming &timing = timings[order[rank]];
+        cout << left << setw(6) << rank + 1 << setw(28) << configs[order[rank]] << right <<
+            setw(10) << fixed << setprecision(2) << timing.amat() << setw(14) << timing.stall_cycles <<
+            setw(14) << timing.cycles() << endl;
+    }
+}
+
+/*
+    Splits the argument of --sweep into configurations. An argument of
+    the form @FILE names a file to read them from instead.
+
+    @return false if the file can't be read or holds no configuration
+*/
+bool read_sweep_configs(const string &arg, vector<string> &configs) {
+    string text = arg;
+    if (arg.rfind("@",0)==0) {
+        ifstream f(arg.substr(1));
+        if (!f.is_open())
+            return false;
+        text.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+    }
+    string config;
+    for (char c : text + ";") {
+        if (c == ';' || isspace(static_cast<unsigned char>(c))) {
+            if (!config.empty())
+                configs.push_back(config);
+            config.clear();
+        } else
+            config.push_back(c);
+    }
+    return !configs.empty();
+}
+
+/*
+    LRU stack distances of the accesses to one set. The most recent
+    access of every block is marked in a Fenwick tree indexed by access
+    time, so the number of distinct blocks used since a block's last
+    access is a range sum rather than a walk down an LRU list. When the
+    times run out, the live marks are renumbered from zero.
+*/
+class StackDistance {
 public:
-    list<int> m_list;
-    map<int, vector<uint16_t>> block; 
-};
+    // Distance of a block's first access
+    static constexpr size_t COLD = SIZE_MAX;
 
-size_t const static NUM_REGS = 8; 
-size_t const static MEM_SIZE = 1<<13;
-size_t const static REG_SIZE = 1<<16;
-uint16_t isoverflow(uint16_t input){
-    while(!(input < MEM_SIZE)){
-        input -= MEM_SIZE;
+    /*
+        @param num_blocks Number of distinct blocks that map to this set
+    */
+    void init(size_t num_blocks) {
+        last.assign(num_blocks, NONE);
+        owner.assign(2 * num_blocks, 0);
+        tree.assign(2 * num_blocks + 1, 0);
+        now = 0;
     }
-    return input;
-}
 
-void load_machine_code(ifstream &f, uint16_t mem[]) {
-    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
-    size_t expectedaddr = 0;
-    string line;
-    while (getline(f, line)) {
-        smatch sm;
-        if (!regex_match(line, sm, machine_code_re)) {
-            cerr << "Can't parse line: " << line << endl;
-            exit(1);
+    /*
+        Records an access to a block.
+
+        @param block The block's index within this set
+        @return The number of other blocks of this set used since the
+            block's previous access, or COLD
+    */
+    size_t access(size_t block) {
+        if (now == owner.size())
+            compact();
+        size_t distance = COLD;
+        if (last[block] != NONE) {
+            distance = prefix(now) - prefix(last[block] + 1);
+            add(last[block], -1);
         }
-        size_t addr = stoi(sm[1], nullptr, 10);
-        unsigned instr = stoi(sm[2], nullptr, 2);
-        if (addr != expectedaddr) {
-            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
-            exit(1);
+        last[block] = now;
+        owner[now] = block;
+        add(now++, 1);
+        return distance;
+    }
+
+private:
+    static constexpr size_t NONE = SIZE_MAX;
+    vector<size_t> last;
+    vector<size_t> owner;
+    vector<int> tree;
+    size_t now;
+
+    void add(size_t time, int delta) {
+        for (size_t i = time + 1; i < tree.size(); i += i & -i)
+            tree[i] += delta;
+    }
+
+    /*
+        @return The number of marks at times below time
+    */
+    int prefix(size_t time) const {
+        int sum = 0;
+        for (size_t i = time; i > 0; i -= i & -i)
+            sum += tree[i];
+        return sum;
+    }
+
+    void compact() {
+        size_t live = 0;
+        fill(tree.begin(), tree.end(), 0);
+        for (size_t time = 0; time < now; time++) {
+            size_t block = owner[time];
+            if (last[block] == time) {
+                last[block] = live;
+                owner[live] = block;
+                add(live++, 1);
+            }
         }
-        if (addr >= MEM_SIZE) {
-            cerr << "Program too big for memory" << endl;
-            exit(1);
+        now = live;
+    }
+};
+
+/*
+    Memory model for --miss-curve. It performs no caching itself, but
+    keeps the LRU stack distance of every access for each power-of-two
+    number of rows, so one run gives the L1 misses of every cache size
+    with the given associativity and blocksize. As in CacheHierarchy,
+    stores allocate and update the LRU order, and only loads count as
+    hits or misses.
+*/
+class MissCurve {
+public:
+    const uint16_t *mem;
+    int assoc;
+    int blocksize;
+    uint64_t loads = 0;
+    uint64_t stores = 0;
+
+    MissCurve(const uint16_t mem[], int assoc, int blocksize) :
+        mem(mem), assoc(assoc), blocksize(blocksize) {
+        size_t num_blocks = (MEM_SIZE + blocksize - 1) / blocksize;
+        for (size_t num_rows = 1; num_rows * assoc * blocksize <= MEM_SIZE; num_rows *= 2) {
+            curves.emplace_back();
+            Curve &curve = curves.back();
+            curve.num_rows = num_rows;
+            curve.sets.resize(num_rows);
+            for (StackDistance &set : curve.sets)
+                set.init((num_blocks + num_rows - 1) / num_rows);
         }
-        expectedaddr ++;
-        mem[addr] = instr;
     }
+
+    uint16_t load(int, int addr) {
+        loads++;
+        access(addr, true);
+        return mem[addr];
+    }
+
+    void store(int, int addr) {
+        stores++;
+        access(addr, false);
+    }
+
+    void step(int) {}
+
+    /*
+        Prints the misses of every cache size, smallest first.
+    */
+    void print() const {
+        cout << "Miss-ratio curve for associativity " << assoc << ", blocksize " << blocksize <<
+            " over " << loads + stores << " memory accesses (" << loads << " loads, " <<
+            stores << " stores)" << endl;
+        cout << right << setw(8) << "size" << setw(8) << "rows" << setw(10) << "hits" <<
+            setw(10) << "misses" << setw(11) << "miss rate" << endl;
+        for (const Curve &curve : curves)
+            cout << setw(8) << curve.num_rows * assoc * blocksize << setw(8) << curve.num_rows <<
+                setw(10) << loads - curve.misses << setw(10) << curve.misses <<
+                setw(10) << fixed << setprecision(2) << (loads ? 100.0 * curve.misses / loads : 0.0) <<
+                "%" << endl;
+    }
+
+private:
+    struct Curve {
+        size_t num_rows;
+        vector<StackDistance> sets;
+        uint64_t misses = 0;
+    };
+    vector<Curve> curves;
+
+    void access(int addr, bool is_load) {
+        size_t blockid = addr / blocksize;
+        for (Curve &curve : curves) {
+            size_t distance = curve.sets[blockid % curve.num_rows].access(blockid / curve.num_rows);
+            if (is_load && (distance == StackDistance::COLD || distance >= static_cast<size_t>(assoc)))
+                curve.misses++;
+        }
+    }
+};
+
+/*
+    Parses the ASSOC,BLOCKSIZE argument of --miss-curve.
+
+    @return Whether both are valid: positive, a power-of-two blocksize,
+        and at least one cache size that fits in memory
+*/
+bool parse_miss_curve_config(const string &arg, int &assoc, int &blocksize) {
+    vector<int> parts;
+    stringstream ss(arg);
+    string part;
+    while (getline(ss, part, ',')) {
+        char *end;
+        long value = strtol(part.c_str(), &end, 10);
+        if (part.empty() || *end != '\0' || value <= 0 || value > static_cast<long>(MEM_SIZE))
+            return false;
+        parts.push_back(value);
+    }
+    if (parts.size() != 2)
+        return false;
+    assoc = parts[0];
+    blocksize = parts[1];
+    return (blocksize & (blocksize - 1)) == 0 && static_cast<size_t>(assoc) * blocksize <= MEM_SIZE;
 }
 
 /*
-    Prints out the correctly-formatted configuration of a cache.
+    Settings of --sample: the length of an interval in instructions,
+    the number of phases the intervals are grouped into, and how many
+    instructions before every sampled interval warm the caches up.
+*/
+struct SampleConfig {
+    uint64_t interval = 0;
+    size_t clusters = 8;
+    uint64_t warmup = 0;
+};
 
-    @param cache_name The name of the cache. "L1" or "L2"
+/*
+    Parses the INTERVAL[,CLUSTERS[,WARMUP]] argument of --sample. The
+    warmup defaults to one interval.
 
-    @param size The total size of the cache, measured in memory cells.
-        Excludes metadata
+    @return Whether every part is a positive number, the warmup aside
+*/
+bool parse_sample_config(const string &arg, SampleConfig &config) {
+    vector<uint64_t> parts;
+    stringstream ss(arg);
+    string part;
+    while (getline(ss, part, ',')) {
+        char *end;
+        unsigned long long value = strtoull(part.c_str(), &end, 10);
+        if (part.empty() || *end != '\0' || part[0] == '-')
+            return false;
+        parts.push_back(value);
+    }
+    if (parts.empty() || parts.size() > 3 || parts[0] == 0 || (parts.size() > 1 && parts[1] == 0))
+        return false;
+    config.interval = parts[0];
+    if (parts.size() > 1)
+        config.clusters = parts[1];
+    config.warmup = parts.size() > 2 ? parts[2] : parts[0];
+    return true;
+}
 
-    @param assoc The associativity of the cache. One of [1,2,4,8,16]
+// Dimensions the basic-block vectors are projected down to, as in SimPoint
+size_t const static BBV_DIMS = 15;
+// Intervals of every cluster simulated in detail, at most
+size_t const static SAMPLES_PER_CLUSTER = 3;
+typedef array<double, BBV_DIMS> Bbv;
 
-    @param blocksize The blocksize of the cache. One of [1,2,4,8,16,32,64])
+/*
+    Memory model for the profiling run of --sample. It counts how
+    often every pc runs in the current interval, which is the
+    basic-block vector of the interval with every block weighted by
+    its length. It performs no caching; loads read mem directly.
+*/
+class IntervalProfiler {
+public:
+    const uint16_t *mem;
+    // The projected vector and the length of every interval so far
+    vector<Bbv> vectors;
+    vector<uint64_t> lengths;
 
-    @param num_rows The number of rows in the given cache.
+    explicit IntervalProfiler(const uint16_t mem[]) : mem(mem), counts(MEM_SIZE, 0) {}
+
+    uint16_t load(int, int addr) {
+        return mem[addr];
+    }
+
+    void store(int, int) {}
+
+    void step(int pc) {
+        if (counts[pc]++ == 0)
+            touched.push_back(pc);
+    }
+
+    /*
+        Ends the current interval. Its vector is normalized to the
+        share of the interval spent at every pc and then randomly
+        projected, so that all vectors are short and comparable.
+    */
+    void end_interval() {
+        uint64_t length = 0;
+        for (uint16_t pc : touched)
+            length += counts[pc];
+        Bbv projected = {};
+        for (uint16_t pc : touched) {
+            double share = static_cast<double>(counts[pc]) / length;
+            for (size_t dim = 0; dim < BBV_DIMS; dim++)
+                projected[dim] += share * projection(pc, dim);
+            counts[pc] = 0;
+        }
+        touched.clear();
+        vectors.push_back(projected);
+        lengths.push_back(length);
+    }
+
+private:
+    vector<uint64_t> counts;
+    vector<uint16_t> touched;
+
+    /*
+        @return A fixed pseudo-random weight in [-1, 1) for a pc and a
+            dimension, from the splitmix64 hash
+    */
+    static double projection(uint16_t pc, size_t dim) {
+        uint64_t z = (static_cast<uint64_t>(pc) * BBV_DIMS + dim + 1) * 0x9E3779B97F4A7C15ull;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        z ^= z >> 31;
+        return (z >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+    }
+};
+
+/*
+    The machine where the warmup of an interval starts, recorded by the
+    profiling run of --sample. Memory is kept as the words that changed
+    since the previous snapshot.
 */
-void print_cache_config(const string &cache_name, int size, int assoc, int blocksize, int num_rows) {
-    cout << "Cache " << cache_name << " has size " << size <<
-        ", associativity " << assoc << ", blocksize " << blocksize <<
-        ", rows " << num_rows << endl;
+struct SampleSnapshot {
+    uint64_t instructions;
+    uint16_t pc;
+    uint16_t regs[NUM_REGS];
+    vector<pair<uint16_t, uint16_t>> changes;
+};
+
+/*
+    Groups vectors into at most k clusters with k-means. The centers
+    are seeded by farthest-first traversal from the first vector, so
+    the result is the same on every run.
+
+    @return The cluster of every vector, numbered from 0
+*/
+vector<size_t> cluster_vectors(const vector<Bbv> &vectors, size_t k) {
+    auto distance = [](const Bbv &a, const Bbv &b) {
+        double sum = 0;
+        for (size_t dim = 0; dim < BBV_DIMS; dim++)
+            sum += (a[dim] - b[dim]) * (a[dim] - b[dim]);
+        return sum;
+    };
+    vector<Bbv> centers;
+    vector<double> nearest(vectors.size(), numeric_limits<double>::max());
+    size_t next = 0;
+    while (centers.size() < k) {
+        centers.push_back(vectors[next]);
+        double farthest = 0;
+        for (size_t i = 0; i < vectors.size(); i++) {
+            nearest[i] = min(nearest[i], distance(vectors[i], centers.back()));
+            if (nearest[i] > farthest) {
+                farthest = nearest[i];
+                next = i;
+            }
+        }
+        // Every vector already coincides with a center
+        if (farthest == 0)
+            break;
+    }
+
+    vector<size_t> assignment(vectors.size(), 0);
+    for (int round = 0; round < 100; round++) {
+        bool changed = false;
+        for (size_t i = 0; i < vectors.size(); i++) {
+            size_t best = 0;
+            for (size_t c = 1; c < centers.size(); c++)
+                if (distance(vectors[i], centers[c]) < distance(vectors[i], centers[best]))
+                    best = c;
+            changed = changed || best != assignment[i];
+            assignment[i] = best;
+        }
+        if (round > 0 && !changed)
+            break;
+        vector<Bbv> sums(centers.size(), Bbv());
+        vector<size_t> sizes(centers.size(), 0);
+        for (size_t i = 0; i < vectors.size(); i++) {
+            for (size_t dim = 0; dim < BBV_DIMS; dim++)
+                sums[assignment[i]][dim] += vectors[i][dim];
+            sizes[assignment[i]]++;
+        }
+        for (size_t c = 0; c < centers.size(); c++)
+            if (sizes[c] != 0)
+                for (size_t dim = 0; dim < BBV_DIMS; dim++)
+                    centers[c][dim] = sums[c][dim] / sizes[c];
+    }
+    return assignment;
 }
 
 /*
-    Prints out a correctly-formatted log entry.
+    Estimates the cache counts of the whole program from a sample of
+    its intervals, in the manner of SimPoint and SMARTS. A profiling
+    run without caches cuts the program into intervals and takes the
+    basic-block vector of each, and the vectors are clustered into
+    phases; the run also keeps a snapshot where the warmup of every
+    interval would start. Then only up to SAMPLES_PER_CLUSTER intervals
+    spread evenly over every phase are simulated in detail, each from
+    its snapshot and after a warmup that fills the caches but isn't
+    counted. A shorter last interval is always simulated. The counts
+    of every phase are extrapolated from its samples, and each miss
+    rate is given with a 95% confidence interval for that stratified
+    sample.
 
-    @param cache_name The name of the cache where the event
-        occurred. "L1" or "L2"
+    @param parts size,associativity,blocksize for each level
+    @param cache_config The --cache argument, for the table
+    @param mem Memory holding the program
+    @param pc Initial program counter
+    @param sampling Interval length, clusters and warmup
+    @param write How stores are handled
+    @param show_traffic Also print the estimated write traffic
+    @param prefetch Prefetcher of each level, see set_prefetchers
+*/
+template <class Policy, size_t N>
+void sample(const vector<int> &parts, const string &cache_config, uint16_t mem[], uint16_t pc,
+            const SampleConfig &sampling, const WritePolicy &write, bool show_traffic,
+            const vector<string> &prefetch) {
+    const vector<uint16_t> image(mem, mem + MEM_SIZE);
+    uint16_t regs[NUM_REGS] = {0};
+    uint16_t run_pc = pc;
+    uint64_t instructions = 0;
+    IntervalProfiler profiler(mem);
+    // The snapshot of interval i is taken where its warmup starts
+    auto warm_point = [&](size_t i) {
+        uint64_t start = i * sampling.interval;
+        return start > sampling.warmup ? start - sampling.warmup : 0;
+    };
+    vector<SampleSnapshot> snapshots;
+    vector<uint16_t> shadow(image);
+    uint64_t boundary = sampling.interval;
+    for (bool halted = false; !halted; ) {
+        if (warm_point(snapshots.size()) == instructions) {
+            snapshots.emplace_back();
+            SampleSnapshot &snapshot = snapshots.back();
+            snapshot.instructions = instructions;
+            snapshot.pc = run_pc;
+            copy(regs, regs + NUM_REGS, snapshot.regs);
+            for (size_t addr = 0; addr < MEM_SIZE; addr++)
+                if (mem[addr] != shadow[addr]) {
+                    snapshot.changes.push_back({static_cast<uint16_t>(addr), mem[addr]});
+                    shadow[addr] = mem[addr];
+                }
+            continue;
+        }
+        halted = execute(mem, regs, run_pc, profiler, instructions,
+                         min(warm_point(snapshots.size()), boundary));
+        if (halted || instructions == boundary) {
+            profiler.end_interval();
+            boundary += sampling.interval;
+        }
+    }
+    const vector<uint64_t> &lengths = profiler.lengths;
+    uint64_t total = instructions;
+    size_t intervals = lengths.size();
+    size_t full = lengths.back() < sampling.interval ? intervals - 1 : intervals;
 
-    @param status The kind of cache event. "SW", "HIT", or
-        "MISS"
+    // Pick the samples of every phase, evenly spaced through it
+    vector<Bbv> vectors(profiler.vectors.begin(), profiler.vectors.begin() + full);
+    vector<size_t> cluster = cluster_vectors(vectors, min(sampling.clusters, full));
+    vector<vector<size_t>> members;
+    for (size_t i = 0; i < full; i++) {
+        if (cluster[i] >= members.size())
+            members.resize(cluster[i] + 1);
+        members[cluster[i]].push_back(i);
+    }
+    vector<vector<size_t>> samples(members.size());
+    vector<bool> chosen(intervals, false);
+    for (size_t c = 0; c < members.size(); c++) {
+        size_t count = min(members[c].size(), SAMPLES_PER_CLUSTER);
+        for (size_t j = 0; j < count; j++) {
+            size_t i = members[c][(2 * j + 1) * members[c].size() / (2 * count)];
+            samples[c].push_back(i);
+            chosen[i] = true;
+        }
+    }
+    if (full < intervals)
+        chosen[intervals - 1] = true;
 
-    @param pc The program counter of the memory
-        access instruction
+    // Simulate the chosen intervals and their warmups, resuming from
+    // the snapshots unless the previous interval ran into the warmup.
+    // Every resume starts with fresh caches.
+    vector<uint16_t> base(image);
+    size_t applied = 0;
+    unique_ptr<CacheHierarchy<Policy, N>> caches;
+    vector<vector<LevelStats>> counts(intervals);
+    uint64_t detailed = 0;
+    size_t simulated = 0;
+    for (size_t i = 0; i < intervals; i++) {
+        if (!chosen[i])
+            continue;
+        uint64_t start = i * sampling.interval;
+        if (!caches || instructions < snapshots[i].instructions) {
+            for (; applied <= i; applied++)
+                for (const auto &change : snapshots[applied].changes)
+                    base[change.first] = change.second;
+            copy(base.begin(), base.end(), mem);
+            copy(snapshots[i].regs, snapshots[i].regs + NUM_REGS, regs);
+            run_pc = snapshots[i].pc;
+            instructions = snapshots[i].instructions;
+            caches.reset(new CacheHierarchy<Policy, N>(parts, mem));
+            caches->write = write;
+            caches->set_prefetchers(prefetch);
+        }
+        uint64_t from = instructions;
+        execute(mem, regs, run_pc, *caches, instructions, start);
+        vector<LevelStats> before = caches->stats();
+        execute(mem, regs, run_pc, *caches, instructions, start + lengths[i]);
+        detailed += instructions - from;
+        simulated++;
+        counts[i] = caches->stats();
+        for (size_t level = 0; level < N; level++) {
+            counts[i][level].hits -= before[level].hits;
+            counts[i][level].misses -= before[level].misses;
+            counts[i][level].stores -= before[level].stores;
+            counts[i][level].writebacks -= before[level].writebacks;
+            counts[i][level].written -= before[level].written;
+            counts[i][level].prefetches -= before[level].prefetches;
+            counts[i][level].useful -= before[level].useful;
+        }
+    }
 
-    @param addr The memory address being accessed.
+    // Extrapolate every level: each phase counts as its size times the
+    // mean of its samples, and the miss rate is a ratio of such totals
+    vector<LevelStats> estimate;
+    vector<double> margins;
+    for (size_t level = 0; level < N; level++) {
+        double loads = 0, misses = 0, stores = 0, writebacks = 0, written = 0, prefetches = 0, useful = 0;
+        for (size_t c = 0; c < samples.size(); c++) {
+            double scale = static_cast<double>(members[c].size()) / samples[c].size();
+            for (size_t i : samples[c]) {
+                loads += scale * (counts[i][level].hits + counts[i][level].misses);
+                misses += scale * counts[i][level].misses;
+                stores += scale * counts[i][level].stores;
+                writebacks += scale * counts[i][level].writebacks;
+                written += scale * counts[i][level].written;
+                prefetches += scale * counts[i][level].prefetches;
+                useful += scale * counts[i][level].useful;
+            }
+        }
+        if (full < intervals) {
+            const LevelStats &tail = counts[intervals - 1][level];
+            loads += tail.hits + tail.misses;
+            misses += tail.misses;
+            stores += tail.stores;
+            writebacks += tail.writebacks;
+            written += tail.written;
+            prefetches += tail.prefetches;
+            useful += tail.useful;
+        }
+        double rate = loads > 0 ? misses / loads : 0;
+        double variance = 0;
+        for (size_t c = 0; c < samples.size(); c++) {
+            size_t n = samples[c].size();
+            size_t size = members[c].size();
+            if (n == size)
+                continue;
+            vector<double> residuals;
+            double mean = 0;
+            for (size_t i : samples[c]) {
+                const LevelStats &counted = counts[i][level];
+                residuals.push_back(counted.misses - rate * (counted.hits + counted.misses));
+                mean += residuals.back() / n;
+            }
+            double spread = 0;
+            for (double residual : residuals)
+                spread += (residual - mean) * (residual - mean) / (n - 1);
+            variance += static_cast<double>(size) * size * (1 - static_cast<double>(n) / size) * spread / n;
+        }
+        uint64_t rounded_loads = llround(loads);
+        uint64_t rounded_misses = min<uint64_t>(llround(misses), rounded_loads);
+        estimate.push_back({caches->levels[level].name, rounded_loads - rounded_misses, rounded_misses,
+                            static_cast<uint64_t>(llround(stores)), static_cast<uint64_t>(llround(writebacks)),
+                            static_cast<uint64_t>(llround(written)), static_cast<uint64_t>(llround(prefetches)),
+                            static_cast<uint64_t>(llround(useful)), 0});
+        margins.push_back(loads > 0 ? 1.96 * sqrt(variance) / loads : 0);
+    }
 
-    @param row The cache row or set number where the data
-        is stored.
+    cout << "Sampled " << simulated << " of " << intervals << " intervals of " << sampling.interval <<
+        " instructions from " << samples.size() << " clusters; simulated " << detailed << " of " << total <<
+        " instructions (" << fixed << setprecision(2) << 100.0 * detailed / total << "%) in detail" << endl;
+    print_stats_header();
+    print_stats(cache_config, estimate);
+    cout << "Miss rate at 95% confidence:";
+    for (size_t level = 0; level < N; level++)
+        cout << (level ? ", " : " ") << estimate[level].name << " " << fixed << setprecision(2) <<
+            (estimate[level].hits + estimate[level].misses ?
+             100.0 * estimate[level].misses / (estimate[level].hits + estimate[level].misses) : 0.0) <<
+            "% +- " << 100 * margins[level] << "%";
+    cout << endl;
+    if (show_traffic)
+        print_traffic(estimate);
+    if (!prefetch.empty())
+        print_prefetch(estimate, prefetch, false);
+}
+
+#ifndef E20_NO_MAIN
+/*
+    Drives a cache hierarchy from a trace written by --record-trace,
+    logging every access exactly as the run that recorded it did. The
+    logs never show data, so the caches are filled from zeroes. A trace
+    holds no instructions, so every access counts as one.
+
+    @param filename The trace file
+    @param parts size,associativity,blocksize for each level
+    @param log Where accesses are logged, or nullptr
+    @param latency Latencies to time the loads with, if enabled
+    @param policy Name of the replacement policy
+    @param write How stores are handled
+    @param prefetch Prefetcher of each level, see set_prefetchers
+    @param stats Set to the counts of every level, L1 first
+    @param timing Set to the time spent on loads; a trace has no
+        instruction count
+    @return false if the trace can't be used, after printing why
 */
-void print_log_entry(const string &cache_name, const string &status, int pc, int addr, int row) {
-    cout << left << setw(8) << cache_name + " " + status <<  right <<
-        " pc:" << setw(5) << pc <<
-        "\taddr:" << setw(5) << addr <<
-        "\trow:" << setw(4) << row << endl;
+bool replay_trace(const char *filename, const vector<int> &parts, LogWriter *log, const CacheLatency &latency,
+                  const string &policy, const WritePolicy &write, const vector<string> &prefetch,
+                  vector<LevelStats> &stats, CacheTiming &timing) {
+    MappedFile file;
+    if (!file.open(filename)) {
+        cerr << "Can't open trace file " << filename << endl;
+        return false;
+    }
+    if (file.size < TRACE_HEADER_SIZE || memcmp(file.data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        cerr << "Not an E20 trace file " << filename << endl;
+        return false;
+    }
+    if (read_le16(file.data + 4) != TRACE_VERSION) {
+        cerr << "Unsupported trace version " << read_le16(file.data + 4) << endl;
+        return false;
+    }
+    if ((file.size - TRACE_HEADER_SIZE) % 4 != 0) {
+        cerr << "Truncated trace file " << filename << endl;
+        return false;
+    }
+
+    unique_ptr<CacheModel> model = make_cache_model(parts, nullptr, log, latency, policy, write, prefetch);
+    vector<MemRef> refs;
+    refs.reserve(SweepRecorder::CHUNK);
+    for (const char *p = file.data + TRACE_HEADER_SIZE; p < file.data + file.size; p += 4) {
+        uint32_t record = read_le16(p) | static_cast<uint32_t>(read_le16(p + 2)) << 16;
+        refs.push_back({static_cast<uint16_t>(record & (MEM_SIZE - 1)),
+            static_cast<uint16_t>((record >> 13) & (MEM_SIZE - 1)), (record & TRACE_STORE) != 0, 1});
+        if (refs.size() == SweepRecorder::CHUNK) {
+            model->replay(refs.data(), refs.size());
+            refs.clear();
+        }
+    }
+    model->replay(refs.data(), refs.size());
+    stats = model->stats();
+    timing = model->timing();
+    return true;
 }
 
 /**
@@ -115,6 +3289,21 @@ int main(int argc, char *argv[]) {
     bool do_help = false;
     bool arg_error = false;
     string cache_config;
+    vector<string> sweep_configs;
+    int curve_assoc = 0;
+    int curve_blocksize = 0;
+    const char *record_file = nullptr;
+    const char *replay_file = nullptr;
+    string log_mode = "full";
+    CacheLatency latency;
+    uint64_t checkpoint_every = 0;
+    uint64_t fast_forward = 0;
+    const char *restore_file = nullptr;
+    SampleConfig sampling;
+    string policy = LRUPolicy::NAME;
+    WritePolicy write;
+    bool show_traffic = false;
+    vector<string> prefetch;
     for (int i=1; i<argc; i++) {
         string arg(argv[i]);
         if (arg.rfind("-",0)==0) {
@@ -127,6 +3316,77 @@ int main(int argc, char *argv[]) {
                 else
                     cache_config = argv[i];
             }
+            else if (arg=="--sweep") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else if (!read_sweep_configs(argv[i], sweep_configs))
+                    arg_error = true;
+            }
+            else if (arg=="--miss-curve") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else if (!parse_miss_curve_config(argv[i], curve_assoc, curve_blocksize))
+                    arg_error = true;
+            }
+            else if (arg.rfind("--log=",0)==0) {
+                log_mode = arg.substr(6);
+                if (log_mode != "none" && log_mode != "summary" && log_mode != "full" && log_mode != "binary")
+                    arg_error = true;
+            }
+            else if (arg.rfind("--latency=",0)==0) {
+                if (!parse_latency(arg.substr(10), latency))
+                    arg_error = true;
+            }
+            else if (arg=="--record-trace" || arg=="--replay-trace") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    (arg=="--record-trace" ? record_file : replay_file) = argv[i];
+            }
+            else if (arg=="--checkpoint-every" || arg=="--fast-forward") {
+                i++;
+                char *end;
+                // strtoull would take a sign or leading blanks
+                if (i>=argc || argv[i][0] < '0' || argv[i][0] > '9')
+                    arg_error = true;
+                else if (((arg=="--checkpoint-every" ? checkpoint_every : fast_forward) =
+                          strtoull(argv[i], &end, 10)) == 0 || *end != '\0')
+                    arg_error = true;
+            }
+            else if (arg.rfind("--policy=",0)==0)
+                policy = arg.substr(9);
+            else if (arg.rfind("--write-policy=",0)==0) {
+                show_traffic = true;
+                if (!parse_write_policy(arg.substr(15), write))
+                    arg_error = true;
+            }
+            else if (arg.rfind("--prefetch=",0)==0) {
+                prefetch.clear();
+                if (!parse_prefetch(arg.substr(11), prefetch))
+                    arg_error = true;
+            }
+            else if (arg.rfind("--seed=",0)==0) {
+                char *end;
+                PolicyRandom::seed = strtoull(arg.c_str() + 7, &end, 10);
+                // strtoull would take a sign or leading blanks
+                if (arg[7] < '0' || arg[7] > '9' || *end != '\0')
+                    arg_error = true;
+            }
+            else if (arg=="--sample") {
+                i++;
+                if (i>=argc || !parse_sample_config(argv[i], sampling))
+                    arg_error = true;
+            }
+            else if (arg=="--restore") {
+                i++;
+                if (i>=argc)
+                    arg_error = true;
+                else
+                    restore_file = argv[i];
+            }
             else
                 arg_error = true;
         } else {
@@ -136,448 +3396,226 @@ int main(int argc, char *argv[]) {
                 arg_error = true;
         }
     }
+    /* A replay takes the place of the program and needs a cache to drive */
+    if (replay_file != nullptr)
+        arg_error = arg_error || filename != nullptr || record_file != nullptr || cache_config.empty();
+    else if ((filename == nullptr) == (restore_file == nullptr))
+        arg_error = true;
+    /* So does a checkpoint; checkpoints are only taken of a cache simulation */
+    if (checkpoint_every != 0 || fast_forward != 0 || restore_file != nullptr)
+        arg_error = arg_error || cache_config.empty() || replay_file != nullptr || !sweep_configs.empty() ||
+            curve_assoc > 0;
+    if (!policy_fits(policy, vector<int>()))
+        arg_error = true;
+    /* The miss curve models LRU loads only */
+    if (curve_assoc > 0 && (policy != LRUPolicy::NAME || show_traffic || !prefetch.empty()))
+        arg_error = true;
+    /* Sampling runs the program its own way and prints only estimates */
+    if (sampling.interval != 0)
+        arg_error = arg_error || cache_config.empty() || replay_file != nullptr || !sweep_configs.empty() ||
+            curve_assoc > 0 || record_file != nullptr || checkpoint_every != 0 || fast_forward != 0 ||
+            restore_file != nullptr || latency.enabled() || log_mode == "binary";
     /* Display error message if appropriate */
-    if (arg_error || do_help || filename == nullptr) {
-        cerr << "usage " << argv[0] << " [-h] [--cache CACHE] filename" << endl << endl; 
+    if (arg_error || do_help) {
+        cerr << "usage " << argv[0] << " [-h] [--cache CACHE] [--log=LOG] [--sweep CONFIGS]" << endl;
+        cerr << "       [--latency=LIST] [--miss-curve A,B] [--record-trace FILE]" << endl;
+        cerr << "       [--replay-trace FILE] [--fast-forward N] [--checkpoint-every N]" << endl;
+        cerr << "       [--restore FILE] [--sample INTERVAL[,CLUSTERS[,WARMUP]]] [--policy=POLICY]" << endl;
+        cerr << "       [--seed=N] [--write-policy=WRITE] [--prefetch=LIST] [filename]" << endl << endl; 
         cerr << "Simulate E20 cache" << endl << endl;
         cerr << "positional arguments:" << endl;
-        cerr << "  filename    The file containing machine code, typically with .bin suffix" << endl<<endl;
+        cerr << "  filename    The file containing machine code, typically with .bin suffix," << endl;
+        cerr << "              either as a listing or as a binary image" << endl<<endl;
         cerr << "optional arguments:"<<endl;
         cerr << "  -h, --help  show this help message and exit"<<endl;
         cerr << "  --cache CACHE  Cache configuration: size,associativity,blocksize (for one"<<endl;
         cerr << "                 cache) or"<<endl;
         cerr << "                 size,associativity,blocksize,size,associativity,blocksize"<<endl;
-        cerr << "                 (for two caches)"<<endl;
+        cerr << "                 (for two caches), and so on for up to four levels"<<endl;
+        cerr << "  --log=LOG   What to print for every access: full (default) for the text"<<endl;
+        cerr << "              log, binary for packed records instead, summary for only the"<<endl;
+        cerr << "              counts of every level at the end, or none"<<endl;
+        cerr << "  --sweep CONFIGS  Run the program once and print hit/miss counts for every"<<endl;
+        cerr << "                 cache configuration in CONFIGS, separated by ';' or"<<endl;
+        cerr << "                 whitespace, or read from the file @FILE"<<endl;
+        cerr << "  --latency=LIST  Hit latency in cycles of every level, L1 first, then the"<<endl;
+        cerr << "                 memory latency, e.g. 1,10,100; prints the AMAT and stall"<<endl;
+        cerr << "                 cycles of the loads, and ranks the configurations of"<<endl;
+        cerr << "                 --sweep by estimated cycles"<<endl;
+        cerr << "  --miss-curve A,B  Run the program once and print the L1 misses of every"<<endl;
+        cerr << "                 power-of-two number of rows for associativity A and"<<endl;
+        cerr << "                 blocksize B"<<endl;
+        cerr << "  --record-trace FILE  Also write every memory access to FILE as a binary"<<endl;
+        cerr << "                 trace; without --cache, only the trace is written"<<endl;
+        cerr << "  --replay-trace FILE  Simulate the cache given by --cache for the accesses"<<endl;
+        cerr << "                 in the trace FILE instead of running a program"<<endl;
+        cerr << "  --fast-forward N  Run the program without caches until N instructions"<<endl;
+        cerr << "                 have been executed, then simulate the caches from there"<<endl;
+        cerr << "  --checkpoint-every N  Save the machine and the caches to a checkpoint"<<endl;
+        cerr << "                 every N instructions, replacing filename.ckpt, or FILE"<<endl;
+        cerr << "                 when restoring from it"<<endl;
+        cerr << "  --restore FILE  Resume the run saved in the checkpoint FILE instead of"<<endl;
+        cerr << "                 starting a program; its caches are restored too, if it"<<endl;
+        cerr << "                 has them"<<endl;
+        cerr << "  --sample INTERVAL[,CLUSTERS[,WARMUP]]  Estimate the counts of --cache from"<<endl;
+        cerr << "                 a sample: cut the run into intervals of INTERVAL"<<endl;
+        cerr << "                 instructions, group them into CLUSTERS phases (default 8)"<<endl;
+        cerr << "                 by their basic-block vectors, and simulate only a few"<<endl;
+        cerr << "                 intervals of each phase, after WARMUP instructions"<<endl;
+        cerr << "                 (default INTERVAL) of warmup; nothing is logged"<<endl;
+        cerr << "  --policy=POLICY  Replacement policy of every level: lru (default), plru"<<endl;
+        cerr << "                 (tree pseudo-LRU), srrip, brrip, fifo or random"<<endl;
+        cerr << "  --seed=N    Seed of the random choices of brrip and random (default 1)"<<endl;
+        cerr << "  --write-policy=WRITE  through (default) or back, optionally followed by"<<endl;
+        cerr << "                 ,allocate (default) or ,no-allocate; prints the words"<<endl;
+        cerr << "                 every level writes to the next and its writebacks"<<endl;
+        cerr << "  --prefetch=LIST  Prefetcher of every level, L1 first: none, next-line,"<<endl;
+        cerr << "                 stride or stream (stream buffers); prints their"<<endl;
+        cerr << "                 accuracy, coverage and, with --latency, timeliness"<<endl;
         return 1;
     }
     /* parse cache config */
+    vector<int> parts;
     if (cache_config.size() > 0) {
-        vector<int> parts;
-        size_t pos;
-        size_t lastpos = 0;
-        while ((pos = cache_config.find(",", lastpos)) != string::npos) {
-            parts.push_back(stoi(cache_config.substr(lastpos,pos)));
-            lastpos = pos + 1;
-        }
-        parts.push_back(stoi(cache_config.substr(lastpos)));
-        if (parts.size() == 3) {
-            int L1size = parts[0];
-            int L1assoc = parts[1];
-            int L1blocksize = parts[2];
-            int num_rows = L1size / L1assoc / L1blocksize;
-            print_cache_config("L1", L1size, L1assoc, L1blocksize, num_rows);
-            vector<LRUcache> cache;
-            for(size_t i = 0; i < num_rows; i++){
-                LRUcache row;
-                cache.push_back(row);
-            }
-
-            // TODO: execute E20 program and simulate one cache here
-            ifstream f(filename);
-            if (!f.is_open()) {
-                cerr << "Can't open file "<<filename<<endl;
-                return 1;
-            }
-            uint16_t mem[MEM_SIZE] = {0};
-            load_machine_code(f, mem);
-            uint16_t regs[NUM_REGS] = {0};
-            uint16_t pc = 0;
-            bool goahead = true;
-            while(goahead){
-                uint16_t num = mem[pc];
-                uint16_t pc_next = pc + 1;
-                uint16_t msb_mask = 0b1110000000000000;
-                uint16_t opcode = (num & msb_mask) >> 13;
-                if(opcode == 0){
-                    uint16_t imm = (num & 0b0000000000001111);
-                    uint16_t regA = (num & 0b0001110000000000) >> 10;
-                    uint16_t regB = (num & 0b0000001110000000) >> 7;
-                    uint16_t dst = (num & 0b0000000001110000) >> 4;
-                    if(imm == 0){ // opcode = add
-                        regs[dst] = (dst == 0 ? 0 : regs[regA] + regs[regB]);
-                    }
-                    else if(imm == 1){ //opcode = sub
-                        regs[dst] = (dst == 0 ? 0 : regs[regA] - regs[regB]);
-                    }
-                    else if(imm == 2){ //opcode = or
-                        regs[dst] = (dst == 0 ? 0 : regs[regA] | regs[regB]);
-                    }
-                    else if(imm == 3){ //opcode = and
-                        regs[dst] = (dst == 0 ? 0 : regs[regA] & regs[regB]);
-                    }
-                    else if (imm  == 4){ //opcode = slt
-                        uint16_t regsrcA = regs[regA];
-                        uint16_t regsrcB = regs[regB];
-                        regs[dst] = dst == 0 ? 0 :(regsrcA < regsrcB ? 1 : 0);
-                    }
-                    else if(imm == 8){ //opcode = jr
-                        pc_next = isoverflow(regs[regA]);
-                    }
-                }
-                else if(opcode == 7){ //opcode = slti
-                    uint16_t imm = (num & 0b0000000001111111);
-                    uint16_t regSrc = (num & 0b0001110000000000) >> 10;
-                    uint16_t regDst = (num & 0b0000001110000000) >> 7;
-                    uint16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-                    uint16_t regsrc = regs[regSrc];
-                    regs[regDst] = regDst == 0 ? 0 :(regsrc < sign_extended ? 1 : 0);
-                }
-                else if(opcode == 4){ //opcode = lw
-                    uint16_t imm = (num & 0b0000000001111111);
-                    int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-                    uint16_t Add = (num & 0b0001110000000000) >> 10;
-                    uint16_t regDst = (num & 0b0000001110000000) >> 7;
-                    // regs[regDst] = (regDst == 0)? 0 : mem[isoverflow(regs[Add] + sign_extended)];
-                    int addr = isoverflow(regs[Add] + sign_extended);
-                    string status = "";
-                    int blockid = addr / L1blocksize;
-                    int row_num = blockid % num_rows;
-                    int tag = blockid / num_rows;
-                    if(cache[row_num].block.find(tag) != cache[row_num].block.end()){
-                        status = "HIT";
-                        // find the iterator pointing to the value in the list
-                        auto it = find(cache[row_num].m_list.begin(), cache[row_num].m_list.end(), tag); 
-                        // put it to the front of the list recording implementation of this row
-                        cache[row_num].m_list.splice(cache[row_num].m_list.begin(), cache[row_num].m_list, it);
-                    }
-                    else{
-                        status = "MISS";
-                        if(cache[row_num].block.size() == L1assoc){
-                            int replaced_tag = cache[row_num].m_list.back();
-                            cache[row_num].block.erase(replaced_tag);
-                            cache[row_num].m_list.pop_back();
-
-                        }
-                        vector<uint16_t> load;
-                        size_t start = blockid * L1blocksize;
-                        size_t end = blockid * L1blocksize + L1blocksize;
-                        for(size_t i = start; i < end; i++){
-                            load.push_back(mem[i]);
-                        }
-                        cache[row_num].block.insert({tag, load});
-                        cache[row_num].m_list.push_front(tag);
-                    }
-                    int offset = addr & (L1blocksize - 1);
-                    regs[regDst] = (regDst == 0)? 0 : cache[row_num].block.at(tag)[offset];
-                    print_log_entry("L1", status, pc, addr, row_num);      
-                }
-                else if(opcode == 5){ //opcode = sw
-                    uint16_t src = (num & 0b0000001110000000)>>7;
-                    uint16_t Add = (num & 0b0001110000000000) >> 10;
-                    uint16_t imm = (num & 0b0000000001111111);
-                    int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-                    // mem[(isoverflow(sign_extended + regs[Add]))] = regs[src];
-
-                    string status = "SW";
-                    int addr = isoverflow(sign_extended + regs[Add]);
-                    mem[addr] = regs[src];
-                    int blockid = addr / L1blocksize;
-                    int row_num = blockid % num_rows;
-                    int tag = blockid / num_rows;
-                    if(cache[row_num].block.find(tag) != cache[row_num].block.end()){
-                        int offset = addr & (L1blocksize - 1);
-                        cache[row_num].block.at(tag)[offset] = mem[addr];
-                        auto it = find(cache[row_num].m_list.begin(), cache[row_num].m_list.end(), tag); 
-                        cache[row_num].m_list.splice(cache[row_num].m_list.begin(), cache[row_num].m_list, it);
-                    }
-                    else{
-                        if(cache[row_num].block.size() == L1assoc){
-                            int replaced_tag = cache[row_num].m_list.back();
-                            cache[row_num].block.erase(replaced_tag);
-                            cache[row_num].m_list.pop_back();
-                        }
-                        vector<uint16_t> load;
-                        size_t start = blockid * L1blocksize;
-                        size_t end = blockid * L1blocksize + L1blocksize;
-                        for(size_t i = start; i < end; i++){
-                            load.push_back(mem[i]);
-                        }
-                        cache[row_num].block.insert({tag, load});
-                        cache[row_num].m_list.push_front(tag);
-                    }
-                    print_log_entry("L1", status, pc, addr, row_num);
-                }
-                else if(opcode == 1){ // opcode = addi
-                    uint16_t src = (num & 0b0001110000000000) >> 10;
-                    uint16_t dst = (num & 0b0000001110000000) >> 7;
-                    uint16_t imm = (num & 0b0000000001111111);
-                    int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-                    regs[dst] = dst == 0 ? 0 : regs[src] + sign_extended;
-                }
-                else if (opcode == 2){ // opcode = j
-                    uint16_t address = isoverflow(num & 0b0001111111111111);
-                    pc_next = (address & 0b0001111111111111);
-                }
-                else if (opcode == 3) { //opcode = jal
-                    regs[7] = pc_next;
-                    pc_next = isoverflow(num & 0b0001111111111111);
-                }
-                else if (opcode == 6) { //opcode = jeq
-                    uint16_t regA = (num & 0b0001110000000000) >> 10;
-                    uint16_t regB = (num & 0b0000001110000000) >> 7;
-                    if(regs[regA] == regs[regB]){
-                        uint16_t rel_imm = (num & 0b0000000001111111);
-                        int16_t sign_extended = (rel_imm & 0x40) ? (rel_imm | 0xFF80) : rel_imm;
-                        pc_next += sign_extended;
-                    }
-                }
-
-                if(pc_next == pc){
-                    goahead = false;
-                }
-                else {
-                    pc = isoverflow(pc_next);
-                }
-            }
-
-        // L1 and L2 caches
-        } else if (parts.size() == 6) {
-            int L1size = parts[0];
-            int L1assoc = parts[1];
-            int L1blocksize = parts[2];
-            int L2size = parts[3];
-            int L2assoc = parts[4];
-            int L2blocksize = parts[5];
-            int num_rows_1 = L1size / L1assoc / L1blocksize;
-            int num_rows_2 = L2size / L2assoc / L2blocksize;
-            print_cache_config("L1", L1size, L1assoc, L1blocksize, num_rows_1);
-            print_cache_config("L2", L2size, L2assoc, L2blocksize, num_rows_2);
-            vector<LRUcache> cache1;
-            vector<LRUcache> cache2;
-            for(size_t i = 0; i < num_rows_1; i++){
-                LRUcache row;
-                cache1.push_back(row);
-            }
-            for(size_t i = 0; i < num_rows_2; i++){
-                LRUcache row;
-                cache2.push_back(row);
-            }
-
-            // TODO: execute E20 program and simulate two caches here
-            ifstream f(filename);
-            if (!f.is_open()) {
-                cerr << "Can't open file "<<filename<<endl;
-                return 1;
-            }
-            // TODO: your code here. Load f and parse using load_machine_code
-            uint16_t mem[MEM_SIZE] = {0};
-            load_machine_code(f, mem);
-
-            // TODO: your code here. Do simulation.
-            uint16_t regs[NUM_REGS] = {0};
-            uint16_t pc = 0;
-            bool goahead = true;
-            while(goahead){
-                uint16_t num = mem[pc];
-                uint16_t pc_next = pc + 1;
-                uint16_t msb_mask = 0b1110000000000000;
-                uint16_t opcode = (num & msb_mask) >> 13;
-                if(opcode == 0){
-                    uint16_t imm = (num & 0b0000000000001111);
-                    uint16_t regA = (num & 0b0001110000000000) >> 10;
-                    uint16_t regB = (num & 0b0000001110000000) >> 7;
-                    uint16_t dst = (num & 0b0000000001110000) >> 4;
-                    if(imm == 0){ // opcode = add
-                        regs[dst] = (dst == 0 ? 0 : regs[regA] + regs[regB]);
-                    }
-                    else if(imm == 1){ //opcode = sub
-                        regs[dst] = (dst == 0 ? 0 : regs[regA] - regs[regB]);
-                    }
-                    else if(imm == 2){ //opcode = or
-                        regs[dst] = (dst == 0 ? 0 : regs[regA] | regs[regB]);
-                    }
-                    else if(imm == 3){ //opcode = and
-                        regs[dst] = (dst == 0 ? 0 : regs[regA] & regs[regB]);
-                    }
-                    else if (imm  == 4){ //opcode = slt
-                        uint16_t regsrcA = regs[regA];
-                        uint16_t regsrcB = regs[regB];
-                        regs[dst] = dst == 0 ? 0 :(regsrcA < regsrcB ? 1 : 0);
-                    }
-                    else if(imm == 8){ //opcode = jr
-                        pc_next = isoverflow(regs[regA]);
-                    }
-                }
-                else if(opcode == 7){ //opcode = slti
-                    uint16_t imm = (num & 0b0000000001111111);
-                    uint16_t regSrc = (num & 0b0001110000000000) >> 10;
-                    uint16_t regDst = (num & 0b0000001110000000) >> 7;
-                    uint16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-                    uint16_t regsrc = regs[regSrc];
-                    regs[regDst] = regDst == 0 ? 0 :(regsrc < sign_extended ? 1 : 0);
-                }
-                else if(opcode == 4){ //opcode = lw
-                    uint16_t imm = (num & 0b0000000001111111);
-                    int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-                    uint16_t Add = (num & 0b0001110000000000) >> 10;
-                    uint16_t regDst = (num & 0b0000001110000000) >> 7;
-                    // regs[regDst] = (regDst == 0)? 0 : mem[isoverflow(regs[Add] + sign_extended)];
-                    int addr = isoverflow(regs[Add] + sign_extended);
-                    int blockid_1 = addr / L1blocksize;
-                    int row_num_1 = blockid_1 % num_rows_1;
-                    int tag_1 = blockid_1 / num_rows_1;
-                    string status_1 = "";
-                    string status_2 = "";
-                    // L1 HIT
-                    if(cache1[row_num_1].block.find(tag_1) != cache1[row_num_1].block.end()){
-                        status_1 = "HIT";
-                        // find the iterator pointing to the value in the list
-                        auto it = find(cache1[row_num_1].m_list.begin(), cache1[row_num_1].m_list.end(), tag_1); 
-                        // put it to the front of the list recording implementation of this row
-                        cache1[row_num_1].m_list.splice(cache1[row_num_1].m_list.begin(), cache1[row_num_1].m_list, it);
-                        print_log_entry("L1", status_1, pc, addr, row_num_1);
-                    }
-                    else{
-                        status_1 = "MISS";
-                        int blockid_2 = addr / L2blocksize;
-                        int row_num_2 = blockid_2 % num_rows_2;
-                        int tag_2 = blockid_2 / num_rows_2;
-                        // find in L2 cache
-                        if(cache2[row_num_2].block.find(tag_2) != cache2[row_num_2].block.end()){
-                            status_2 = "HIT";
-
-                        }
-                        // L1 & L2 both miss
-                        else{
-                            status_2 = "MISS";
-                            if(cache2[row_num_2].block.size() == L2assoc){
-                                int replaced_tag_2 = cache2[row_num_2].m_list.back();
-                                cache2[row_num_2].block.erase(replaced_tag_2);
-                                cache2[row_num_2].m_list.pop_back();
-                            }
-                            vector<uint16_t> load_2;
-                            size_t start_2 = blockid_2 * L2blocksize;
-                            size_t end_2 = blockid_2 * L2blocksize + L2blocksize;
-                            for(size_t i = start_2; i < end_2; i++){
-                                load_2.push_back(mem[i]);
-                            }
-                            cache2[row_num_2].block.insert({tag_2, load_2});
-                            cache2[row_num_2].m_list.push_front(tag_2);
-                        }
-                        // store in L1
-                        if(cache1[row_num_1].block.size() == L1assoc){
-                            int replaced_tag_1 = cache1[row_num_1].m_list.back();
-                            cache1[row_num_1].block.erase(replaced_tag_1);
-                            cache1[row_num_1].m_list.pop_back();
-                        }
-                        vector<uint16_t> load_1;
-                        size_t start = blockid_1 * L1blocksize;
-                        size_t end = blockid_1 * L1blocksize + L1blocksize;
-                        for(size_t i = start; i < end; i++){
-                            load_1.push_back(mem[i]);
-                        }
-                        cache1[row_num_1].block.insert({tag_1, load_1});
-                        cache1[row_num_1].m_list.push_front(tag_1);
-                        print_log_entry("L1", status_1, pc, addr, row_num_1);
-                        print_log_entry("L2", status_2, pc, addr, row_num_2);
-                    }
-                    int offset = addr & (L1blocksize - 1);
-                    regs[regDst] = (regDst == 0)? 0 : cache1[row_num_1].block.at(tag_1)[offset];
-                }
-                else if(opcode == 5){ //opcode = sw
-                    uint16_t src = (num & 0b0000001110000000)>>7;
-                    uint16_t Add = (num & 0b0001110000000000) >> 10;
-                    uint16_t imm = (num & 0b0000000001111111);
-                    int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-                    // mem[(isoverflow(sign_extended + regs[Add]))] = regs[src];
-
-                    int addr = isoverflow(sign_extended + regs[Add]);
-                    mem[addr] = regs[src];
-                    string status_1 = "SW";
-                    string status_2 = "SW";
-                    // modify L1
-                    int blockid_1 = addr / L1blocksize;
-                    int row_num_1 = blockid_1 % num_rows_1;
-                    int tag_1 = blockid_1 / num_rows_1;
-                    if(cache1[row_num_1].block.find(tag_1) != cache1[row_num_1].block.end()){
-                        int offset = addr & (L1blocksize - 1);
-                        cache1[row_num_1].block.at(tag_1)[offset] = mem[addr];
-                        auto it = find(cache1[row_num_1].m_list.begin(), cache1[row_num_1].m_list.end(), tag_1); 
-                        cache1[row_num_1].m_list.splice(cache1[row_num_1].m_list.begin(), cache1[row_num_1].m_list, it);
-                    }
-                    else{
-                        if(cache1[row_num_1].block.size() == L1assoc){
-                            int replaced_tag = cache1[row_num_1].m_list.back();
-                            cache1[row_num_1].block.erase(replaced_tag);
-                            cache1[row_num_1].m_list.pop_back();
-                        }
-                        vector<uint16_t> load1;
-                        size_t start = blockid_1 * L1blocksize;
-                        size_t end = blockid_1 * L1blocksize + L1blocksize;
-                        for(size_t i = start; i < end; i++){
-                            load1.push_back(mem[i]);
-                        }
-                        cache1[row_num_1].block.insert({tag_1, load1});
-                        cache1[row_num_1].m_list.push_front(tag_1);
-                    }
-                    // modify L2
-                    int blockid_2 = addr / L2blocksize;
-                    int row_num_2 = blockid_2 % num_rows_2;
-                    int tag_2 = blockid_2 / num_rows_2;
-                    if(cache2[row_num_2].block.find(tag_2) != cache2[row_num_2].block.end()){
-                        int offset = addr & (L2blocksize - 1);
-                        cache2[row_num_2].block.at(tag_2)[offset] = mem[addr];
-                        auto it = find(cache2[row_num_2].m_list.begin(), cache2[row_num_2].m_list.end(), tag_2); 
-                        cache2[row_num_2].m_list.splice(cache2[row_num_2].m_list.begin(), cache2[row_num_2].m_list, it);
-                    }
-                    else{
-                        if(cache2[row_num_2].block.size() == L2assoc){
-                            int replaced_tag = cache2[row_num_2].m_list.back();
-                            cache2[row_num_2].block.erase(replaced_tag);
-                            cache2[row_num_2].m_list.pop_back();
-                        }
-                        vector<uint16_t> load2;
-                        size_t start = blockid_2 * L2blocksize;
-                        size_t end = blockid_2 * L2blocksize + L2blocksize;
-                        for(size_t i = start; i < end; i++){
-                            load2.push_back(mem[i]);
-                        }
-                        cache2[row_num_2].block.insert({tag_2, load2});
-                        cache2[row_num_2].m_list.push_front(tag_2);
-                    }
-                    print_log_entry("L1", status_1, pc, addr, row_num_1);
-                    print_log_entry("L2", status_2, pc, addr, row_num_2);
-
-
-                }
-                else if(opcode == 1){ // opcode = addi
-                    uint16_t src = (num & 0b0001110000000000) >> 10;
-                    uint16_t dst = (num & 0b0000001110000000) >> 7;
-                    uint16_t imm = (num & 0b0000000001111111);
-                    int16_t sign_extended = (imm & 0x40) ? (imm | 0xFF80) : imm;
-                    regs[dst] = dst == 0 ? 0 : regs[src] + sign_extended;
-                }
-                else if (opcode == 2){ // opcode = j
-                    uint16_t address = isoverflow(num & 0b0001111111111111);
-                    pc_next = (address & 0b0001111111111111);
-                }
-                else if (opcode == 3) { //opcode = jal
-                    regs[7] = pc_next;
-                    pc_next = isoverflow(num & 0b0001111111111111);
-                }
-                else if (opcode == 6) { //opcode = jeq
-                    uint16_t regA = (num & 0b0001110000000000) >> 10;
-                    uint16_t regB = (num & 0b0000001110000000) >> 7;
-                    if(regs[regA] == regs[regB]){
-                        uint16_t rel_imm = (num & 0b0000000001111111);
-                        int16_t sign_extended = (rel_imm & 0x40) ? (rel_imm | 0xFF80) : rel_imm;
-                        pc_next += sign_extended;
-                    }
-                }
+        parts = parse_cache_config(cache_config);
+        if (parts.empty()) {
+            cerr << "Invalid cache config"  << endl;
+            return 1;
+        }
+        if (!policy_fits(policy, parts)) {
+            cerr << "Policy " << policy << " needs a power-of-two associativity" << endl;
+            return 1;
+        }
+        if (latency.enabled() && parts.size() / 3 > latency.hit.size()) {
+            cerr << "No latency for every cache level" << endl;
+            return 1;
+        }
+        if (prefetch.size() > parts.size() / 3) {
+            cerr << "More prefetchers than cache levels" << endl;
+            return 1;
+        }
+    }
+    unique_ptr<LogWriter> log;
+    if (log_mode == "full")
+        log.reset(new LogWriter(LogWriter::TEXT));
+    else if (log_mode == "binary") {
+        log.reset(new LogWriter(LogWriter::BINARY));
+        log->header(parts);
+    }
+    vector<LevelStats> stats;
+    CacheTiming timing;
+    if (replay_file != nullptr) {
+        if (log_mode != "binary") {
+            print_cache_configs(parts, policy);
+            if (show_traffic)
+                print_write_policy(write);
+            if (!prefetch.empty())
+                print_prefetchers(prefetch);
+            if (latency.enabled())
+                print_latency(latency, parts.size() / 3);
+        }
+        if (!replay_trace(replay_file, parts, log.get(), latency, policy, write, prefetch, stats, timing))
+            return 1;
+        log.reset();
+        if (log_mode == "summary") {
+            print_stats_header();
+            print_stats(cache_config, stats);
+        }
+        if (latency.enabled() && log_mode != "binary")
+            print_timing(timing);
+        if (show_traffic && log_mode != "binary")
+            print_traffic(stats);
+        if (!prefetch.empty() && log_mode != "binary")
+            print_prefetch(stats, prefetch, latency.enabled());
+        return 0;
+    }
 
-                if(pc_next == pc){
-                    goahead = false;
-                }
-                else {
-                    pc = isoverflow(pc_next);
-                }
-            }
+    static uint16_t mem[MEM_SIZE];
+    Checkpoint state;
+    if (restore_file != nullptr) {
+        if (!load_checkpoint(restore_file, state, mem)) {
+            cerr << "Can't restore checkpoint "<<restore_file<<endl;
+            return 1;
+        }
+    } else if (!load_image(filename, mem, state.pc)) {
+        cerr << "Can't open file "<<filename<<endl;
+        return 1;
+    }
+    uint16_t pc = state.pc;
+    uint16_t regs[NUM_REGS] = {0};
+    if (!sweep_configs.empty()) {
+        sweep(sweep_configs, mem, pc, latency, policy, write, show_traffic, prefetch);
+        return 0;
+    }
+    if (sampling.interval != 0) {
+        print_cache_configs(parts, policy);
+        if (show_traffic)
+            print_write_policy(write);
+        if (!prefetch.empty())
+            print_prefetchers(prefetch);
+        with_cache(policy, parts.size() / 3, [&](auto replacement, auto levels) {
+            sample<decltype(replacement), decltype(levels)::value>(parts, cache_config, mem, pc, sampling,
+                                                                   write, show_traffic, prefetch);
+        });
+        return 0;
+    }
+    if (curve_assoc > 0) {
+        MissCurve curve(mem, curve_assoc, curve_blocksize);
+        execute(mem, regs, pc, curve);
+        curve.print();
+        return 0;
+    }
 
-        } else {
-            cerr << "Invalid cache config"  << endl;
+    unique_ptr<TraceWriter> trace;
+    if (record_file != nullptr)
+        trace.reset(new TraceWriter(record_file));
+    if (cache_config.size() > 0) {
+        if (fast_forward > state.instructions) {
+            // Saved caches would miss the stores made on the way
+            state.levels = 0;
+            state.caches.clear();
+            FlatMemory memory{mem};
+            state.halted = execute(mem, state.regs, state.pc, memory, state.instructions, fast_forward);
+        }
+        string checkpoint_file = restore_file != nullptr ? restore_file : string(filename) + ".ckpt";
+        if (log_mode != "binary") {
+            print_cache_configs(parts, policy);
+            if (show_traffic)
+                print_write_policy(write);
+            if (!prefetch.empty())
+                print_prefetchers(prefetch);
+            if (latency.enabled())
+                print_latency(latency, parts.size() / 3);
+        }
+        with_cache(policy, parts.size() / 3, [&](auto replacement, auto levels) {
+            stats = simulate<decltype(replacement), decltype(levels)::value>(
+                parts, mem, state, log.get(), trace.get(), latency, write, prefetch, timing, checkpoint_every,
+                checkpoint_file);
+        });
+        log.reset();
+        if (log_mode == "summary") {
+            print_stats_header();
+            print_stats(cache_config, stats);
+        }
+        if (latency.enabled() && log_mode != "binary")
+            print_timing(timing);
+        if (show_traffic && log_mode != "binary")
+            print_traffic(stats);
+        if (!prefetch.empty() && log_mode != "binary")
+            print_prefetch(stats, prefetch, latency.enabled());
+    } else if (trace) {
+        FlatMemory memory{mem};
+        TracedMemory<FlatMemory> traced(memory, *trace);
+        execute(mem, regs, pc, traced);
+    }
+    if (trace) {
+        trace->flush();
+        if (!trace->good()) {
+            cerr << "Can't write trace file "<<record_file<<endl;
             return 1;
         }
     }
     return 0;
 }
+#endif
 //ra0Eequ6ucie6Jei0koh6phishohm9
\ No newline at end of file